@@ -0,0 +1,319 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "auth.h"
+#include "irc.h"
+
+struct auth_entry {
+    char nick[AUTH_NAME_MAX];    // Empty if the slot is free.
+    char account[AUTH_NAME_MAX]; // Empty if not logged in.
+    long long expires;           // On the monotonic clock, in seconds.
+};
+
+// A check waiting on a WHOIS. Only the first for a nick sends one.
+struct auth_wait {
+    struct auth_wait *next;
+    char nick[AUTH_NAME_MAX];
+    char account[AUTH_NAME_MAX]; // Filled in by auth_whois_account().
+    bool unknown;                // Identified to some account, per 307.
+    auth_cb cb;
+    void *data;
+    struct auth *auth;
+    struct ircconn *conn;
+    struct irctimer timeout;
+};
+
+static long long
+now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static uint32_t
+hash_nick(const char *nick)
+{
+    uint32_t h = 2166136261u;
+    for (; *nick; ++nick) {
+        h ^= (unsigned char) irc_fold(*nick);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// The entry for |nick| that is still live at |now|, or NULL.
+static struct auth_entry *
+find_entry_at(struct auth *auth, const char *nick, long long now)
+{
+    if (!auth->cache)
+        return NULL;
+
+    uint32_t base = hash_nick(nick);
+    for (int i = 0; i < AUTH_PROBE; ++i) {
+        struct auth_entry *e = &auth->cache[(base + i) & (AUTH_CACHE_SLOTS - 1)];
+        if (e->nick[0] && e->expires > now && irc_name_equal(e->nick, nick))
+            return e;
+    }
+    return NULL;
+}
+
+static struct auth_entry *
+find_entry(struct auth *auth, const char *nick)
+{
+    return find_entry_at(auth, nick, now_s());
+}
+
+// Caches |account| (or "" if not logged in) for |nick|.
+static void
+store(struct auth *auth, const char *nick, const char *account)
+{
+    if (auth->closed || strlen(nick) >= AUTH_NAME_MAX || strlen(account) >= AUTH_NAME_MAX)
+        return;
+    if (!auth->cache && !(auth->cache = calloc(AUTH_CACHE_SLOTS, sizeof *auth->cache)))
+        return;
+
+    // Reuse the nick's own slot if it has one, or else the slot that has
+    // expired or will expire soonest.
+    long long now = now_s();
+    uint32_t base = hash_nick(nick);
+    struct auth_entry *slot = NULL;
+    for (int i = 0; i < AUTH_PROBE; ++i) {
+        struct auth_entry *e = &auth->cache[(base + i) & (AUTH_CACHE_SLOTS - 1)];
+        if (e->nick[0] && irc_name_equal(e->nick, nick)) {
+            slot = e;
+            break;
+        }
+        if (!slot || e->expires < slot->expires)
+            slot = e;
+    }
+
+    strcpy(slot->nick, nick);
+    strcpy(slot->account, account);
+    slot->expires = now + (account[0] ? AUTH_TTL : AUTH_NEGATIVE_TTL);
+}
+
+void
+auth_init(struct auth *auth)
+{
+    memset(auth, 0, sizeof *auth);
+}
+
+// The server never finished the WHOIS in time for this check. Don't guess,
+// and don't cache. Later checks on the same nick keep their own deadlines,
+// with a WHOIS of their own in case this one was lost.
+static void
+whois_timeout(struct irctimer *timer)
+{
+    struct auth_wait *wait = timer->data;
+    struct auth *auth = wait->auth;
+    struct ircconn *conn = wait->conn;
+
+    bool others = false;
+    struct auth_wait **link = &auth->waiting;
+    while (*link) {
+        if (*link == wait) {
+            *link = wait->next;
+            continue;
+        }
+        others = others || irc_name_equal((*link)->nick, wait->nick);
+        link = &(*link)->next;
+    }
+    auth->nwaiting--;
+
+    if (others)
+        irc_send(conn, "WHOIS %s\r\n", wait->nick);
+    wait->cb(conn, wait->nick, NULL, wait->data);
+    free(wait);
+}
+
+void
+auth_free(struct auth *auth)
+{
+    struct auth_wait *wait = auth->waiting;
+    while (wait) {
+        struct auth_wait *next = wait->next;
+        ircloop_cancel(wait->conn->loop, &wait->timeout);
+        wait->cb(NULL, wait->nick, NULL, wait->data);
+        free(wait);
+        wait = next;
+    }
+    free(auth->cache);
+    auth_init(auth);
+    auth->closed = true;
+}
+
+bool
+auth_check(struct auth *auth, struct ircconn *conn, struct ircmsg_privmsg *msg,
+           auth_cb cb, void *data)
+{
+    const char *nick = msg->name.nick.s;
+    if (auth->closed)
+        return false;
+
+    // The tag is authoritative, and its absence means "not logged in".
+    if (conn->caps & IRCCAP_ACCOUNT_TAG) {
+        const char *account = msg->account.len > 0 ? msg->account.s : NULL;
+        auth_learn(auth, nick, account);
+        cb(conn, nick, account, data);
+        return true;
+    }
+
+    // Nicks that can't be cached can't be checked, either.
+    if (strlen(nick) >= AUTH_NAME_MAX) {
+        cb(conn, nick, NULL, data);
+        return true;
+    }
+
+    struct auth_entry *e = find_entry(auth, nick);
+    if (e) {
+        cb(conn, nick, e->account[0] ? e->account : NULL, data);
+        return true;
+    }
+
+    if (auth->nwaiting >= AUTH_MAX_WAITING)
+        return false;
+    struct auth_wait *wait = calloc(1, sizeof *wait);
+    if (!wait)
+        return false;
+
+    bool asked = false;
+    struct auth_wait **tail = &auth->waiting;
+    for (; *tail; tail = &(*tail)->next)
+        asked = asked || irc_name_equal((*tail)->nick, nick);
+    if (!asked && !irc_send(conn, "WHOIS %s\r\n", nick)) {
+        free(wait);
+        return false;
+    }
+
+    strcpy(wait->nick, nick);
+    wait->cb = cb;
+    wait->data = data;
+    wait->auth = auth;
+    wait->conn = conn;
+    irctimer_init(&wait->timeout, whois_timeout, wait);
+    ircloop_schedule(conn->loop, &wait->timeout, AUTH_WHOIS_TIMEOUT_MS);
+    *tail = wait;
+    auth->nwaiting++;
+    return true;
+}
+
+void
+auth_learn(struct auth *auth, const char *nick, const char *account)
+{
+    store(auth, nick, account && strcmp(account, "*") != 0 ? account : "");
+}
+
+void
+auth_forget(struct auth *auth, const char *nick)
+{
+    struct auth_entry *e = find_entry(auth, nick);
+    if (e)
+        e->nick[0] = '\0';
+}
+
+void
+auth_forget_many(struct auth *auth, const char **nicks, int n)
+{
+    if (!auth->cache)
+        return;
+
+    // The clock is read once for the lot.
+    long long now = now_s();
+    for (int i = 0; i < n; ++i) {
+        struct auth_entry *e = find_entry_at(auth, nicks[i], now);
+        if (e)
+            e->nick[0] = '\0';
+    }
+}
+
+void
+auth_whois_account(struct auth *auth, const char *nick, const char *account)
+{
+    if (strlen(account) >= AUTH_NAME_MAX)
+        return;
+    for (struct auth_wait *wait = auth->waiting; wait; wait = wait->next) {
+        if (irc_name_equal(wait->nick, nick))
+            strcpy(wait->account, account);
+    }
+}
+
+void
+auth_whois_regnick(struct auth *auth, const char *nick)
+{
+    for (struct auth_wait *wait = auth->waiting; wait; wait = wait->next) {
+        if (irc_name_equal(wait->nick, nick))
+            wait->unknown = true;
+    }
+}
+
+// Answers every check waiting on |nick|'s WHOIS.
+static void
+answer(struct auth *auth, struct ircconn *conn, const char *nick)
+{
+    // Unlink the answered checks first, so callbacks may start new ones.
+    struct auth_wait *answered = NULL;
+    struct auth_wait **link = &auth->waiting;
+    while (*link) {
+        struct auth_wait *wait = *link;
+        if (irc_name_equal(wait->nick, nick)) {
+            *link = wait->next;
+            ircloop_cancel(conn->loop, &wait->timeout);
+            wait->next = answered;
+            answered = wait;
+            auth->nwaiting--;
+        } else {
+            link = &wait->next;
+        }
+    }
+    if (!answered)
+        return;
+
+    if (answered->account[0] || !answered->unknown)
+        store(auth, answered->nick, answered->account);
+
+    // |answered| is newest first; answer in the order the checks came.
+    struct auth_wait *ordered = NULL;
+    while (answered) {
+        struct auth_wait *next = answered->next;
+        answered->next = ordered;
+        ordered = answered;
+        answered = next;
+    }
+    while (ordered) {
+        struct auth_wait *next = ordered->next;
+        ordered->cb(conn, ordered->nick, ordered->account[0] ? ordered->account : NULL,
+                    ordered->data);
+        free(ordered);
+        ordered = next;
+    }
+}
+
+void
+auth_whois_end(struct auth *auth, struct ircconn *conn, const char *nick)
+{
+    answer(auth, conn, nick);
+}
@@ -0,0 +1,97 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Which services account each nick is logged in to, for deciding who may
+// record PRs. With the account-tag capability, every message says which
+// account sent it, so checks cost nothing. Otherwise the answer comes from a
+// WHOIS and is cached by nick for a while. NICK, QUIT, account-notify and
+// extended-join keep the cache honest in the meantime.
+
+#include <stdbool.h>
+
+#include "irc.h"
+
+#ifndef prbot_auth_h__
+#define prbot_auth_h__
+
+// The cache: a fixed table, where each nick may live in any of AUTH_PROBE
+// slots from its hash. A full neighborhood loses its soonest-to-expire entry.
+#define AUTH_CACHE_SLOTS 1024 // Must be a power of two.
+#define AUTH_PROBE 8
+
+// Longest nick or account that is checked at all, including the null-terminator.
+#define AUTH_NAME_MAX 64
+
+// How long answers are trusted, in seconds. "Not logged in" expires sooner,
+// since that is what changes when someone identifies.
+#define AUTH_TTL 600
+#define AUTH_NEGATIVE_TTL 60
+
+// Most checks that may wait on a WHOIS at once.
+#define AUTH_MAX_WAITING 64
+
+// Checks whose WHOIS has not ended after this many milliseconds are answered
+// with "not logged in".
+#define AUTH_WHOIS_TIMEOUT_MS 10000
+
+struct auth_entry;
+struct auth_wait;
+
+struct auth {
+    struct auth_entry *cache; // AUTH_CACHE_SLOTS entries, allocated on first use.
+    struct auth_wait *waiting;
+    int nwaiting;
+    bool closed; // Freed: nothing is cached or checked until the next init.
+};
+
+// Called once a check is answered, with the account |nick| is logged in to,
+// or NULL if none. |conn| is NULL if the check was abandoned, e.g. on a
+// disconnect; then there is only cleaning up left to do.
+typedef void (*auth_cb)(struct ircconn *conn, const char *nick, const char *account,
+                        void *data);
+
+void auth_init(struct auth *auth);
+
+// Forgets everything, abandoning any checks still waiting. Until auth_init()
+// is called again, nothing is cached and every check is refused.
+void auth_free(struct auth *auth);
+
+// Looks up the account of |msg|'s sender, calling |cb| right away if the
+// message's tags or the cache know it, or else once a WHOIS comes back.
+// Returns false without calling |cb| if too many checks are waiting, or
+// after auth_free().
+bool auth_check(struct auth *auth, struct ircconn *conn, struct ircmsg_privmsg *msg,
+                auth_cb cb, void *data);
+
+// What the protocol says in passing. An |account| of NULL or "*" means the
+// nick is not logged in. auth_forget() is for NICK and QUIT.
+void auth_learn(struct auth *auth, const char *nick, const char *account);
+void auth_forget(struct auth *auth, const char *nick);
+void auth_forget_many(struct auth *auth, const char **nicks, int n); // A netsplit's QUITs.
+
+// WHOIS replies: 330 names the account, and 318 (or 401) ends the reply and
+// answers the waiting checks. 307 only says that the nick is identified, not
+// to which account, so a reply with 307 and no 330 is answered "not logged
+// in" without being cached.
+void auth_whois_account(struct auth *auth, const char *nick, const char *account);
+void auth_whois_regnick(struct auth *auth, const char *nick);
+void auth_whois_end(struct auth *auth, struct ircconn *conn, const char *nick);
+
+#endif // prbot_auth_h__
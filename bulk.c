@@ -0,0 +1,552 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "bulk.h"
+#include "db.h"
+#include "lifts.h"
+#include "parse.h"
+
+// Bad rows past this many are counted, but not reported one by one.
+#define BULK_MAX_REPORTS 100
+
+// A field of the current line, unescaped in place. Not null-terminated.
+struct field {
+    char *s;
+    int len;
+};
+
+// The fields of a row, whichever format it came in.
+struct row {
+    struct field nick;
+    struct field lift;
+    struct field date;
+    struct field sets;
+    struct field reps;
+    struct field weight; // With or without a unit.
+    struct field kgs;    // JSON only: plain numbers.
+    struct field lbs;
+};
+
+enum bulk_format
+bulk_format_for(const char *filename)
+{
+    const char *dot = strrchr(filename, '.');
+    if (dot && (strcasecmp(dot, ".jsonl") == 0 || strcasecmp(dot, ".json") == 0))
+        return BULK_JSONL;
+    return BULK_CSV;
+}
+
+// Copies |f| into |buf| as a string, if it fits.
+static bool
+field_str(const struct field *f, char *buf, int size)
+{
+    if (!f->s || f->len >= size)
+        return false;
+    memcpy(buf, f->s, f->len);
+    buf[f->len] = '\0';
+    return true;
+}
+
+static bool
+field_count(const struct field *f, int *out)
+{
+    char buf[16];
+    char *p = buf;
+    return field_str(f, buf, sizeof buf) && parse_count(&p, out) && *p == '\0';
+}
+
+// A plain, positive, finite number.
+static bool
+field_number(const struct field *f, double *out)
+{
+    char buf[32];
+    if (!field_str(f, buf, sizeof buf) || buf[0] == '\0')
+        return false;
+
+    char *end;
+    errno = 0;
+    double n = strtod(buf, &end);
+    if (errno || *end != '\0' || !isfinite(n) || n <= 0)
+        return false;
+    *out = n;
+    return true;
+}
+
+// Reads a Unix time, or "YYYY-MM-DD" with an optional "THH:MM:SS[Z]", as UTC.
+static bool
+field_date(const struct field *f, time_t *out)
+{
+    char buf[32];
+    if (!field_str(f, buf, sizeof buf) || buf[0] == '\0')
+        return false;
+
+    char *end;
+    errno = 0;
+    long long secs = strtoll(buf, &end, 10);
+    if (*end == '\0') {
+        if (errno || secs < 0)
+            return false;
+        *out = (time_t) secs;
+        return true;
+    }
+
+    struct tm tm = { 0 };
+    int consumed = 0;
+    if (sscanf(buf, "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &consumed) != 3)
+        return false;
+    char *p = buf + consumed;
+    if (*p == 'T' || *p == ' ') {
+        consumed = 0;
+        if (sscanf(p + 1, "%2d:%2d:%2d%n", &tm.tm_hour, &tm.tm_min, &tm.tm_sec,
+                   &consumed) != 3)
+        {
+            return false;
+        }
+        p += 1 + consumed;
+        if (*p == 'Z')
+            p++;
+    }
+    if (*p != '\0' || tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 ||
+        tm.tm_mday > 31 || tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60)
+    {
+        return false;
+    }
+
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    time_t date = timegm(&tm);
+    if (date == (time_t) -1)
+        return false;
+    *out = date;
+    return true;
+}
+
+// Checks a row the way PRs from IRC are checked, filling in |pr| and |lift|.
+// |nick| receives the lowercased nick. Returns why the row is bad, or NULL.
+static const char *
+validate_row(struct row *row, char *nick, struct prbot_pr *pr, const struct lift **lift)
+{
+    if (!field_str(&row->nick, nick, DB_NAME_MAX) || nick[0] == '\0')
+        return "missing or overlong nick";
+    for (char *c = nick; *c != '\0'; ++c) {
+        if (is_space(*c))
+            return "nick contains spaces";
+        *c = to_lower(*c);
+    }
+
+    if (!row->lift.s || row->lift.len == 0)
+        return "missing lift";
+    *lift = lifts_find(row->lift.s, row->lift.len);
+    if (!*lift)
+        return "unknown lift";
+
+    if (!field_date(&row->date, &pr->date))
+        return "bad date";
+    if (!field_count(&row->sets, &pr->sets))
+        return "bad sets";
+    if (!field_count(&row->reps, &pr->reps))
+        return "bad reps";
+
+    if (row->kgs.s) {
+        if (!field_number(&row->kgs, &pr->kgs))
+            return "bad kgs";
+    } else if (row->lbs.s) {
+        if (!field_number(&row->lbs, &pr->kgs))
+            return "bad lbs";
+        pr->kgs = lb2kg(pr->kgs);
+    } else {
+        // A bare number is kilograms; otherwise it's read as on IRC.
+        char buf[32];
+        char *p = buf;
+        if (!field_number(&row->weight, &pr->kgs) &&
+            (!field_str(&row->weight, buf, sizeof buf) || !parse_weight(&p, &pr->kgs) ||
+             *p != '\0'))
+        {
+            return "bad weight";
+        }
+    }
+
+    pr->nick = nick;
+    pr->lift = (*lift)->name;
+    return NULL;
+}
+
+// Splits a CSV line into fields, unquoting them in place. Quoted fields may
+// contain commas and doubled quotes, but not newlines.
+static const char *
+split_csv(char *line, struct row *row)
+{
+    struct field *fields[] = {
+        &row->nick, &row->lift, &row->date, &row->sets, &row->reps, &row->weight
+    };
+    const int nfields = sizeof fields / sizeof fields[0];
+
+    char *p = line;
+    for (int i = 0;; ++i) {
+        if (i == nfields)
+            return "too many fields";
+
+        char *start = p;
+        char *out = p;
+        if (*p == '"') {
+            p++;
+            for (;;) {
+                if (*p == '\0')
+                    return "unterminated quote";
+                if (*p == '"' && p[1] != '"')
+                    break;
+                if (*p == '"')
+                    p++;
+                *out++ = *p++;
+            }
+            p++;
+        } else {
+            while (*p != ',' && *p != '\0')
+                p++;
+            out = p;
+        }
+        fields[i]->s = start;
+        fields[i]->len = out - start;
+
+        while (is_space(*p))
+            p++;
+        if (*p == '\0') {
+            if (i + 1 != nfields)
+                return "too few fields";
+            return NULL;
+        }
+        if (*p != ',')
+            return "junk after quoted field";
+        p++;
+    }
+}
+
+// Reads a JSON string starting at the opening quote, unescaping it in place.
+static bool
+json_string(char **p, struct field *f)
+{
+    char *s = *p + 1;
+    char *out = s;
+    f->s = s;
+
+    for (;;) {
+        unsigned char c = *s++;
+        if (c == '"')
+            break;
+        if (c == '\0' || c < 0x20)
+            return false;
+        if (c != '\\') {
+            *out++ = c;
+            continue;
+        }
+
+        switch (*s++) {
+          case '"':  *out++ = '"'; break;
+          case '\\': *out++ = '\\'; break;
+          case '/':  *out++ = '/'; break;
+          case 'b':  *out++ = '\b'; break;
+          case 'f':  *out++ = '\f'; break;
+          case 'n':  *out++ = '\n'; break;
+          case 'r':  *out++ = '\r'; break;
+          case 't':  *out++ = '\t'; break;
+          case 'u': {
+            // Written back out as UTF-8, which is never longer than the escape.
+            // Surrogate pairs aren't worth the trouble for nicks and lifts.
+            unsigned int cp;
+            int consumed = 0;
+            if (sscanf(s, "%4x%n", &cp, &consumed) != 1 || consumed != 4 ||
+                (cp >= 0xd800 && cp < 0xe000))
+            {
+                return false;
+            }
+            s += 4;
+            if (cp < 0x80) {
+                *out++ = cp;
+            } else if (cp < 0x800) {
+                *out++ = 0xc0 | (cp >> 6);
+                *out++ = 0x80 | (cp & 0x3f);
+            } else {
+                *out++ = 0xe0 | (cp >> 12);
+                *out++ = 0x80 | ((cp >> 6) & 0x3f);
+                *out++ = 0x80 | (cp & 0x3f);
+            }
+            break;
+          }
+          default:
+            return false;
+        }
+    }
+
+    f->len = out - f->s;
+    *p = s;
+    return true;
+}
+
+static void
+json_spaces(char **p)
+{
+    while (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n')
+        (*p)++;
+}
+
+// Picks the fields of a row out of a flat JSON object. Unknown keys are
+// ignored, as long as their values are strings, numbers or literals.
+static const char *
+split_json(char *line, struct row *row)
+{
+    static const struct {
+        const char *key;
+        size_t offset;
+    } KEYS[] = {
+        { "nick", offsetof(struct row, nick) },
+        { "lift", offsetof(struct row, lift) },
+        { "date", offsetof(struct row, date) },
+        { "sets", offsetof(struct row, sets) },
+        { "reps", offsetof(struct row, reps) },
+        { "weight", offsetof(struct row, weight) },
+        { "kgs", offsetof(struct row, kgs) },
+        { "lbs", offsetof(struct row, lbs) }
+    };
+
+    char *p = line;
+    json_spaces(&p);
+    if (*p++ != '{')
+        return "expected an object";
+    json_spaces(&p);
+    if (*p == '}')
+        return NULL;
+
+    for (;;) {
+        struct field key, value;
+        if (*p != '"' || !json_string(&p, &key))
+            return "bad key";
+        json_spaces(&p);
+        if (*p++ != ':')
+            return "expected ':'";
+        json_spaces(&p);
+
+        if (*p == '"') {
+            if (!json_string(&p, &value))
+                return "bad string";
+        } else if (*p == '{' || *p == '[') {
+            return "nested values aren't supported";
+        } else {
+            // A number or a literal.
+            value.s = p;
+            while (*p && *p != ',' && *p != '}' && *p != ' ' && *p != '\t')
+                p++;
+            value.len = p - value.s;
+            if (value.len == 0)
+                return "missing value";
+            if (value.len == 4 && memcmp(value.s, "null", 4) == 0)
+                value.s = NULL;
+        }
+
+        for (size_t i = 0; i < sizeof KEYS / sizeof KEYS[0]; ++i) {
+            if ((size_t) key.len == strlen(KEYS[i].key) &&
+                memcmp(key.s, KEYS[i].key, key.len) == 0)
+            {
+                *(struct field *) ((char *) row + KEYS[i].offset) = value;
+                break;
+            }
+        }
+
+        json_spaces(&p);
+        if (*p == '}')
+            break;
+        if (*p++ != ',')
+            return "expected ',' or '}'";
+        json_spaces(&p);
+    }
+
+    p++;
+    json_spaces(&p);
+    return *p == '\0' ? NULL : "junk after object";
+}
+
+bool
+bulk_import(FILE *in, const char *name, enum bulk_format format)
+{
+    if (!db_import_begin()) {
+        fprintf(stderr, "%s: couldn't start importing: %s\n", name, db_errmsg());
+        return false;
+    }
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+    long lineno = 0;
+    long imported = 0;
+    long skipped = 0;
+    bool ok = true;
+
+    while ((len = getline(&line, &linecap, in)) >= 0) {
+        lineno++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+
+        // Spreadsheets like to start with a header.
+        if (lineno == 1 && format == BULK_CSV && strncasecmp(line, "nick,", 5) == 0)
+            continue;
+
+        struct row row;
+        memset(&row, 0, sizeof row);
+        struct prbot_pr pr;
+        const struct lift *lift;
+        char nick[DB_NAME_MAX];
+
+        const char *error = format == BULK_CSV ? split_csv(line, &row) : split_json(line, &row);
+        if (!error)
+            error = validate_row(&row, nick, &pr, &lift);
+        if (error) {
+            if (++skipped <= BULK_MAX_REPORTS)
+                fprintf(stderr, "%s:%ld: %s\n", name, lineno, error);
+            continue;
+        }
+
+        if (!db_import_pr(&pr, lift->id)) {
+            fprintf(stderr, "%s:%ld: couldn't insert: %s\n", name, lineno, db_errmsg());
+            ok = false;
+            break;
+        }
+        imported++;
+    }
+
+    if (ok && ferror(in)) {
+        fprintf(stderr, "%s: read error\n", name);
+        ok = false;
+    }
+    free(line);
+
+    if (!db_import_end(ok)) {
+        if (ok)
+            fprintf(stderr, "%s: couldn't commit: %s\n", name, db_errmsg());
+        fprintf(stderr, "%s: import failed at line %ld; nothing was imported\n", name, lineno);
+        return false;
+    }
+
+    fprintf(stderr, "%s: imported %ld PRs", name, imported);
+    if (skipped > BULK_MAX_REPORTS)
+        fprintf(stderr, " (skipped %ld bad rows, %ld not shown)\n", skipped,
+                skipped - BULK_MAX_REPORTS);
+    else if (skipped)
+        fprintf(stderr, " (skipped %ld bad rows)\n", skipped);
+    else
+        fprintf(stderr, "\n");
+    return true;
+}
+
+// Writes |s| as a CSV field, quoted only if it has to be.
+static void
+put_csv(FILE *out, const char *s)
+{
+    if (!strpbrk(s, ",\"\r\n")) {
+        fputs(s, out);
+        return;
+    }
+    putc('"', out);
+    for (; *s; ++s) {
+        if (*s == '"')
+            putc('"', out);
+        putc(*s, out);
+    }
+    putc('"', out);
+}
+
+static void
+put_json(FILE *out, const char *s)
+{
+    putc('"', out);
+    for (; *s; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            putc(c, out);
+    }
+    putc('"', out);
+}
+
+struct export_state {
+    FILE *out;
+    enum bulk_format format;
+};
+
+static bool
+export_row(const struct prbot_pr *pr, void *data)
+{
+    struct export_state *state = data;
+    FILE *out = state->out;
+
+    struct tm tm;
+    char date[32];
+    strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&pr->date, &tm));
+
+    // Seventeen digits, so that weights converted from pounds survive a round trip.
+    if (state->format == BULK_CSV) {
+        put_csv(out, pr->nick);
+        putc(',', out);
+        put_csv(out, pr->lift);
+        fprintf(out, ",%s,%d,%d,%.17g\n", date, pr->sets, pr->reps, pr->kgs);
+    } else {
+        fputs("{\"nick\":", out);
+        put_json(out, pr->nick);
+        fputs(",\"lift\":", out);
+        put_json(out, pr->lift);
+        fprintf(out, ",\"date\":\"%s\",\"sets\":%d,\"reps\":%d,\"kgs\":%.17g}\n",
+                date, pr->sets, pr->reps, pr->kgs);
+    }
+    return !ferror(out);
+}
+
+bool
+bulk_export(FILE *out, enum bulk_format format)
+{
+    struct export_state state = { out, format };
+    if (format == BULK_CSV)
+        fputs("nick,lift,date,sets,reps,kgs\n", out);
+
+    if (!db_export(export_row, &state)) {
+        if (ferror(out))
+            perror("export");
+        else
+            fprintf(stderr, "export: %s\n", db_errmsg());
+        return false;
+    }
+    if (fflush(out) != 0) {
+        perror("export");
+        return false;
+    }
+    return true;
+}
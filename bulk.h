@@ -0,0 +1,58 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Bulk import and export of PR history, for bringing in logs from other bots
+// and spreadsheets without going through IRC. Files are streamed a line at a
+// time, so their size doesn't matter. Two formats are understood:
+//
+//   CSV:         nick,lift,date,sets,reps,weight
+//                dave,squat,2013-05-01,5,5,140
+//   JSON lines:  {"nick": "dave", "lift": "bp", "date": 1367366400, "sets": 3,
+//                 "reps": 5, "weight": "225 lbs"}
+//
+// Dates are Unix times or UTC ISO 8601 dates ("2013-05-01" or
+// "2013-05-01T18:30:00Z"). Weights are kilograms, or a number with a unit as
+// on IRC; JSON may also give "kgs" or "lbs" as plain numbers. Lifts go
+// through the lift registry, so aliases are recorded under the lift's name.
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifndef prbot_bulk_h__
+#define prbot_bulk_h__
+
+enum bulk_format {
+    BULK_CSV,
+    BULK_JSONL
+};
+
+// JSON lines for names ending in ".jsonl" or ".json", CSV otherwise.
+enum bulk_format bulk_format_for(const char *filename);
+
+// Both run before db_worker_start(), on a database that is already prepared
+// and a lift registry that is already loaded.
+//
+// Rows that don't validate are reported as "name:line: reason" and skipped.
+// Fails only if reading or the database does, in which case nothing is
+// imported at all.
+bool bulk_import(FILE *in, const char *name, enum bulk_format format);
+bool bulk_export(FILE *out, enum bulk_format format);
+
+#endif // prbot_bulk_h__
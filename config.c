@@ -0,0 +1,268 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+// Replaces *|field| with a copy of |value|.
+static bool
+set_string(char **field, const char *value)
+{
+    char *copy = strdup(value);
+    if (!copy)
+        return false;
+    free(*field);
+    *field = copy;
+    return true;
+}
+
+struct config_network *
+config_add_network(struct config *config, const char *host, const char *port, const char *nick)
+{
+    struct config_network *networks =
+        realloc(config->networks, (config->nnetworks + 1) * sizeof *networks);
+    if (!networks)
+        return NULL;
+    config->networks = networks;
+
+    struct config_network *network = &networks[config->nnetworks++];
+    memset(network, 0, sizeof *network);
+    network->flood_interval_ms = -1;
+    network->keepalive_idle_ms = -1;
+    if ((host && !set_string(&network->host, host)) ||
+        (port && !set_string(&network->port, port)) ||
+        (nick && !set_string(&network->nick, nick)))
+    {
+        return NULL;
+    }
+    return network;
+}
+
+bool
+config_add_channel(struct config_network *network, const char *chan)
+{
+    char **channels = realloc(network->channels, (network->nchannels + 1) * sizeof *channels);
+    if (!channels)
+        return false;
+    network->channels = channels;
+
+    channels[network->nchannels] = strdup(chan);
+    if (!channels[network->nchannels])
+        return false;
+    network->nchannels++;
+    return true;
+}
+
+// Strips leading and trailing whitespace in place.
+static char *
+trim(char *s)
+{
+    while (isspace((unsigned char) *s))
+        s++;
+
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char) end[-1]))
+        end--;
+    *end = '\0';
+    return s;
+}
+
+// Cuts off a comment after a setting: a ';' at the start or after
+// whitespace. '#' only starts comments at the start of a line, since channel
+// names start with it too.
+static void
+strip_comment(char *s)
+{
+    for (char *p = s; *p; ++p) {
+        if (*p == ';' && (p == s || isspace((unsigned char) p[-1]))) {
+            *p = '\0';
+            return;
+        }
+    }
+}
+
+// Parses a whole, non-negative number.
+static bool
+parse_count(const char *value, int *out)
+{
+    char *end;
+    errno = 0;
+    long n = strtol(value, &end, 10);
+    if (errno || end == value || *end != '\0' || n < 0 || n > INT_MAX)
+        return false;
+    *out = n;
+    return true;
+}
+
+// The setters return an error message, or NULL on success.
+static const char *
+set_network_key(struct config_network *network, const char *key, char *value)
+{
+    static const char *OOM = "out of memory";
+
+    if (strcmp(key, "host") == 0)
+        return set_string(&network->host, value) ? NULL : OOM;
+    if (strcmp(key, "port") == 0)
+        return set_string(&network->port, value) ? NULL : OOM;
+    if (strcmp(key, "nick") == 0)
+        return set_string(&network->nick, value) ? NULL : OOM;
+
+    if (strcmp(key, "flood_burst") == 0) {
+        if (!parse_count(value, &network->flood_burst) || network->flood_burst == 0)
+            return "expected a positive number for";
+        return NULL;
+    }
+    if (strcmp(key, "flood_interval") == 0)
+        return parse_count(value, &network->flood_interval_ms) ? NULL : "expected a number for";
+    if (strcmp(key, "keepalive_idle") == 0)
+        return parse_count(value, &network->keepalive_idle_ms) ? NULL : "expected a number for";
+    if (strcmp(key, "keepalive_timeout") == 0) {
+        if (!parse_count(value, &network->keepalive_timeout_ms) ||
+            network->keepalive_timeout_ms == 0)
+        {
+            return "expected a positive number for";
+        }
+        return NULL;
+    }
+
+    if (strcmp(key, "channels") == 0) {
+        // Channels are separated by whitespace or commas.
+        for (char *chan = strtok(value, " \t,"); chan; chan = strtok(NULL, " \t,")) {
+            if (!config_add_channel(network, chan))
+                return OOM;
+        }
+        return NULL;
+    }
+
+    return "unknown network setting";
+}
+
+static const char *
+set_global_key(struct config *config, const char *key, const char *value)
+{
+    static const char *OOM = "out of memory";
+
+    if (strcmp(key, "database") == 0)
+        return set_string(&config->database, value) ? NULL : OOM;
+    if (strcmp(key, "synchronous") == 0)
+        return set_string(&config->synchronous, value) ? NULL : OOM;
+
+    return "unknown setting";
+}
+
+// Checks that every network has what it needs to connect.
+static bool
+validate(struct config *config, const char *filename)
+{
+    if (config->nnetworks == 0) {
+        fprintf(stderr, "%s: no [network] sections\n", filename);
+        return false;
+    }
+
+    for (int i = 0; i < config->nnetworks; ++i) {
+        struct config_network *network = &config->networks[i];
+        if (!network->host || !network->port || !network->nick) {
+            fprintf(stderr, "%s: network %d needs a host, port and nick\n", filename, i + 1);
+            return false;
+        }
+        if (strlen(network->nick) > 30) {
+            fprintf(stderr, "%s: nick \"%s\" is too long\n", filename, network->nick);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+config_load(struct config *config, const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        perror(filename);
+        return false;
+    }
+
+    struct config_network *network = NULL;
+    char *line = NULL;
+    size_t linecap = 0;
+    int lineno = 0;
+    bool ok = true;
+
+    while (ok && getline(&line, &linecap, file) >= 0) {
+        lineno++;
+
+        strip_comment(line);
+        char *s = trim(line);
+        if (s[0] == '\0' || s[0] == '#' || s[0] == ';')
+            continue;
+
+        if (strcmp(s, "[network]") == 0) {
+            network = config_add_network(config, NULL, NULL, NULL);
+            ok = network != NULL;
+            continue;
+        }
+
+        char *equals = strchr(s, '=');
+        if (!equals) {
+            fprintf(stderr, "%s:%d: expected \"key = value\"\n", filename, lineno);
+            ok = false;
+            break;
+        }
+        *equals = '\0';
+        char *key = trim(s);
+        char *value = trim(equals + 1);
+
+        const char *error = network ? set_network_key(network, key, value)
+                                    : set_global_key(config, key, value);
+        if (error) {
+            fprintf(stderr, "%s:%d: %s \"%s\"\n", filename, lineno, error, key);
+            ok = false;
+        }
+    }
+
+    free(line);
+    fclose(file);
+    return ok && validate(config, filename);
+}
+
+void
+config_free(struct config *config)
+{
+    for (int i = 0; i < config->nnetworks; ++i) {
+        struct config_network *network = &config->networks[i];
+        free(network->host);
+        free(network->port);
+        free(network->nick);
+        for (int j = 0; j < network->nchannels; ++j)
+            free(network->channels[j]);
+        free(network->channels);
+    }
+    free(config->networks);
+    free(config->database);
+    free(config->synchronous);
+    memset(config, 0, sizeof *config);
+}
@@ -0,0 +1,75 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Configuration file parsing.
+//
+// The file is a list of "key = value" lines. Settings before the first
+// section apply to the whole bot; each "[network]" line starts a new server
+// connection. Lines starting with '#' or ';' are comments, as is anything
+// after a ';' that follows whitespace. For example:
+//
+//   database = prbot.sqlite3
+//   synchronous = FULL
+//
+//   [network]
+//   host = irc.rizon.net
+//   port = 6667
+//   nick = prbot
+//   channels = #prbottest #fitness
+//   flood_burst = 5        ; Lines that may be sent back to back...
+//   flood_interval = 2000  ; ...and milliseconds per line after that.
+//   keepalive_idle = 30000    ; PING after this many quiet milliseconds (0: never)...
+//   keepalive_timeout = 15000 ; ...and disconnect if nothing comes back in this many.
+
+#include <stdbool.h>
+
+#ifndef prbot_config_h__
+#define prbot_config_h__
+
+struct config_network {
+    char *host;
+    char *port;
+    char *nick;
+    char **channels;
+    int nchannels;
+    int flood_burst;          // 0 if unset.
+    int flood_interval_ms;    // -1 if unset.
+    int keepalive_idle_ms;    // -1 if unset.
+    int keepalive_timeout_ms; // 0 if unset.
+};
+
+struct config {
+    char *database;
+    char *synchronous;
+    struct config_network *networks;
+    int nnetworks;
+};
+
+// Fills |config| from the file. On failure, prints why and returns false.
+bool config_load(struct config *config, const char *filename);
+
+// Adds a network to |config|. Strings are copied.
+struct config_network *config_add_network(struct config *config, const char *host,
+                                          const char *port, const char *nick);
+bool config_add_channel(struct config_network *network, const char *chan);
+
+void config_free(struct config *config);
+
+#endif // prbot_config_h__
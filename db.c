@@ -0,0 +1,1125 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "db.h"
+#include "prcache.h"
+
+// The schema as it was before versioning (user_version 0). Only used to
+// bootstrap fresh databases, which are then brought up to date by MIGRATIONS.
+static const char INITIALIZE_DB[] =
+    "CREATE TABLE IF NOT EXISTS prs ("
+    "    id INTEGER PRIMARY KEY AUTOINCREMENT,"
+    "    nick VARCHAR(255) NOT NULL,"
+    "    lift VARCHAR(255) NOT NULL,"
+    "    date INTEGER NOT NULL,"
+    "    sets INTEGER NOT NULL,"
+    "    reps INTEGER NOT NULL,"
+    "    kgs REAL NOT NULL"
+    ");";
+
+// The best PR for each (nick, lift), in the shape it had before migrations.
+// The migrations below reshape it; from version 5 on, it holds the heaviest.
+static const char CREATE_BEST_PRS[] =
+    "CREATE TABLE best_prs ("
+    "    nick VARCHAR(255) NOT NULL,"
+    "    lift VARCHAR(255) NOT NULL,"
+    "    date INTEGER NOT NULL,"
+    "    sets INTEGER NOT NULL,"
+    "    reps INTEGER NOT NULL,"
+    "    kgs REAL NOT NULL,"
+    "    PRIMARY KEY (nick, lift)"
+    ") WITHOUT ROWID;";
+
+// Fills best_prs from the full history. Only run when best_prs is created,
+// on an unversioned database; version 5 then refills it by weight.
+static const char BACKFILL_BEST_PRS[] =
+    "INSERT INTO best_prs (nick, lift, date, sets, reps, kgs) "
+    "SELECT nick, lift, date, sets, reps, kgs FROM prs WHERE 1 "
+    "ORDER BY date ASC, id ASC "
+    "ON CONFLICT (nick, lift) DO UPDATE SET"
+    "    date = excluded.date, sets = excluded.sets,"
+    "    reps = excluded.reps, kgs = excluded.kgs;";
+
+// Version 1: intern nicks and lifts, so rows and indexes carry integers.
+static const char MIGRATE_INTERN_NAMES[] =
+    "CREATE TABLE nicks ("
+    "    id INTEGER PRIMARY KEY,"
+    "    name VARCHAR(255) NOT NULL UNIQUE"
+    ");"
+    "CREATE TABLE lifts ("
+    "    id INTEGER PRIMARY KEY,"
+    "    name VARCHAR(255) NOT NULL UNIQUE"
+    ");"
+    "INSERT INTO nicks (name) SELECT DISTINCT nick FROM prs;"
+    "INSERT INTO lifts (name) SELECT DISTINCT lift FROM prs;"
+
+    "CREATE TABLE prs_v1 ("
+    "    id INTEGER PRIMARY KEY AUTOINCREMENT,"
+    "    nick_id INTEGER NOT NULL REFERENCES nicks (id),"
+    "    lift_id INTEGER NOT NULL REFERENCES lifts (id),"
+    "    date INTEGER NOT NULL,"
+    "    sets INTEGER NOT NULL,"
+    "    reps INTEGER NOT NULL,"
+    "    kgs REAL NOT NULL"
+    ");"
+    "INSERT INTO prs_v1 (id, nick_id, lift_id, date, sets, reps, kgs)"
+    "    SELECT p.id, n.id, l.id, p.date, p.sets, p.reps, p.kgs"
+    "    FROM prs p"
+    "    JOIN nicks n ON n.name = p.nick"
+    "    JOIN lifts l ON l.name = p.lift;"
+    "DROP TABLE prs;"
+    "ALTER TABLE prs_v1 RENAME TO prs;"
+    "CREATE INDEX prs_by_nick_lift_date ON prs (nick_id, lift_id, date, sets, reps, kgs);"
+
+    "CREATE TABLE best_prs_v1 ("
+    "    nick_id INTEGER NOT NULL REFERENCES nicks (id),"
+    "    lift_id INTEGER NOT NULL REFERENCES lifts (id),"
+    "    date INTEGER NOT NULL,"
+    "    sets INTEGER NOT NULL,"
+    "    reps INTEGER NOT NULL,"
+    "    kgs REAL NOT NULL,"
+    "    PRIMARY KEY (nick_id, lift_id)"
+    ") WITHOUT ROWID;"
+    "INSERT INTO best_prs_v1 (nick_id, lift_id, date, sets, reps, kgs)"
+    "    SELECT n.id, l.id, b.date, b.sets, b.reps, b.kgs"
+    "    FROM best_prs b"
+    "    JOIN nicks n ON n.name = b.nick"
+    "    JOIN lifts l ON l.name = b.lift;"
+    "DROP TABLE best_prs;"
+    "ALTER TABLE best_prs_v1 RENAME TO best_prs;";
+
+// Version 2: lifts become a registry, with metadata and aliases. Seeded with
+// the lifts prbot has always known, plus a few more.
+static const char MIGRATE_LIFT_REGISTRY[] =
+    "ALTER TABLE lifts ADD COLUMN category VARCHAR(255) NOT NULL DEFAULT '';"
+    "ALTER TABLE lifts ADD COLUMN bodyweight INTEGER NOT NULL DEFAULT 0;"
+    "CREATE TABLE lift_aliases ("
+    "    alias VARCHAR(255) NOT NULL PRIMARY KEY,"
+    "    lift_id INTEGER NOT NULL REFERENCES lifts (id)"
+    ") WITHOUT ROWID;"
+
+    "INSERT OR IGNORE INTO lifts (name) VALUES"
+    "    ('bench press'), ('overhead press'), ('squat'), ('front squat'),"
+    "    ('power clean'), ('deadlift'), ('pull-up'), ('chin-up'), ('dip');"
+    "UPDATE lifts SET category = 'press' WHERE name IN ('bench press', 'overhead press', 'dip');"
+    "UPDATE lifts SET category = 'squat' WHERE name IN ('squat', 'front squat');"
+    "UPDATE lifts SET category = 'pull' WHERE name IN ('deadlift', 'pull-up', 'chin-up');"
+    "UPDATE lifts SET category = 'olympic' WHERE name = 'power clean';"
+    "UPDATE lifts SET bodyweight = 1 WHERE name IN ('pull-up', 'chin-up', 'dip');"
+
+    "WITH a (alias, name) AS (VALUES"
+    "    ('bench', 'bench press'), ('bp', 'bench press'),"
+    "    ('ohp', 'overhead press'), ('press', 'overhead press'),"
+    "    ('military press', 'overhead press'),"
+    "    ('sq', 'squat'), ('back squat', 'squat'),"
+    "    ('fs', 'front squat'), ('fsq', 'front squat'),"
+    "    ('pc', 'power clean'), ('clean', 'power clean'),"
+    "    ('dl', 'deadlift'),"
+    "    ('pullup', 'pull-up'), ('pull up', 'pull-up'),"
+    "    ('chinup', 'chin-up'), ('chin up', 'chin-up'),"
+    "    ('dips', 'dip')"
+    ") INSERT INTO lift_aliases (alias, lift_id)"
+    "    SELECT a.alias, l.id FROM a JOIN lifts l ON l.name = a.name;";
+
+// Version 3: best_prs carries each PR's estimated one-rep max, and is indexed
+// for per-lift leaderboards.
+static const char MIGRATE_LEADERBOARDS[] =
+    "ALTER TABLE best_prs ADD COLUMN e1rm REAL NOT NULL DEFAULT 0;"
+    "UPDATE best_prs SET e1rm = CASE WHEN reps <= 1 THEN kgs ELSE kgs * (1 + reps / 30.0) END;"
+    "CREATE INDEX best_prs_by_lift_kgs ON best_prs (lift_id, kgs DESC);"
+    "CREATE INDEX best_prs_by_lift_e1rm ON best_prs (lift_id, e1rm DESC);";
+
+// Version 4: every PR stores its e1RM too. The history index is rebuilt to
+// cover it and to be ordered by (date, id), the key that history pages are
+// cut on; a second index finds each lift's best e1RM directly.
+static const char MIGRATE_PR_E1RM[] =
+    "ALTER TABLE prs ADD COLUMN e1rm REAL NOT NULL DEFAULT 0;"
+    "UPDATE prs SET e1rm = CASE WHEN reps <= 1 THEN kgs ELSE kgs * (1 + reps / 30.0) END;"
+    "DROP INDEX prs_by_nick_lift_date;"
+    "CREATE INDEX prs_by_nick_lift_date ON prs (nick_id, lift_id, date, id, sets, reps, kgs, e1rm);"
+    "CREATE INDEX prs_by_nick_lift_e1rm ON prs (nick_id, lift_id, e1rm);";
+
+// Version 5: best_prs keeps each lifter's heaviest PR instead of their most
+// recent one, and the best e1RM, which may come from a different PR, moves to
+// a table of its own. Both are rebuilt from the history; on ties, the older
+// PR stays.
+static const char MIGRATE_TRUE_BESTS[] =
+    "DROP INDEX best_prs_by_lift_e1rm;"
+    "DELETE FROM best_prs;"
+    "INSERT INTO best_prs (nick_id, lift_id, date, sets, reps, kgs, e1rm)"
+    "    SELECT nick_id, lift_id, date, sets, reps, kgs, e1rm FROM prs WHERE 1"
+    "    ORDER BY id ASC"
+    "    ON CONFLICT (nick_id, lift_id) DO UPDATE SET"
+    "        date = excluded.date, sets = excluded.sets,"
+    "        reps = excluded.reps, kgs = excluded.kgs, e1rm = excluded.e1rm"
+    "    WHERE excluded.kgs > best_prs.kgs;"
+
+    "CREATE TABLE best_e1rms ("
+    "    nick_id INTEGER NOT NULL REFERENCES nicks (id),"
+    "    lift_id INTEGER NOT NULL REFERENCES lifts (id),"
+    "    date INTEGER NOT NULL,"
+    "    sets INTEGER NOT NULL,"
+    "    reps INTEGER NOT NULL,"
+    "    kgs REAL NOT NULL,"
+    "    e1rm REAL NOT NULL,"
+    "    PRIMARY KEY (nick_id, lift_id)"
+    ") WITHOUT ROWID;"
+    "INSERT INTO best_e1rms (nick_id, lift_id, date, sets, reps, kgs, e1rm)"
+    "    SELECT nick_id, lift_id, date, sets, reps, kgs, e1rm FROM prs WHERE 1"
+    "    ORDER BY id ASC"
+    "    ON CONFLICT (nick_id, lift_id) DO UPDATE SET"
+    "        date = excluded.date, sets = excluded.sets,"
+    "        reps = excluded.reps, kgs = excluded.kgs, e1rm = excluded.e1rm"
+    "    WHERE excluded.e1rm > best_e1rms.e1rm;"
+    "CREATE INDEX best_e1rms_by_lift_e1rm ON best_e1rms (lift_id, e1rm DESC);";
+
+// Schema migrations, in order. MIGRATIONS[i] takes user_version i to i + 1.
+// Append only: never edit a migration that has shipped.
+static const char *MIGRATIONS[] = {
+    MIGRATE_INTERN_NAMES,
+    MIGRATE_LIFT_REGISTRY,
+    MIGRATE_LEADERBOARDS,
+    MIGRATE_PR_E1RM,
+    MIGRATE_TRUE_BESTS
+};
+
+#define SCHEMA_VERSION ((int) (sizeof MIGRATIONS / sizeof MIGRATIONS[0]))
+
+static const char NICK_ID[] =
+    "SELECT id FROM nicks WHERE name = ?;";
+
+static const char INSERT_NICK[] =
+    "INSERT INTO nicks (name) VALUES (?);";
+
+static const char LIFT_ID[] =
+    "SELECT id FROM lifts WHERE name = ?;";
+
+static const char INSERT_LIFT[] =
+    "INSERT INTO lifts (name) VALUES (?);";
+
+static const char ALL_LIFTS[] =
+    "SELECT id, name, category, bodyweight FROM lifts;";
+
+static const char ALL_LIFT_ALIASES[] =
+    "SELECT alias, lift_id FROM lift_aliases;";
+
+static const char TOP_PRS[] =
+    "SELECT n.name, l.name, b.date, b.sets, b.reps, b.kgs "
+    "FROM nicks n "
+    "JOIN best_prs b ON b.nick_id = n.id "
+    "JOIN lifts l ON l.id = b.lift_id "
+    "WHERE n.name = ? "
+    "ORDER BY l.name ASC;";
+
+static const char INSERT_PR[] =
+    "INSERT INTO prs (nick_id, lift_id, date, sets, reps, kgs, e1rm)"
+    "VALUES (?, ?, ?, ?, ?, ?, ?)";
+
+// One page of a nick's history for a lift, newest first, starting after the
+// (date, id) key that ended the previous page.
+static const char HISTORY_PAGE[] =
+    "SELECT id, date, sets, reps, kgs, e1rm FROM prs "
+    "WHERE nick_id = ?1 AND lift_id = ?2 AND (date, id) < (?3, ?4) "
+    "ORDER BY date DESC, id DESC LIMIT ?5;";
+
+// The (date, id) key that ends the page after the one ending at (?3, ?4),
+// read off the index alone. ?5 is the page length less one.
+static const char HISTORY_SEEK[] =
+    "SELECT date, id FROM prs "
+    "WHERE nick_id = ?1 AND lift_id = ?2 AND (date, id) < (?3, ?4) "
+    "ORDER BY date DESC, id DESC LIMIT 1 OFFSET ?5;";
+
+// Bring best_prs and best_e1rms up to date with the PRs from ?1 on, as
+// UPDATE_BEST_PR and UPDATE_BEST_E1RM would have one at a time.
+static const char IMPORT_BEST_PRS[] =
+    "INSERT INTO best_prs (nick_id, lift_id, date, sets, reps, kgs, e1rm) "
+    "SELECT nick_id, lift_id, date, sets, reps, kgs, e1rm FROM prs "
+    "WHERE id >= ?1 ORDER BY id ASC "
+    "ON CONFLICT (nick_id, lift_id) DO UPDATE SET"
+    "    date = excluded.date, sets = excluded.sets,"
+    "    reps = excluded.reps, kgs = excluded.kgs, e1rm = excluded.e1rm "
+    "WHERE excluded.kgs > best_prs.kgs;";
+
+static const char IMPORT_BEST_E1RMS[] =
+    "INSERT INTO best_e1rms (nick_id, lift_id, date, sets, reps, kgs, e1rm) "
+    "SELECT nick_id, lift_id, date, sets, reps, kgs, e1rm FROM prs "
+    "WHERE id >= ?1 ORDER BY id ASC "
+    "ON CONFLICT (nick_id, lift_id) DO UPDATE SET"
+    "    date = excluded.date, sets = excluded.sets,"
+    "    reps = excluded.reps, kgs = excluded.kgs, e1rm = excluded.e1rm "
+    "WHERE excluded.e1rm > best_e1rms.e1rm;";
+
+// Every PR, oldest first, for export.
+static const char EXPORT_PRS[] =
+    "SELECT n.name, l.name, p.date, p.sets, p.reps, p.kgs "
+    "FROM prs p "
+    "JOIN nicks n ON n.id = p.nick_id "
+    "JOIN lifts l ON l.id = p.lift_id "
+    "ORDER BY p.id ASC;";
+
+// A single primary-key probe; no row means no history at all.
+static const char BEST_E1RM[] =
+    "SELECT e1rm FROM best_e1rms WHERE nick_id = ? AND lift_id = ?;";
+
+// A PR replaces the best only if it is strictly heavier, or for
+// UPDATE_BEST_E1RM, strictly stronger; a newer, lighter one leaves it be.
+static const char UPDATE_BEST_PR[] =
+    "INSERT INTO best_prs (nick_id, lift_id, date, sets, reps, kgs, e1rm) "
+    "VALUES (?, ?, ?, ?, ?, ?, ?) "
+    "ON CONFLICT (nick_id, lift_id) DO UPDATE SET"
+    "    date = excluded.date, sets = excluded.sets,"
+    "    reps = excluded.reps, kgs = excluded.kgs, e1rm = excluded.e1rm "
+    "WHERE excluded.kgs > best_prs.kgs;";
+
+static const char UPDATE_BEST_E1RM[] =
+    "INSERT INTO best_e1rms (nick_id, lift_id, date, sets, reps, kgs, e1rm) "
+    "VALUES (?, ?, ?, ?, ?, ?, ?) "
+    "ON CONFLICT (nick_id, lift_id) DO UPDATE SET"
+    "    date = excluded.date, sets = excluded.sets,"
+    "    reps = excluded.reps, kgs = excluded.kgs, e1rm = excluded.e1rm "
+    "WHERE excluded.e1rm > best_e1rms.e1rm;";
+
+// Leaderboards read straight off best_prs_by_lift_kgs and best_e1rms_by_lift_e1rm.
+static const char TOP_BY_KGS[] =
+    "SELECT n.name, b.date, b.sets, b.reps, b.kgs, b.e1rm "
+    "FROM best_prs b INDEXED BY best_prs_by_lift_kgs "
+    "JOIN nicks n ON n.id = b.nick_id "
+    "WHERE b.lift_id = ? "
+    "ORDER BY b.kgs DESC LIMIT ?;";
+
+static const char TOP_BY_E1RM[] =
+    "SELECT n.name, b.date, b.sets, b.reps, b.kgs, b.e1rm "
+    "FROM best_e1rms b INDEXED BY best_e1rms_by_lift_e1rm "
+    "JOIN nicks n ON n.id = b.nick_id "
+    "WHERE b.lift_id = ? "
+    "ORDER BY b.e1rm DESC LIMIT ?;";
+
+// Indexed by enum db_stmtid.
+static const char *STMT_SQL[DB_NUM_STMTS] = {
+    "BEGIN;",
+    "COMMIT;",
+    "ROLLBACK;",
+    "SAVEPOINT pr;",
+    "RELEASE pr;",
+    "ROLLBACK TO pr;",
+    NICK_ID,
+    INSERT_NICK,
+    LIFT_ID,
+    INSERT_LIFT,
+    INSERT_PR,
+    UPDATE_BEST_PR,
+    TOP_PRS,
+    ALL_LIFTS,
+    ALL_LIFT_ALIASES,
+    TOP_BY_KGS,
+    TOP_BY_E1RM,
+    HISTORY_PAGE,
+    HISTORY_SEEK,
+    BEST_E1RM,
+    IMPORT_BEST_PRS,
+    EXPORT_PRS,
+    UPDATE_BEST_E1RM,
+    IMPORT_BEST_E1RMS
+};
+
+// Global database handle ( :( ).
+static sqlite3 *db;
+
+// Statement cache, indexed by enum db_stmtid.
+static sqlite3_stmt *stmts[DB_NUM_STMTS];
+
+// Wakeups for the database thread and the network thread, respectively.
+static int request_fd = -1;
+static int result_fd = -1;
+
+// A PR waiting in the write-behind queue, with its own copy of the strings.
+struct pending_pr {
+    struct prbot_pr pr;
+    char nick[DB_NAME_MAX];
+    char lift[DB_NAME_MAX];
+    db_insert_cb cb;
+    void *data;
+};
+
+// Write-behind queue, committed by db_flush() as a single transaction.
+static struct pending_pr pending[DB_BATCH_MAX];
+static int npending;
+static struct timespec oldest_pending; // When pending[0] was queued.
+
+static bool
+table_exists(const char *name)
+{
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?",
+                           -1, &stmt, NULL) != SQLITE_OK)
+    {
+        return false;
+    }
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    bool exists = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    return exists;
+}
+
+// Creates best_prs and populates it from existing history, all at once.
+static bool
+create_best_prs(void)
+{
+    if (table_exists("best_prs"))
+        return true;
+
+    // The error is reported here, since the rollback replaces its message.
+    if (sqlite3_exec(db, "BEGIN;", 0, 0, 0) == SQLITE_OK &&
+        sqlite3_exec(db, CREATE_BEST_PRS, 0, 0, 0) == SQLITE_OK &&
+        sqlite3_exec(db, BACKFILL_BEST_PRS, 0, 0, 0) == SQLITE_OK &&
+        sqlite3_exec(db, "COMMIT;", 0, 0, 0) == SQLITE_OK)
+    {
+        return true;
+    }
+    fprintf(stderr, "Failed to create best_prs: %s\n", sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    return false;
+}
+
+// |synchronous| is one of the PRAGMA synchronous levels: OFF, NORMAL, FULL or EXTRA.
+// PRs are only reported as recorded once committed, so anything below FULL
+// trades that guarantee for fewer fsyncs.
+bool
+db_open(const char *filename, const char *synchronous)
+{
+    static const char *LEVELS[] = { "OFF", "NORMAL", "FULL", "EXTRA" };
+
+    bool level_ok = false;
+    for (size_t i = 0; i < sizeof LEVELS / sizeof LEVELS[0]; ++i) {
+        if (strcasecmp(LEVELS[i], synchronous) == 0) {
+            level_ok = true;
+            break;
+        }
+    }
+    if (!level_ok) {
+        fprintf(stderr, "Unknown synchronous level: %s\n", synchronous);
+        return false;
+    }
+
+    if (sqlite3_open(filename, &db)) {
+        fprintf(stderr, "Failed to open database: %s\n", sqlite3_errmsg(db));
+        return false;
+    }
+
+    char pragmas[128];
+    snprintf(pragmas, sizeof pragmas,
+             "PRAGMA journal_mode = WAL; PRAGMA synchronous = %s;", synchronous);
+    if (sqlite3_exec(db, pragmas, 0, 0, 0)) {
+        fprintf(stderr, "Failed to configure database: %s\n", sqlite3_errmsg(db));
+        return false;
+    }
+    return true;
+}
+
+static int
+user_version(void)
+{
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, NULL) != SQLITE_OK)
+        return -1;
+    int version = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : -1;
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+// Applies MIGRATIONS[version] and bumps user_version in one transaction.
+// The error is reported here, since the rollback replaces its message.
+static bool
+migrate_one(int version)
+{
+    char bump[64];
+    snprintf(bump, sizeof bump, "PRAGMA user_version = %d;", version + 1);
+
+    if (sqlite3_exec(db, "BEGIN;", 0, 0, 0) == SQLITE_OK &&
+        sqlite3_exec(db, MIGRATIONS[version], 0, 0, 0) == SQLITE_OK &&
+        sqlite3_exec(db, bump, 0, 0, 0) == SQLITE_OK &&
+        sqlite3_exec(db, "COMMIT;", 0, 0, 0) == SQLITE_OK)
+    {
+        return true;
+    }
+    fprintf(stderr, "Failed to migrate schema to version %d: %s\n", version + 1,
+            sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+    return false;
+}
+
+// Brings the schema up to SCHEMA_VERSION.
+bool
+db_migrate(void)
+{
+    int version = user_version();
+    if (version < 0) {
+        fprintf(stderr, "Failed to read schema version: %s\n", sqlite3_errmsg(db));
+        return false;
+    }
+    if (version > SCHEMA_VERSION) {
+        fprintf(stderr, "Database schema version %d is newer than this prbot (%d).\n",
+                version, SCHEMA_VERSION);
+        return false;
+    }
+
+    if (version == 0) {
+        // Unversioned: either brand new or from before migrations existed.
+        if (sqlite3_exec(db, INITIALIZE_DB, 0, 0, 0)) {
+            fprintf(stderr, "Failed to initialize database: %s\n", sqlite3_errmsg(db));
+            return false;
+        }
+        if (!create_best_prs())
+            return false; // Already reported.
+    }
+
+    for (; version < SCHEMA_VERSION; ++version) {
+        if (!migrate_one(version))
+            return false; // Already reported.
+    }
+    return true;
+}
+
+// Prepares the statement cache. The schema must be up to date.
+bool
+db_prepare(void)
+{
+    for (int i = 0; i < DB_NUM_STMTS; ++i) {
+        if (sqlite3_prepare_v3(db, STMT_SQL[i], -1, SQLITE_PREPARE_PERSISTENT,
+                               &stmts[i], NULL) != SQLITE_OK)
+        {
+            fprintf(stderr, "Failed to prepare statement %d: %s\n", i, sqlite3_errmsg(db));
+            return false;
+        }
+    }
+    return true;
+}
+
+void
+db_close(void)
+{
+    db_flush();
+    prcache_clear();
+
+    if (request_fd >= 0)
+        close(request_fd);
+    if (result_fd >= 0)
+        close(result_fd);
+    request_fd = result_fd = -1;
+
+    for (int i = 0; i < DB_NUM_STMTS; ++i) {
+        sqlite3_finalize(stmts[i]);
+        stmts[i] = NULL;
+    }
+
+    if (sqlite3_close(db) != SQLITE_OK)
+        fprintf(stderr, "Failed to close database: %s\n", sqlite3_errmsg(db));
+    db = NULL;
+}
+
+const char *
+db_errmsg(void)
+{
+    return sqlite3_errmsg(db);
+}
+
+sqlite3_stmt *
+db_stmt(enum db_stmtid id)
+{
+    assert(id >= 0 && id < DB_NUM_STMTS);
+    assert(stmts[id]);
+    return stmts[id];
+}
+
+// Resets the statement so the next borrower can bind it afresh.
+void
+db_stmt_done(sqlite3_stmt *stmt)
+{
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
+
+// Runs a statement that takes no parameters and returns no rows.
+static bool
+exec_stmt(enum db_stmtid id)
+{
+    sqlite3_stmt *stmt = db_stmt(id);
+    bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+    db_stmt_done(stmt);
+    return ok;
+}
+
+// Looks up the ID of an interned name, adding it if it is new.
+// Must be called inside a transaction.
+static sqlite3_int64
+intern(enum db_stmtid find, enum db_stmtid insert, const char *name)
+{
+    sqlite3_int64 id = -1;
+
+    sqlite3_stmt *stmt = db_stmt(find);
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        id = sqlite3_column_int64(stmt, 0);
+    db_stmt_done(stmt);
+    if (id >= 0)
+        return id;
+
+    stmt = db_stmt(insert);
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_DONE)
+        id = sqlite3_last_insert_rowid(db);
+    db_stmt_done(stmt);
+    return id;
+}
+
+// Epley's formula. A single is its own one-rep max.
+double
+db_e1rm(int reps, double kgs)
+{
+    return reps <= 1 ? kgs : kgs * (1 + reps / 30.0);
+}
+
+// Runs DB_INSERT_PR, DB_UPDATE_BEST_PR or DB_UPDATE_BEST_E1RM, which share a
+// parameter layout.
+static bool
+exec_pr_stmt(enum db_stmtid id, sqlite3_int64 nick_id, sqlite3_int64 lift_id,
+             struct prbot_pr *pr)
+{
+    sqlite3_stmt *stmt = db_stmt(id);
+    sqlite3_bind_int64(stmt, 1, nick_id);
+    sqlite3_bind_int64(stmt, 2, lift_id);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64) pr->date);
+    sqlite3_bind_int(stmt, 4, pr->sets);
+    sqlite3_bind_int(stmt, 5, pr->reps);
+    sqlite3_bind_double(stmt, 6, pr->kgs);
+    sqlite3_bind_double(stmt, 7, db_e1rm(pr->reps, pr->kgs));
+
+    bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+    db_stmt_done(stmt);
+    return ok;
+}
+
+// Writes the PR to the history, and to best_prs and best_e1rms if it beats
+// what is there. Must be called inside a transaction.
+static bool
+insert_pr(struct prbot_pr *pr)
+{
+    sqlite3_int64 nick_id = intern(DB_NICK_ID, DB_INSERT_NICK, pr->nick);
+    sqlite3_int64 lift_id = intern(DB_LIFT_ID, DB_INSERT_LIFT, pr->lift);
+    return nick_id >= 0 && lift_id >= 0 &&
+           exec_pr_stmt(DB_INSERT_PR, nick_id, lift_id, pr) &&
+           exec_pr_stmt(DB_UPDATE_BEST_PR, nick_id, lift_id, pr) &&
+           exec_pr_stmt(DB_UPDATE_BEST_E1RM, nick_id, lift_id, pr);
+}
+
+// Records the PR in the history and in best_prs, in a single transaction.
+bool
+db_insert_pr(struct prbot_pr *pr)
+{
+    if (!exec_stmt(DB_BEGIN))
+        return false;
+
+    if (!insert_pr(pr)) {
+        exec_stmt(DB_ROLLBACK);
+        return false;
+    }
+
+    if (!exec_stmt(DB_COMMIT)) {
+        exec_stmt(DB_ROLLBACK);
+        return false;
+    }
+    prcache_update(pr);
+    return true;
+}
+
+static long
+ms_since(const struct timespec *then)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+// Queues the PR for the next group commit. |cb| is called once the PR is
+// durable, or once it has failed; it may run before this function returns.
+bool
+db_queue_pr(struct prbot_pr *pr, db_insert_cb cb, void *data)
+{
+    if (strlen(pr->nick) >= DB_NAME_MAX || strlen(pr->lift) >= DB_NAME_MAX)
+        return false;
+
+    struct pending_pr *p = &pending[npending];
+    strcpy(p->nick, pr->nick);
+    strcpy(p->lift, pr->lift);
+    p->pr = *pr;
+    p->pr.nick = p->nick;
+    p->pr.lift = p->lift;
+    p->cb = cb;
+    p->data = data;
+
+    if (npending++ == 0)
+        clock_gettime(CLOCK_MONOTONIC, &oldest_pending);
+    if (npending == DB_BATCH_MAX)
+        db_flush();
+    return true;
+}
+
+// Milliseconds until db_flush() is due, or -1 if nothing is queued.
+int
+db_flush_timeout(void)
+{
+    if (npending == 0)
+        return -1;
+    long remaining = DB_BATCH_DELAY_MS - ms_since(&oldest_pending);
+    return remaining > 0 ? (int) remaining : 0;
+}
+
+// Commits every queued PR in one transaction, then runs their callbacks.
+// A PR that fails is rolled back on its own without failing the others.
+void
+db_flush(void)
+{
+    if (npending == 0)
+        return;
+
+    bool ok[DB_BATCH_MAX];
+    bool committed = exec_stmt(DB_BEGIN);
+    if (committed) {
+        for (int i = 0; i < npending; ++i) {
+            if (!exec_stmt(DB_SAVEPOINT)) {
+                ok[i] = false;
+                continue;
+            }
+            ok[i] = insert_pr(&pending[i].pr);
+            if (!ok[i])
+                exec_stmt(DB_ROLLBACK_TO);
+            exec_stmt(DB_RELEASE);
+        }
+
+        committed = exec_stmt(DB_COMMIT);
+        if (!committed)
+            exec_stmt(DB_ROLLBACK);
+    }
+
+    // Callbacks may queue more PRs, so empty the queue first.
+    struct pending_pr done[DB_BATCH_MAX];
+    int ndone = npending;
+    memcpy(done, pending, ndone * sizeof done[0]);
+    npending = 0;
+
+    for (int i = 0; i < ndone; ++i) {
+        done[i].pr.nick = done[i].nick;
+        done[i].pr.lift = done[i].lift;
+        if (committed && ok[i])
+            prcache_update(&done[i].pr);
+        done[i].cb(&done[i].pr, committed && ok[i], done[i].data);
+    }
+}
+
+// Fetches the nick's PRs from the database, handing each row to |cb| as it
+// is read, and caches them.
+static bool
+fetch_top_prs(const char *nick, db_row_cb cb, void *data)
+{
+    struct prbot_pr *prs = NULL;
+    int nprs = 0;
+    bool ok = true;
+
+    sqlite3_stmt *stmt = db_stmt(DB_TOP_PRS);
+    sqlite3_bind_text(stmt, 1, nick, -1, SQLITE_STATIC);
+
+    int retval;
+    while (ok && (retval = sqlite3_step(stmt)) == SQLITE_ROW) {
+        // There are 6 columns:
+        //
+        // 0. nick
+        // 1. lift
+        // 2. date
+        // 3. sets
+        // 4. reps
+        // 5. kgs
+        struct prbot_pr pr = {
+            .nick = (char *) nick,
+            .lift = (char *) sqlite3_column_text(stmt, 1),
+            .date = (time_t) sqlite3_column_int64(stmt, 2),
+            .sets = sqlite3_column_int(stmt, 3),
+            .reps = sqlite3_column_int(stmt, 4),
+            .kgs = sqlite3_column_double(stmt, 5)
+        };
+        ok = cb(&pr, data);
+
+        // Keep a copy for the cache; the column text goes away with the next step.
+        struct prbot_pr *grown = realloc(prs, (nprs + 1) * sizeof *grown);
+        if (!grown || !(pr.lift = strdup(pr.lift))) {
+            prs = grown ? grown : prs;
+            ok = false;
+            break;
+        }
+        prs = grown;
+        prs[nprs++] = pr;
+    }
+    if (ok && retval != SQLITE_DONE)
+        ok = false;
+    db_stmt_done(stmt);
+
+    if (ok)
+        prcache_put(nick, prs, nprs);
+    for (int i = 0; i < nprs; ++i)
+        free(prs[i].lift);
+    free(prs);
+    return ok;
+}
+
+bool
+db_top_prs(const char *nick, db_row_cb cb, void *data)
+{
+    // Queued PRs must show up (and be acknowledged) first.
+    db_flush();
+
+    const struct prbot_pr *prs;
+    int nprs;
+    if (!prcache_lookup(nick, &prs, &nprs))
+        return fetch_top_prs(nick, cb, data);
+
+    for (int i = 0; i < nprs; ++i) {
+        if (!cb(&prs[i], data))
+            return false;
+    }
+    return true;
+}
+
+// Bulk loading state: rows so far, the first PR's ID, and the last nick seen,
+// since imported logs tend to have runs of the same nick.
+static long import_rows;
+static sqlite3_int64 import_first_id = -1;
+static char import_nick[DB_NAME_MAX];
+static sqlite3_int64 import_nick_id = -1;
+
+// Indexes dropped for the import, to be built again at the end.
+struct dropped_index {
+    char *name;
+    char *sql;
+};
+static struct dropped_index *import_indexes;
+static int import_nindexes;
+
+bool
+db_import_begin(void)
+{
+    import_rows = 0;
+    import_first_id = -1;
+    import_nick_id = -1;
+
+    // Rows arrive in no particular (nick, lift) order, so index inserts touch
+    // pages all over the file: keep enough of them around to not thrash.
+    char pragma[64];
+    snprintf(pragma, sizeof pragma, "PRAGMA cache_size = -%d;", DB_IMPORT_CACHE_KB);
+    return sqlite3_exec(db, pragma, 0, 0, 0) == SQLITE_OK && exec_stmt(DB_BEGIN);
+}
+
+// Drops the indexes on prs and the best tables, remembering how to build them again.
+// Whoever added them in a migration needn't know about this.
+static bool
+drop_indexes(void)
+{
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT name, sql FROM sqlite_master "
+                               "WHERE type = 'index' AND sql IS NOT NULL "
+                               "AND tbl_name IN ('prs', 'best_prs', 'best_e1rms');",
+                           -1, &stmt, NULL) != SQLITE_OK)
+    {
+        return false;
+    }
+
+    bool ok = true;
+    while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+        struct dropped_index *indexes =
+            realloc(import_indexes, (import_nindexes + 1) * sizeof *indexes);
+        if (!indexes) {
+            ok = false;
+            break;
+        }
+        import_indexes = indexes;
+
+        struct dropped_index *dropped = &indexes[import_nindexes++];
+        dropped->name = strdup((const char *) sqlite3_column_text(stmt, 0));
+        dropped->sql = strdup((const char *) sqlite3_column_text(stmt, 1));
+        ok = dropped->name && dropped->sql;
+    }
+    sqlite3_finalize(stmt);
+
+    // The schema can't change under a running SELECT, so drop them afterwards.
+    for (int i = 0; ok && i < import_nindexes; ++i) {
+        char drop[DB_NAME_MAX + 32];
+        snprintf(drop, sizeof drop, "DROP INDEX \"%s\";", import_indexes[i].name);
+        ok = sqlite3_exec(db, drop, 0, 0, 0) == SQLITE_OK;
+    }
+    return ok;
+}
+
+bool
+db_import_pr(struct prbot_pr *pr, int lift_id)
+{
+    if (strlen(pr->nick) >= DB_NAME_MAX)
+        return false;
+
+    if (import_nick_id < 0 || strcmp(import_nick, pr->nick) != 0) {
+        import_nick_id = intern(DB_NICK_ID, DB_INSERT_NICK, pr->nick);
+        if (import_nick_id < 0)
+            return false;
+        strcpy(import_nick, pr->nick);
+    }
+
+    // best_prs is brought up to date once, at the end.
+    if (!exec_pr_stmt(DB_INSERT_PR, import_nick_id, lift_id, pr))
+        return false;
+    if (import_first_id < 0)
+        import_first_id = sqlite3_last_insert_rowid(db);
+
+    // Past a certain size, sorting everything into fresh indexes at the end
+    // beats keeping them up to date row by row.
+    if (++import_rows == DB_IMPORT_REINDEX_ROWS)
+        return drop_indexes();
+    return true;
+}
+
+bool
+db_import_end(bool commit)
+{
+    // The best tables first, while their own indexes are still gone.
+    enum db_stmtid refresh[] = { DB_IMPORT_BEST_PRS, DB_IMPORT_BEST_E1RMS };
+    for (int i = 0; commit && import_first_id >= 0 && i < 2; ++i) {
+        sqlite3_stmt *stmt = db_stmt(refresh[i]);
+        sqlite3_bind_int64(stmt, 1, import_first_id);
+        commit = sqlite3_step(stmt) == SQLITE_DONE;
+        db_stmt_done(stmt);
+    }
+
+    for (int i = 0; commit && i < import_nindexes; ++i)
+        commit = sqlite3_exec(db, import_indexes[i].sql, 0, 0, 0) == SQLITE_OK;
+
+    for (int i = 0; i < import_nindexes; ++i) {
+        free(import_indexes[i].name);
+        free(import_indexes[i].sql);
+    }
+    free(import_indexes);
+    import_indexes = NULL;
+    import_nindexes = 0;
+    import_nick_id = -1;
+
+    // Rolling back brings back any dropped indexes, too.
+    if (commit && exec_stmt(DB_COMMIT))
+        return true;
+    exec_stmt(DB_ROLLBACK);
+    return false;
+}
+
+bool
+db_export(db_row_cb cb, void *data)
+{
+    sqlite3_stmt *stmt = db_stmt(DB_EXPORT_PRS);
+    bool ok = true;
+    int retval = SQLITE_DONE;
+    while (ok && (retval = sqlite3_step(stmt)) == SQLITE_ROW) {
+        struct prbot_pr pr = {
+            .nick = (char *) sqlite3_column_text(stmt, 0),
+            .lift = (char *) sqlite3_column_text(stmt, 1),
+            .date = (time_t) sqlite3_column_int64(stmt, 2),
+            .sets = sqlite3_column_int(stmt, 3),
+            .reps = sqlite3_column_int(stmt, 4),
+            .kgs = sqlite3_column_double(stmt, 5)
+        };
+        ok = cb(&pr, data);
+    }
+    if (ok && retval != SQLITE_DONE)
+        ok = false;
+    db_stmt_done(stmt);
+    return ok;
+}
+
+// Single-producer, single-consumer ring of jobs. The producer only ever
+// advances |tail| and the consumer only ever advances |head|, so no lock is
+// needed: each side publishes its index with release semantics.
+struct job_ring {
+    struct db_job *slots[DB_QUEUE_LEN];
+    unsigned head;
+    unsigned tail;
+};
+
+static bool
+ring_push(struct job_ring *ring, struct db_job *job)
+{
+    unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (tail - head == DB_QUEUE_LEN)
+        return false;
+
+    ring->slots[tail % DB_QUEUE_LEN] = job;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static struct db_job *
+ring_pop(struct job_ring *ring)
+{
+    unsigned head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return NULL;
+
+    struct db_job *job = ring->slots[head % DB_QUEUE_LEN];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return job;
+}
+
+static struct job_ring requests; // Network thread -> database thread.
+static struct job_ring results;  // Database thread -> network thread.
+
+// Jobs submitted but not yet reaped. Network thread only.
+// Bounding this by DB_QUEUE_LEN guarantees that |results| never overflows.
+static int inflight;
+
+static pthread_t worker;
+static bool stopping;
+
+static void
+signal_fd(int fd)
+{
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof one) < 0 && errno == EINTR)
+        ;
+}
+
+static void
+drain_fd(int fd)
+{
+    uint64_t count;
+    while (read(fd, &count, sizeof count) < 0 && errno == EINTR)
+        ;
+}
+
+static void *
+worker_main(void *unused)
+{
+    (void) unused;
+    for (;;) {
+        // Sleep until there is work, or until the write-behind queue is due.
+        struct pollfd pfd = { .fd = request_fd, .events = POLLIN };
+        if (poll(&pfd, 1, db_flush_timeout()) < 0 && errno != EINTR)
+            perror("db worker: poll()");
+
+        bool stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        if (pfd.revents & POLLIN)
+            drain_fd(request_fd);
+
+        struct db_job *job;
+        while ((job = ring_pop(&requests)))
+            job->run(job);
+
+        if (stop) {
+            db_flush();
+            return NULL;
+        }
+        if (db_flush_timeout() == 0)
+            db_flush();
+    }
+}
+
+bool
+db_worker_start(void)
+{
+    request_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    result_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (request_fd < 0 || result_fd < 0) {
+        perror("db_worker_start(): eventfd()");
+        return false;
+    }
+
+    int err = pthread_create(&worker, NULL, worker_main, NULL);
+    if (err) {
+        fprintf(stderr, "db_worker_start(): pthread_create(): %s\n", strerror(err));
+        return false;
+    }
+    return true;
+}
+
+// Waits for the database thread to finish every submitted job, then stops it.
+// Finished jobs are left for a final db_reap().
+void
+db_worker_stop(void)
+{
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    signal_fd(request_fd);
+    pthread_join(worker, NULL);
+}
+
+bool
+db_submit(struct db_job *job)
+{
+    if (inflight == DB_QUEUE_LEN)
+        return false;
+
+    bool pushed = ring_push(&requests, job);
+    assert(pushed);
+    inflight++;
+    signal_fd(request_fd);
+    return true;
+}
+
+void
+db_complete(struct db_job *job)
+{
+    bool pushed = ring_push(&results, job);
+    assert(pushed);
+    signal_fd(result_fd);
+}
+
+int
+db_result_fd(void)
+{
+    return result_fd;
+}
+
+void
+db_reap(void)
+{
+    drain_fd(result_fd);
+
+    struct db_job *job;
+    while ((job = ring_pop(&results))) {
+        inflight--;
+        job->done(job);
+    }
+}
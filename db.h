@@ -0,0 +1,158 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Owner of the SQLite database handle.
+// The schema is versioned with PRAGMA user_version, and every statement is
+// prepared once at startup.
+//
+// Once db_worker_start() has been called, the database belongs to a worker
+// thread: all further work must be submitted to it as a struct db_job.
+
+#include <stdbool.h>
+#include <time.h>
+#include <sqlite3.h>
+
+#ifndef prbot_db_h__
+#define prbot_db_h__
+
+// Identifies a statement in the statement cache.
+enum db_stmtid {
+    DB_BEGIN,
+    DB_COMMIT,
+    DB_ROLLBACK,
+    DB_SAVEPOINT,
+    DB_RELEASE,
+    DB_ROLLBACK_TO,
+    DB_NICK_ID,
+    DB_INSERT_NICK,
+    DB_LIFT_ID,
+    DB_INSERT_LIFT,
+    DB_INSERT_PR,
+    DB_UPDATE_BEST_PR,
+    DB_TOP_PRS,
+    DB_ALL_LIFTS,
+    DB_ALL_LIFT_ALIASES,
+    DB_TOP_BY_KGS,
+    DB_TOP_BY_E1RM,
+    DB_HISTORY_PAGE,
+    DB_HISTORY_SEEK,
+    DB_BEST_E1RM,
+    DB_IMPORT_BEST_PRS,
+    DB_EXPORT_PRS,
+    DB_UPDATE_BEST_E1RM,
+    DB_IMPORT_BEST_E1RMS,
+    DB_NUM_STMTS
+};
+
+// Longest nick or lift name the database accepts, including the null-terminator.
+#define DB_NAME_MAX 256
+
+// Most jobs that may be in flight at once. Must be a power of two.
+#define DB_QUEUE_LEN 256
+
+// Queued PRs are committed together once this many are waiting...
+#define DB_BATCH_MAX 64
+// ...or once the oldest has waited this long.
+#define DB_BATCH_DELAY_MS 50
+
+struct prbot_pr {
+    char *nick;
+    char *lift;
+    time_t date;
+    int sets;
+    int reps;
+    double kgs;
+};
+
+// A unit of work for the database thread. Embed this as the first member of
+// a larger struct to carry arguments and results.
+struct db_job {
+    // Runs on the database thread, and must lead to exactly one db_complete()
+    // call, either before returning or later (e.g. from a db_queue_pr() callback).
+    void (*run)(struct db_job *job);
+
+    // Runs on the network thread, from db_reap(), after db_complete().
+    void (*done)(struct db_job *job);
+};
+
+// Startup, in order: open (and create, if necessary) the database, bring its
+// schema up to date, then prepare all statements.
+bool db_open(const char *filename, const char *synchronous);
+bool db_migrate(void);
+bool db_prepare(void);
+void db_close(void);
+const char *db_errmsg(void);
+
+// Borrows a cached statement. Must be handed back with db_stmt_done().
+sqlite3_stmt *db_stmt(enum db_stmtid id);
+void db_stmt_done(sqlite3_stmt *stmt);
+
+bool db_insert_pr(struct prbot_pr *pr);
+
+// Estimated one-rep max for a set of |reps| at |kgs|.
+double db_e1rm(int reps, double kgs);
+
+// Write-behind insertion. Queued PRs are group-committed by db_flush(), which
+// the caller must run once db_flush_timeout() expires.
+typedef void (*db_insert_cb)(struct prbot_pr *pr, bool ok, void *data);
+bool db_queue_pr(struct prbot_pr *pr, db_insert_cb cb, void *data);
+int db_flush_timeout(void);
+void db_flush(void);
+
+// Runs |cb| on each of the nick's best (heaviest) PRs, sorted by lift, stopping early
+// if it returns false. Queued PRs are flushed first, and repeated lookups are
+// served from an in-memory cache.
+typedef bool (*db_row_cb)(const struct prbot_pr *pr, void *data);
+bool db_top_prs(const char *nick, db_row_cb cb, void *data);
+
+// Bulk loading, for use before db_worker_start(). The whole import is one
+// transaction, so it either lands completely or not at all, and can simply be
+// run again after a failure. |lift_id| must come from the lift registry.
+bool db_import_begin(void);
+bool db_import_pr(struct prbot_pr *pr, int lift_id);
+bool db_import_end(bool commit);
+
+// Imports bigger than this many PRs rebuild the indexes on prs and the best tables
+// from scratch at the end, rather than updating them as they go.
+#define DB_IMPORT_REINDEX_ROWS 100000
+// Page cache for the import, in KiB.
+#define DB_IMPORT_CACHE_KB (256 * 1024)
+
+// Runs |cb| on every PR ever recorded, oldest first, straight off a cursor.
+bool db_export(db_row_cb cb, void *data);
+
+// Database thread. Jobs are passed through lock-free single-producer,
+// single-consumer rings in both directions.
+bool db_worker_start(void);
+void db_worker_stop(void);
+
+// Network thread: hands a job to the database thread. Fails if DB_QUEUE_LEN
+// jobs are already in flight.
+bool db_submit(struct db_job *job);
+
+// Database thread: hands a finished job back to the network thread.
+void db_complete(struct db_job *job);
+
+// Network thread: becomes readable when finished jobs are waiting for db_reap(),
+// which runs their done() callbacks.
+int db_result_fd(void);
+void db_reap(void);
+
+#endif // prbot_db_h__
@@ -19,15 +19,24 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 
 #include "irc.h"
@@ -37,386 +46,1941 @@ ircbuf_init(struct ircbuf *ircbuf, char *buf, int len)
 {
     ircbuf->buf = buf;
     ircbuf->max = len;
+    ircbuf->start = 0;
     ircbuf->count = 0;
-    ircbuf->msglen = -1;
+    ircbuf->scanned = 0;
+    ircbuf->discarding = false;
+}
+
+static long long
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
 bool
-irc_vsend(int fd, const char *fmt, va_list argp)
+ircloop_init(struct ircloop *loop)
+{
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->running = false;
+    memset(loop->wheel, 0, sizeof loop->wheel);
+    loop->tick = 0;
+    loop->start_ms = now_ms();
+    loop->ntimers = 0;
+    if (loop->epfd < 0) {
+        perror("ircloop_init(): epoll_create1()");
+        return false;
+    }
+    return true;
+}
+
+void
+ircloop_free(struct ircloop *loop)
+{
+    close(loop->epfd);
+    loop->epfd = -1;
+}
+
+static uint32_t
+watch_events(struct ircwatch *watch)
 {
-    char buf[1024];
+    return EPOLLIN | (watch->want_write ? EPOLLOUT : 0);
+}
 
-    int len = vsnprintf(buf, 1024, fmt, argp);
-    assert(len >= 0 && len < 1024);
+bool
+ircloop_add(struct ircloop *loop, struct ircwatch *watch)
+{
+    struct epoll_event ev = { .events = watch_events(watch), .data.ptr = watch };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, watch->fd, &ev) < 0) {
+        perror("ircloop_add(): epoll_ctl()");
+        return false;
+    }
+    return true;
+}
+
+// Arms or disarms the watch's on_writable callback.
+bool
+ircloop_want_write(struct ircloop *loop, struct ircwatch *watch, bool want)
+{
+    if (watch->want_write == want)
+        return true;
+
+    watch->want_write = want;
+    struct epoll_event ev = { .events = watch_events(watch), .data.ptr = watch };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, watch->fd, &ev) < 0) {
+        perror("ircloop_want_write(): epoll_ctl()");
+        return false;
+    }
+    return true;
+}
+
+void
+ircloop_remove(struct ircloop *loop, struct ircwatch *watch)
+{
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, watch->fd, NULL);
+}
+
+void
+irctimer_init(struct irctimer *timer, void (*fire)(struct irctimer *timer), void *data)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires_ms = 0;
+    timer->fire = fire;
+    timer->data = data;
+}
+
+bool
+irctimer_pending(const struct irctimer *timer)
+{
+    return timer->pprev != NULL;
+}
+
+static void
+timer_link(struct irctimer **head, struct irctimer *timer)
+{
+    timer->next = *head;
+    if (*head)
+        (*head)->pprev = &timer->next;
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void
+timer_unlink(struct irctimer *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// Files |timer| under the tick it expires on, in the lowest level whose
+// slots do not wrap around before then.
+static void
+timer_place(struct ircloop *loop, struct irctimer *timer)
+{
+    long long after = timer->expires_ms - loop->start_ms;
+    unsigned long long expires = after <= 0 ? 0 : (after + IRCWHEEL_TICK_MS - 1) / IRCWHEEL_TICK_MS;
+    if (expires < loop->tick)
+        expires = loop->tick;
+
+    unsigned long long delta = expires - loop->tick;
+    int level = 0;
+    while (level < IRCWHEEL_LEVELS - 1 && delta >> ((level + 1) * IRCWHEEL_BITS))
+        level++;
+    // Too far off even for the top level: come back around then.
+    if (delta >> (IRCWHEEL_LEVELS * IRCWHEEL_BITS))
+        expires = loop->tick + (1ULL << (IRCWHEEL_LEVELS * IRCWHEEL_BITS)) - 1;
+
+    int slot = (expires >> (level * IRCWHEEL_BITS)) & (IRCWHEEL_SLOTS - 1);
+    timer_link(&loop->wheel[level][slot], timer);
+}
+
+void
+ircloop_schedule(struct ircloop *loop, struct irctimer *timer, long delay_ms)
+{
+    if (irctimer_pending(timer))
+        timer_unlink(timer);
+    else
+        loop->ntimers++;
+    timer->expires_ms = now_ms() + (delay_ms > 0 ? delay_ms : 0);
+    timer_place(loop, timer);
+}
+
+void
+ircloop_cancel(struct ircloop *loop, struct irctimer *timer)
+{
+    if (!irctimer_pending(timer))
+        return;
+    timer_unlink(timer);
+    loop->ntimers--;
+}
+
+// Slot |slot| of |level| has come around: spread its timers over the levels
+// below.
+static void
+cascade(struct ircloop *loop, int level, int slot)
+{
+    struct irctimer *timer = loop->wheel[level][slot];
+    loop->wheel[level][slot] = NULL;
+    while (timer) {
+        struct irctimer *next = timer->next;
+        timer_place(loop, timer);
+        timer = next;
+    }
+}
+
+// Runs every tick up to now.
+static void
+run_timers(struct ircloop *loop)
+{
+    long long now = now_ms();
+    unsigned long long now_tick = (now - loop->start_ms) / IRCWHEEL_TICK_MS;
+
+    while (loop->ntimers > 0 && loop->tick <= now_tick) {
+        int slot = loop->tick & (IRCWHEEL_SLOTS - 1);
+        for (int level = 1; slot == 0 && level < IRCWHEEL_LEVELS; ++level) {
+            slot = (loop->tick >> (level * IRCWHEEL_BITS)) & (IRCWHEEL_SLOTS - 1);
+            cascade(loop, level, slot);
+        }
+
+        // Take the whole slot first: callbacks may schedule and cancel
+        // timers, including the ones still to run here.
+        struct irctimer *due = NULL;
+        struct irctimer **head = &loop->wheel[0][loop->tick & (IRCWHEEL_SLOTS - 1)];
+        if (*head) {
+            due = *head;
+            due->pprev = &due;
+            *head = NULL;
+        }
+        long long tick_ms = loop->start_ms + (long long) loop->tick * IRCWHEEL_TICK_MS;
+        loop->tick++;
+
+        while (due) {
+            struct irctimer *timer = due;
+            timer_unlink(timer);
+            if (timer->expires_ms > tick_ms) {
+                // Clamped by timer_place(); not due yet.
+                timer_place(loop, timer);
+                continue;
+            }
+            loop->ntimers--;
+            timer->fire(timer);
+        }
+    }
+
+    // Nothing to wait for: skip ahead rather than stepping through idle ticks later.
+    if (loop->ntimers == 0 && loop->tick <= now_tick)
+        loop->tick = now_tick + 1;
+}
+
+// Milliseconds until run_timers() may have work to do, or -1 for never.
+// Looks no further than the next turn of the second level, which bounds the
+// scan and leaves far-off timers to be found after they cascade.
+static int
+timers_timeout(struct ircloop *loop)
+{
+    if (loop->ntimers == 0)
+        return -1;
+
+    // The bottom level holds exactly the next IRCWHEEL_SLOTS ticks.
+    unsigned long long tick = ~0ULL;
+    for (int i = 0; i < IRCWHEEL_SLOTS; ++i) {
+        if (loop->wheel[0][(loop->tick + i) & (IRCWHEEL_SLOTS - 1)]) {
+            tick = loop->tick + i;
+            break;
+        }
+    }
+
+    // The levels above only matter once they cascade.
+    unsigned long long point = (loop->tick + IRCWHEEL_SLOTS - 1) & ~(IRCWHEEL_SLOTS - 1ULL);
+    while (point < tick) {
+        int slot = (point >> IRCWHEEL_BITS) & (IRCWHEEL_SLOTS - 1);
+        if (slot == 0 || loop->wheel[1][slot]) {
+            tick = point;
+            break;
+        }
+        point += IRCWHEEL_SLOTS;
+    }
+
+    long long wait = loop->start_ms + (long long) tick * IRCWHEEL_TICK_MS - now_ms();
+    return wait < 0 ? 0 : wait;
+}
+
+void
+ircloop_run(struct ircloop *loop)
+{
+#define MAX_EVENTS 32
+    struct epoll_event events[MAX_EVENTS];
+
+    loop->running = true;
+    while (loop->running) {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, timers_timeout(loop));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("ircloop_run(): epoll_wait()");
+            return;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            struct ircwatch *watch = events[i].data.ptr;
+            uint32_t ev = events[i].events;
+
+            if ((ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) && watch->on_readable)
+                watch->on_readable(watch);
+            // The read callback may have closed the fd.
+            if ((ev & EPOLLOUT) && watch->fd >= 0 && watch->on_writable)
+                watch->on_writable(watch);
+        }
+
+        run_timers(loop);
+    }
+#undef MAX_EVENTS
+}
+
+void
+ircloop_stop(struct ircloop *loop)
+{
+    loop->running = false;
+}
+
+static void conn_readable(struct ircwatch *watch);
+static void conn_writable(struct ircwatch *watch);
+static void conn_flood_timer(struct irctimer *timer);
+static void conn_keepalive(struct irctimer *timer);
+static void free_output(struct ircconn *conn);
+static void free_batches(struct ircconn *conn);
+
+bool
+ircconn_init(struct ircconn *conn, struct ircloop *loop, int fd, char *buf, int len)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("ircconn_init(): fcntl()");
+        return false;
+    }
+
+    conn->watch.fd = fd;
+    conn->watch.want_write = false;
+    conn->watch.on_readable = conn_readable;
+    conn->watch.on_writable = conn_writable;
+    conn->watch.data = conn;
+    conn->loop = loop;
+    ircbuf_init(&conn->in, buf, len);
+    conn->caps = 0;
+    conn->caps_wanted = 0;
+    conn->cap_negotiating = false;
+    conn->batches = NULL;
+    conn->done_batch = NULL;
+    conn->nbatches = 0;
+    conn->batched_lines = 0;
+    conn->batched_bytes = 0;
+
+    conn->control.head = conn->control.tail = NULL;
+    conn->ready.head = conn->ready.tail = NULL;
+    conn->targets = conn->targets_tail = NULL;
+    conn->ready_sent = 0;
+    conn->queued = 0;
+    irctimer_init(&conn->flood_timer, conn_flood_timer, conn);
+    ircconn_set_flood(conn, IRCFLOOD_BURST, IRCFLOOD_INTERVAL_MS);
+
+    if (!ircloop_add(loop, &conn->watch)) {
+        conn->watch.fd = -1;
+        return false;
+    }
+
+    conn->input_ms = now_ms();
+    conn->ping_ms = 0;
+    conn->lag_ms = -1;
+    irctimer_init(&conn->keepalive_timer, conn_keepalive, conn);
+    ircconn_set_keepalive(conn, IRCKEEPALIVE_IDLE_MS, IRCKEEPALIVE_TIMEOUT_MS);
+    return true;
+}
+
+bool
+ircconn_isopen(struct ircconn *conn)
+{
+    return conn->watch.fd >= 0;
+}
+
+void
+ircconn_close(struct ircconn *conn)
+{
+    if (!ircconn_isopen(conn))
+        return;
+
+    ircloop_remove(conn->loop, &conn->watch);
+    close(conn->watch.fd);
+    conn->watch.fd = -1;
+    conn->watch.want_write = false;
+    ircloop_cancel(conn->loop, &conn->flood_timer);
+    ircloop_cancel(conn->loop, &conn->keepalive_timer);
+    free_output(conn);
+    free_batches(conn);
+
+    if (conn->on_close)
+        conn->on_close(conn);
+}
+
+// A queued line, or a few for irc_send() calls that send several at once.
+struct ircqline {
+    struct ircqline *next;
+    int len;
+    int cost; // Lines, as far as the flood bucket is concerned.
+    char text[];
+};
+
+// The PRIVMSGs waiting for one channel or nick.
+struct irctarget {
+    struct irctarget *next;
+    struct ircqueue lines;
+    char name[];
+};
+
+static void
+queue_push(struct ircqueue *queue, struct ircqline *line)
+{
+    line->next = NULL;
+    if (queue->tail)
+        queue->tail->next = line;
+    else
+        queue->head = line;
+    queue->tail = line;
+}
+
+static struct ircqline *
+queue_pop(struct ircqueue *queue)
+{
+    struct ircqline *line = queue->head;
+    if (line) {
+        queue->head = line->next;
+        if (!queue->head)
+            queue->tail = NULL;
+    }
+    return line;
+}
+
+static void
+queue_free(struct ircqueue *queue)
+{
+    struct ircqline *line;
+    while ((line = queue_pop(queue)))
+        free(line);
+}
+
+static void
+free_output(struct ircconn *conn)
+{
+    queue_free(&conn->control);
+    queue_free(&conn->ready);
+    while (conn->targets) {
+        struct irctarget *next = conn->targets->next;
+        queue_free(&conn->targets->lines);
+        free(conn->targets);
+        conn->targets = next;
+    }
+    conn->targets_tail = NULL;
+    conn->ready_sent = 0;
+    conn->queued = 0;
+}
+
+// Finds the queue for |name|, adding it at the back of the round if new.
+static struct irctarget *
+find_target(struct ircconn *conn, const char *name)
+{
+    for (struct irctarget *target = conn->targets; target; target = target->next) {
+        if (strcmp(target->name, name) == 0)
+            return target;
+    }
+
+    size_t len = strlen(name);
+    struct irctarget *target = malloc(sizeof *target + len + 1);
+    if (!target)
+        return NULL;
+    memcpy(target->name, name, len + 1);
+    target->lines.head = target->lines.tail = NULL;
+    target->next = NULL;
+
+    if (conn->targets_tail)
+        conn->targets_tail->next = target;
+    else
+        conn->targets = target;
+    conn->targets_tail = target;
+    return target;
+}
+
+// The first target just had a turn: send it to the back, or drop it if it
+// has nothing left.
+static void
+rotate_targets(struct ircconn *conn)
+{
+    struct irctarget *target = conn->targets;
+    conn->targets = target->next;
+    if (!conn->targets)
+        conn->targets_tail = NULL;
+
+    if (!target->lines.head) {
+        free(target);
+        return;
+    }
+
+    target->next = NULL;
+    if (conn->targets_tail)
+        conn->targets_tail->next = target;
+    else
+        conn->targets = target;
+    conn->targets_tail = target;
+}
+
+// Where the next line to send comes from, or NULL if nothing is waiting.
+static struct ircqueue *
+next_queue(struct ircconn *conn)
+{
+    if (conn->control.head)
+        return &conn->control;
+    if (conn->targets)
+        return &conn->targets->lines;
+    return NULL;
+}
+
+void
+ircconn_set_flood(struct ircconn *conn, int burst, int interval_ms)
+{
+    assert(burst >= 1 && interval_ms >= 0);
+    conn->flood.burst = burst;
+    conn->flood.interval_ms = interval_ms;
+    conn->credit_ms = (long) burst * interval_ms;
+    conn->refilled_ms = now_ms();
+}
+
+// Moves lines to |ready| for as long as the bucket has tokens. If any are
+// left waiting, the timer is scheduled for when the next token arrives.
+static bool
+release(struct ircconn *conn)
+{
+    long long now = now_ms();
+    long max = (long) conn->flood.burst * conn->flood.interval_ms;
+    conn->credit_ms += now - conn->refilled_ms;
+    if (conn->credit_ms > max)
+        conn->credit_ms = max;
+    conn->refilled_ms = now;
+
+    struct ircqueue *queue;
+    while ((queue = next_queue(conn)) && conn->credit_ms >= conn->flood.interval_ms) {
+        struct ircqline *line = queue_pop(queue);
+        conn->credit_ms -= (long) line->cost * conn->flood.interval_ms;
+        if (queue != &conn->control)
+            rotate_targets(conn);
+        queue_push(&conn->ready, line);
+    }
+
+    // Tokens only come back with time, so a scheduled timer is never late.
+    if (next_queue(conn) && !irctimer_pending(&conn->flood_timer))
+        ircloop_schedule(conn->loop, &conn->flood_timer, conn->flood.interval_ms - conn->credit_ms);
+    return true;
+}
+
+// Writes as much of |ready| as the socket will take, coalescing lines into
+// as few system calls as possible.
+static bool
+conn_flush(struct ircconn *conn)
+{
+    while (conn->ready.head) {
+        struct iovec iov[IRCCONN_IOV];
+        int n = 0;
+        for (struct ircqline *line = conn->ready.head; line && n < IRCCONN_IOV; line = line->next) {
+            iov[n].iov_base = line->text;
+            iov[n].iov_len = line->len;
+            n++;
+        }
+        iov[0].iov_base = conn->ready.head->text + conn->ready_sent;
+        iov[0].iov_len -= conn->ready_sent;
+
+        // sendmsg() is writev() with MSG_NOSIGNAL.
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+        ssize_t sent = sendmsg(conn->watch.fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            perror("sendmsg()");
+            ircconn_close(conn);
+            return false;
+        }
+
+        // Drop the lines that went out whole.
+        sent += conn->ready_sent;
+        while (conn->ready.head && sent >= conn->ready.head->len) {
+            struct ircqline *line = queue_pop(&conn->ready);
+            sent -= line->len;
+            conn->queued -= line->len;
+            free(line);
+        }
+        conn->ready_sent = sent;
+    }
+
+    return ircloop_want_write(conn->loop, &conn->watch, conn->ready.head != NULL);
+}
+
+// Queues raw bytes for sending. Messages are never split: if the whole
+// message does not fit in the queue, none of it is queued. Messages with a
+// |target| take turns with other targets; those without go ahead of them.
+static bool
+conn_write(struct ircconn *conn, const char *target, const char *buf, int len)
+{
+    if (!ircconn_isopen(conn))
+        return false;
+    if (len > IRCCONN_OUT_MAX - conn->queued) {
+        fprintf(stderr, "Output queue full, dropping message.\n");
+        return false;
+    }
+
+    struct ircqline *line = malloc(sizeof *line + len);
+    if (!line)
+        return false;
+    memcpy(line->text, buf, len);
+    line->len = len;
+    line->cost = 0;
+    for (const char *p = buf; (p = memchr(p, '\n', buf + len - p)); p++)
+        line->cost++;
+
+    struct ircqueue *queue = &conn->control;
+    if (target) {
+        struct irctarget *t = find_target(conn, target);
+        if (!t) {
+            free(line);
+            return false;
+        }
+        queue = &t->lines;
+    }
+    queue_push(queue, line);
+    conn->queued += len;
+
+    if (!release(conn))
+        return false;
+
+    // If output was already backed up, leave it for conn_writable().
+    if (conn->watch.want_write)
+        return true;
+    return conn_flush(conn);
+}
+
+static void
+conn_writable(struct ircwatch *watch)
+{
+    conn_flush(watch->data);
+}
+
+// The bucket has a token for the first waiting line.
+static void
+conn_flood_timer(struct irctimer *timer)
+{
+    struct ircconn *conn = timer->data;
+    if (release(conn) && !conn->watch.want_write)
+        conn_flush(conn);
+}
+
+void
+ircconn_set_keepalive(struct ircconn *conn, int idle_ms, int timeout_ms)
+{
+    assert(idle_ms >= 0 && timeout_ms > 0);
+    conn->keepalive.idle_ms = idle_ms;
+    conn->keepalive.timeout_ms = timeout_ms;
+
+    // An idle time of 0 turns keepalive off.
+    if (idle_ms == 0)
+        ircloop_cancel(conn->loop, &conn->keepalive_timer);
+    else if (ircconn_isopen(conn))
+        ircloop_schedule(conn->loop, &conn->keepalive_timer, 0);
+}
+
+// Pings a quiet server, and gives up on one that stays quiet.
+static void
+conn_keepalive(struct irctimer *timer)
+{
+    struct ircconn *conn = timer->data;
+    long long now = now_ms();
+
+    // Our PING is out, and nothing has come back since.
+    if (conn->ping_ms > conn->input_ms) {
+        long left = conn->ping_ms + conn->keepalive.timeout_ms - now;
+        if (left <= 0) {
+            fprintf(stderr, "Ping timeout: no reply in %d ms.\n", conn->keepalive.timeout_ms);
+            ircconn_close(conn);
+            return;
+        }
+        ircloop_schedule(conn->loop, timer, left);
+        return;
+    }
+
+    long idle = now - conn->input_ms;
+    if (idle < conn->keepalive.idle_ms) {
+        ircloop_schedule(conn->loop, timer, conn->keepalive.idle_ms - idle);
+        return;
+    }
+
+    conn->ping_ms = now;
+    irc_send(conn, "PING :%lld\r\n", now);
+    ircloop_schedule(conn->loop, timer, conn->keepalive.timeout_ms);
+}
+
+bool
+irc_pong_handle(struct ircconn *conn, struct ircmsg *msg)
+{
+    // Only the bot's own PINGs carry a timestamp.
+    char *end;
+    errno = 0;
+    long long sent = strtoll(msg->u.pong.text.s, &end, 10);
+    if (errno || end == msg->u.pong.text.s || *end != '\0' || sent != conn->ping_ms)
+        return false;
+
+    conn->lag_ms = now_ms() - sent;
+    return true;
+}
+
+// Cuts every line of |buf| that is longer than the protocol allows down to
+// IRC_LINE_MAX, CR/LF included. An unterminated last line is given its CR/LF.
+// Returns the new length, which is never more than |len| + 2.
+static int
+clip_lines(char *buf, int len)
+{
+    int in = 0;
+    int out = 0;
+    while (in < len) {
+        char *nl = memchr(buf + in, '\n', len - in);
+        int end = nl ? nl - buf + 1 : len;
+        int linelen = end - in;
+        if (nl && linelen <= IRC_LINE_MAX) {
+            memmove(buf + out, buf + in, linelen);
+            out += linelen;
+        } else {
+            // Too long, or cut short by the caller: end it by hand.
+            if (linelen > IRC_LINE_MAX - 2)
+                linelen = IRC_LINE_MAX - 2;
+            memmove(buf + out, buf + in, linelen);
+            out += linelen;
+            buf[out++] = '\r';
+            buf[out++] = '\n';
+        }
+        in = end;
+    }
+    return out;
+}
+
+bool
+irc_vsend(struct ircconn *conn, const char *fmt, va_list argp)
+{
     assert(fmt[strlen(fmt) - 2] == '\r');
     assert(fmt[strlen(fmt) - 1] == '\n');
 
-    int written = write(fd, buf, len);
-    assert(written == len);
-    return true;
+    // Room for the three lines of irc_nick(), and for the CR/LF that
+    // clip_lines() puts back on a line vsnprintf() had to cut short.
+    char buf[IRC_LINE_MAX * 3 + 2];
+    int len = vsnprintf(buf, sizeof buf - 2, fmt, argp);
+    if (len < 0)
+        return false;
+
+    // What goes in the format is mostly the server's own words, such as a
+    // PING's token, and those can be as long as an input line. Anything
+    // past the protocol limit is cut off, not sent.
+    bool cut = len >= (int) sizeof buf - 2;
+    if (cut)
+        len = sizeof buf - 3;
+    int clipped = clip_lines(buf, len);
+    if (cut || clipped < len)
+        fprintf(stderr, "Message too long, sending it cut short.\n");
+
+    return conn_write(conn, NULL, buf, clipped);
 }
 
 bool
-irc_send(int fd, const char *fmt, ...)
+irc_send(struct ircconn *conn, const char *fmt, ...)
 {
     va_list argp;
     va_start(argp, fmt);
-    bool ret = irc_vsend(fd, fmt, argp);
+    bool ret = irc_vsend(conn, fmt, argp);
     va_end(argp);
     return ret;
 }
 
 bool
-irc_pong(int fd, const char *response)
+irc_pong(struct ircconn *conn, const char *response)
 {
-    return irc_send(fd, "PONG :%s\r\n", response);
+    return irc_send(conn, "PONG :%s\r\n", response);
 }
 
 bool
-irc_join(int fd, const char *chan)
+irc_join(struct ircconn *conn, const char *chan)
 {
-    return irc_send(fd, "JOIN %s\r\n", chan);
+    return irc_send(conn, "JOIN %s\r\n", chan);
 }
 
 bool
-irc_nick(int fd, const char *nick, const char *passwd)
+irc_nick(struct ircconn *conn, const char *nick, const char *passwd)
 {
     assert(passwd == NULL); // Unhandled, for now.
     assert(strlen(nick) <= 30);
-    return irc_send(fd, "NICK %s\r\nUSER %s 0 * : %s\r\n", nick, nick, nick);
+
+    // Servers hold registration until CAP END; see irc_cap_handle().
+    // Servers without capabilities just ignore the CAP LS.
+    conn->caps = conn->caps_wanted = 0;
+    conn->cap_negotiating = true;
+    return irc_send(conn, "CAP LS 302\r\nNICK %s\r\nUSER %s 0 * : %s\r\n", nick, nick, nick);
 }
 
 bool
-irc_privmsg(int fd, const char *chan, const char *fmt, ...)
+irc_privmsg(struct ircconn *conn, const char *chan, const char *fmt, ...)
 {
-    int len = 0;
-    char buf[1024];
-    int written;
+    // One whole line, and vsnprintf()'s null-terminator.
+    char buf[IRC_LINE_MAX + 1];
 
     // Write the header boilerplate.
-    written = snprintf(buf, 1024, "PRIVMSG %s :", chan);
-    if (written < 0 || written >= 1024)
+    int len = snprintf(buf, sizeof buf, "PRIVMSG %s :", chan);
+    if (len < 0 || len > IRC_LINE_MAX - 2)
         return false;
-    len += written;
 
     // Add the user message.
     va_list argp;
     va_start(argp, fmt);
-    written = vsnprintf(buf + len, 1024 - len, fmt, argp);
+    int written = vsnprintf(buf + len, sizeof buf - len, fmt, argp);
     va_end(argp);
-
-    if (written < 0 || written >= 1024 - len)
+    if (written < 0)
         return false;
-    len += written;
+
+    // Replies often quote what they were sent, which can be as long as an
+    // input line. The text is cut to fit the protocol limit, and at any line
+    // break, rather than dropped.
+    int textlen = strcspn(buf + len, "\r\n");
+    if (textlen > IRC_LINE_MAX - 2 - len)
+        textlen = IRC_LINE_MAX - 2 - len;
+    if (textlen < written)
+        fprintf(stderr, "Message too long, sending it cut short.\n");
+    len += textlen;
 
     // Finish with a newline.
-    written = snprintf(buf + len, 1024 - len, "\r\n");
-    if (written < 0 || written >= 1024 - len)
-        return false;
-    len += written;
+    buf[len++] = '\r';
+    buf[len++] = '\n';
 
     // Send buffer to server.
-    printf("Sending: %s", buf);
-    written = write(fd, buf, len);
-    assert(written == len);
-    return true;
+    return conn_write(conn, chan, buf, len);
 }
 
-// Constructs a file descriptor with an open connection to the specified server.
-int
-irc_connect(const char *server, const char *port)
+void
+irc_reply_init(struct ircreply *reply, struct ircconn *conn, const char *chan, const char *head)
 {
-    struct addrinfo hints;
-    struct addrinfo *serverlist;
+    reply->conn = conn;
+    reply->chan = chan;
+    reply->head = head;
+    reply->emit = NULL;
+    reply->data = NULL;
+    reply->nentries = 0;
+    reply->nlines = 0;
+
+    // "PRIVMSG <chan> :<text>\r\n"
+    reply->max = IRC_LINE_MAX - IRC_PREFIX_RESERVE - (int) strlen("PRIVMSG  :\r\n") - strlen(chan);
+    assert(reply->max > 0);
+
+    reply->headlen = strlen(head);
+    if (reply->headlen > reply->max / 2)
+        reply->headlen = reply->max / 2;
+    memcpy(reply->text, head, reply->headlen);
+    reply->text[reply->headlen] = '\0';
+    reply->len = reply->headlen;
+}
+
+static bool
+reply_emit(struct ircreply *reply)
+{
+    int headlen = reply->headlen;
+    if (reply->len == headlen)
+        return true;
+
+    reply->nlines++;
+    bool ok = reply->emit ? reply->emit(reply, reply->text, reply->len)
+                          : irc_privmsg(reply->conn, reply->chan, "%s", reply->text);
+    reply->len = headlen;
+    reply->text[headlen] = '\0';
+    return ok;
+}
+
+bool
+irc_reply_add(struct ircreply *reply, const char *fmt, ...)
+{
+    char entry[IRC_LINE_MAX];
+    va_list argp;
+    va_start(argp, fmt);
+    int len = vsnprintf(entry, sizeof entry, fmt, argp);
+    va_end(argp);
+    if (len < 0)
+        return false;
 
+    bool ok = true;
+    if (reply->len + len > reply->max)
+        ok = reply_emit(reply);
+
+    // Whatever does not fit on an empty line is cut off.
+    int room = reply->max - reply->len;
+    if (len > room)
+        len = room;
+    memcpy(reply->text + reply->len, entry, len);
+    reply->len += len;
+    reply->text[reply->len] = '\0';
+    reply->nentries++;
+    return ok;
+}
+
+bool
+irc_reply_finish(struct ircreply *reply)
+{
+    return reply_emit(reply);
+}
+
+static void attempt_ready(struct ircwatch *watch);
+static void attempt_timeout(struct irctimer *timer);
+static void connector_delay(struct irctimer *timer);
+
+// The first address from |s| on that is (or, if !|match|, is not) in |family|.
+static struct addrinfo *
+next_family(struct addrinfo *s, int family, bool match)
+{
+    while (s && (s->ai_family == family) != match)
+        s = s->ai_next;
+    return s;
+}
+
+// A name lookup, on a thread of its own. Until the thread is done with it,
+// the lookup is shared: whichever of the thread and the connector lets go of
+// it last frees it, so abandoning a lookup never waits on the resolver.
+struct irclookup {
+    pthread_mutex_t lock;
+    bool done;      // The thread has finished, and signalled |fd|.
+    bool abandoned; // The connector has let go.
+    int fd;         // An eventfd, signalled when done.
+    int status;     // From getaddrinfo().
+    struct addrinfo *addrs;
+    char *server;
+    char *port;
+};
+
+static void
+lookup_free(struct irclookup *lookup)
+{
+    if (lookup->addrs)
+        freeaddrinfo(lookup->addrs);
+    if (lookup->fd >= 0)
+        close(lookup->fd);
+    pthread_mutex_destroy(&lookup->lock);
+    free(lookup->server);
+    free(lookup->port);
+    free(lookup);
+}
+
+static void *
+lookup_main(void *arg)
+{
+    struct irclookup *lookup = arg;
+
+    struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET; // IPv4.
+    hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM; // TCP.
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    struct addrinfo *addrs = NULL;
+    int status = getaddrinfo(lookup->server, lookup->port, &hints, &addrs);
+
+    // Signalled under the lock, so the connector can't free |fd| meanwhile.
+    pthread_mutex_lock(&lookup->lock);
+    lookup->status = status;
+    lookup->addrs = status ? NULL : addrs;
+    lookup->done = true;
+    bool abandoned = lookup->abandoned;
+    if (!abandoned) {
+        uint64_t one = 1;
+        if (write(lookup->fd, &one, sizeof one) < 0)
+            perror("lookup_main(): write()");
+    }
+    pthread_mutex_unlock(&lookup->lock);
+
+    if (abandoned)
+        lookup_free(lookup);
+    return NULL;
+}
+
+// Lets go of the running lookup, if any. It is freed now if it is done, or
+// else by its thread once the resolver returns.
+static void
+lookup_abandon(struct ircconnector *connector)
+{
+    struct irclookup *lookup = connector->lookup;
+    if (!lookup)
+        return;
+    ircloop_remove(connector->loop, &connector->resolved);
+    connector->lookup = NULL;
+
+    pthread_mutex_lock(&lookup->lock);
+    bool done = lookup->done;
+    lookup->abandoned = true;
+    pthread_mutex_unlock(&lookup->lock);
+    if (done)
+        lookup_free(lookup);
+}
+
+static void connector_resolved(struct ircwatch *watch);
+
+bool
+ircconnector_start(struct ircconnector *connector, struct ircloop *loop,
+                   const char *server, const char *port)
+{
+    connector->loop = loop;
+    connector->lookup = NULL;
+    connector->addrs = NULL;
+    connector->order = NULL;
+    connector->naddrs = connector->next = 0;
+    irctimer_init(&connector->delay, connector_delay, connector);
+    for (int i = 0; i < IRCCONNECT_ATTEMPTS; ++i) {
+        struct ircattempt *attempt = &connector->attempts[i];
+        attempt->watch.fd = -1;
+        attempt->watch.want_write = true;
+        attempt->watch.on_readable = attempt_ready;
+        attempt->watch.on_writable = attempt_ready;
+        attempt->watch.data = attempt;
+        irctimer_init(&attempt->timeout, attempt_timeout, attempt);
+        attempt->addr = NULL;
+        attempt->connector = connector;
+    }
+
+    struct irclookup *lookup = calloc(1, sizeof *lookup);
+    if (!lookup)
+        return false;
+    pthread_mutex_init(&lookup->lock, NULL);
+    lookup->server = strdup(server);
+    lookup->port = strdup(port);
+    lookup->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!lookup->server || !lookup->port || lookup->fd < 0) {
+        perror("ircconnector_start()");
+        lookup_free(lookup);
+        return false;
+    }
+
+    connector->resolved.fd = lookup->fd;
+    connector->resolved.want_write = false;
+    connector->resolved.on_readable = connector_resolved;
+    connector->resolved.on_writable = NULL;
+    connector->resolved.data = connector;
+    if (!ircloop_add(loop, &connector->resolved)) {
+        lookup_free(lookup);
+        return false;
+    }
+    connector->lookup = lookup;
+
+    // Detached: an abandoned lookup is left to finish and clean up alone.
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, lookup_main, lookup);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        fprintf(stderr, "ircconnector_start(): pthread_create(): %s\n", strerror(err));
+        ircloop_remove(loop, &connector->resolved);
+        connector->lookup = NULL;
+        lookup_free(lookup);
+        return false;
+    }
+    return true;
+}
+
+static void connector_finish(struct ircconnector *connector, int fd);
+
+// The lookup is done: start on its addresses, or give up.
+static void
+connector_resolved(struct ircwatch *watch)
+{
+    struct ircconnector *connector = watch->data;
+    struct irclookup *lookup = connector->lookup;
+
+    uint64_t count;
+    if (read(watch->fd, &count, sizeof count) < 0 && errno != EAGAIN)
+        perror("connector_resolved(): read()");
+
+    // Once the thread is done with it, it is the connector's alone.
+    pthread_mutex_lock(&lookup->lock);
+    bool done = lookup->done;
+    pthread_mutex_unlock(&lookup->lock);
+    if (!done)
+        return;
+
+    ircloop_remove(connector->loop, watch);
+    connector->lookup = NULL;
+    int status = lookup->status;
+    connector->addrs = lookup->addrs;
+    lookup->addrs = NULL;
+    lookup_free(lookup);
 
-    // Get linked list of server candidates.
-    int status = getaddrinfo(server, port, &hints, &serverlist);
     if (status) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
-        return -1;
+        connector_finish(connector, -1);
+        return;
     }
 
-    // Establish a connection to the first server that will accept.
-    struct addrinfo *s;
-    for (s = serverlist; s != NULL; s = s->ai_next) {
-        int fd = socket(s->ai_family, s->ai_socktype, s->ai_protocol);
-        if (fd < 0)
-            continue;
-
-        if (connect(fd, s->ai_addr, s->ai_addrlen) == 0) {
-            freeaddrinfo(serverlist);
-            return fd;
-        }
+    for (struct addrinfo *s = connector->addrs; s; s = s->ai_next)
+        connector->naddrs++;
+    connector->order = malloc(connector->naddrs * sizeof *connector->order);
+    if (!connector->order) {
+        connector_finish(connector, -1);
+        return;
+    }
 
-        close(fd);
+    // Alternate between the family the resolver prefers and the rest,
+    // keeping the resolver's order within each.
+    int family = connector->addrs->ai_family;
+    struct addrinfo *same = next_family(connector->addrs, family, true);
+    struct addrinfo *other = next_family(connector->addrs, family, false);
+    for (int i = 0; i < connector->naddrs; ++i) {
+        bool take_same = !other || (same && i % 2 == 0);
+        struct addrinfo **from = take_same ? &same : &other;
+        connector->order[i] = *from;
+        *from = next_family((*from)->ai_next, family, take_same);
     }
 
-    freeaddrinfo(serverlist);
-    return -1;
+    connector_delay(&connector->delay);
+}
+
+bool
+ircconnector_busy(struct ircconnector *connector)
+{
+    return connector->lookup != NULL || connector->addrs != NULL;
+}
+
+static void
+attempt_close(struct ircattempt *attempt)
+{
+    struct ircconnector *connector = attempt->connector;
+    if (attempt->watch.fd < 0)
+        return;
+    ircloop_remove(connector->loop, &attempt->watch);
+    close(attempt->watch.fd);
+    attempt->watch.fd = -1;
+    ircloop_cancel(connector->loop, &attempt->timeout);
 }
 
 void
-irc_disconnect(int fd)
+ircconnector_cancel(struct ircconnector *connector)
 {
-    close(fd);
+    if (!ircconnector_busy(connector))
+        return;
+    lookup_abandon(connector);
+    for (int i = 0; i < IRCCONNECT_ATTEMPTS; ++i)
+        attempt_close(&connector->attempts[i]);
+    ircloop_cancel(connector->loop, &connector->delay);
+    free(connector->order);
+    if (connector->addrs)
+        freeaddrinfo(connector->addrs);
+    connector->order = NULL;
+    connector->addrs = NULL;
+    connector->naddrs = connector->next = 0;
 }
 
-static int
-find_whole_line(char *buf, int len)
-{
-    for (int c = 0; c < len; c++) {
-        if (buf[c] == '\n') {
-            if (c > 0 && buf[c] == '\r')
-                buf[c - 1] = '\0';
-            buf[c] = '\0';
-            return c; // String length.
+// Hands over |fd|, or reports failure, and forgets everything else.
+static void
+connector_finish(struct ircconnector *connector, int fd)
+{
+    ircconnector_cancel(connector);
+    connector->on_connect(connector, fd);
+}
+
+// Gives up if nothing is left to try and nothing is still trying.
+static void
+connector_check(struct ircconnector *connector)
+{
+    if (connector->next < connector->naddrs)
+        return;
+    for (int i = 0; i < IRCCONNECT_ATTEMPTS; ++i) {
+        if (connector->attempts[i].watch.fd >= 0)
+            return;
+    }
+    connector_finish(connector, -1);
+}
+
+static void
+print_attempt_error(const struct addrinfo *addr, const char *error)
+{
+    char host[NI_MAXHOST];
+    if (getnameinfo(addr->ai_addr, addr->ai_addrlen, host, sizeof host, NULL, 0, NI_NUMERICHOST))
+        strcpy(host, "?");
+    fprintf(stderr, "Connecting to %s: %s\n", host, error);
+}
+
+// Starts connecting to the next address, skipping any that fail at once.
+static void
+connector_next(struct ircconnector *connector)
+{
+    struct ircattempt *attempt = NULL;
+    for (int i = 0; i < IRCCONNECT_ATTEMPTS && !attempt; ++i) {
+        if (connector->attempts[i].watch.fd < 0)
+            attempt = &connector->attempts[i];
+    }
+    if (!attempt)
+        return;
+
+    while (connector->next < connector->naddrs) {
+        struct addrinfo *addr = connector->order[connector->next++];
+        int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        addr->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+            connector_finish(connector, fd);
+            return;
+        }
+        if (errno != EINPROGRESS) {
+            print_attempt_error(addr, strerror(errno));
+            close(fd);
+            continue;
         }
+
+        attempt->watch.fd = fd;
+        attempt->addr = addr;
+        if (!ircloop_add(connector->loop, &attempt->watch)) {
+            close(fd);
+            attempt->watch.fd = -1;
+            continue;
+        }
+        ircloop_schedule(connector->loop, &attempt->timeout, IRCCONNECT_TIMEOUT_MS);
+        if (connector->next < connector->naddrs)
+            ircloop_schedule(connector->loop, &connector->delay, IRCCONNECT_DELAY_MS);
+        return;
     }
-    return -1;
+
+    connector_check(connector);
 }
 
+// The previous attempt has had its head start.
 static void
-discardline(struct ircbuf *ircbuf)
+connector_delay(struct irctimer *timer)
 {
-    int msglen = ircbuf->msglen;
-    assert(msglen >= 0);
-    assert(ircbuf->buf[msglen] == '\0');
+    connector_next(timer->data);
+}
 
-    memmove(ircbuf->buf, &ircbuf->buf[msglen + 1], ircbuf->count - (msglen + 1));
-    ircbuf->count -= (msglen + 1);
-    ircbuf->msglen = -1;
+static void
+attempt_ready(struct ircwatch *watch)
+{
+    struct ircattempt *attempt = watch->data;
+    struct ircconnector *connector = attempt->connector;
+
+    // Closed by a winner from the same batch of events.
+    if (watch->fd < 0)
+        return;
+
+    int err = 0;
+    socklen_t len = sizeof err;
+    if (getsockopt(watch->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+
+    if (err == 0) {
+        // A new attempt may have taken over the slot since this event.
+        struct sockaddr_storage peer;
+        socklen_t peerlen = sizeof peer;
+        if (getpeername(watch->fd, (struct sockaddr *) &peer, &peerlen) < 0 && errno == ENOTCONN)
+            return;
+
+        // Keep the winner out of attempt_close().
+        int fd = watch->fd;
+        ircloop_remove(connector->loop, watch);
+        ircloop_cancel(connector->loop, &attempt->timeout);
+        watch->fd = -1;
+        connector_finish(connector, fd);
+        return;
+    }
+
+    print_attempt_error(attempt->addr, strerror(err));
+    attempt_close(attempt);
+
+    // A failure hands its turn straight to the next address.
+    connector_next(connector);
 }
 
-// Blocks until a full line is received from the server.
-// Returned line is kept in the buffer; length is remembered via ircbuf->msglen.
-char *
-irc_getline(int fd, struct ircbuf *ircbuf)
+static void
+attempt_timeout(struct irctimer *timer)
 {
-    char *buf = ircbuf->buf;
+    struct ircattempt *attempt = timer->data;
+    struct ircconnector *connector = attempt->connector;
+    print_attempt_error(attempt->addr, "timed out");
+    attempt_close(attempt);
+    connector_next(connector);
+}
 
-    // If a line was previously returned, remove it from the buffer.
-    if (ircbuf->msglen > 0)
-        discardline(ircbuf);
+// Makes room at the end of the buffer for another read.
+static void
+ircbuf_makeroom(struct ircbuf *ircbuf)
+{
+    // Everything has been handed out: start over for free.
+    if (ircbuf->start == ircbuf->count) {
+        ircbuf->start = ircbuf->count = ircbuf->scanned = 0;
+        return;
+    }
 
-    int msglen = find_whole_line(buf, ircbuf->count);
-    if (msglen >= 0) {
-        ircbuf->msglen = msglen;
-        return buf;
+    if (ircbuf->count < ircbuf->max)
+        return;
+
+    // Out of space: move the partial line at the end to the front.
+    if (ircbuf->start > 0) {
+        int len = ircbuf->count - ircbuf->start;
+        memmove(ircbuf->buf, ircbuf->buf + ircbuf->start, len);
+        ircbuf->scanned -= ircbuf->start;
+        ircbuf->count = len;
+        ircbuf->start = 0;
+        return;
     }
 
-    while (ircbuf->count < ircbuf->max) {
-        int bytes = read(fd, buf + ircbuf->count, ircbuf->max - ircbuf->count);
-        if (bytes == 0) {
-            fprintf(stderr, "Connection closed by remote host.\n");
-            return NULL;
-        }
-        if (bytes < 0) {
-            perror("irc_getline():");
-            return NULL;
-        }
+    // The whole buffer is a single unterminated line, which can never be
+    // handed out. Drop it, and keep dropping until it finally ends.
+    if (!ircbuf->discarding)
+        fprintf(stderr, "Discarding overlong line.\n");
+    ircbuf->discarding = true;
+    ircbuf->start = ircbuf->count = ircbuf->scanned = 0;
+}
 
-        int origcount = ircbuf->count;
+int
+ircbuf_read(struct ircbuf *ircbuf, int fd)
+{
+    ircbuf_makeroom(ircbuf);
+
+    int bytes = read(fd, ircbuf->buf + ircbuf->count, ircbuf->max - ircbuf->count);
+    if (bytes > 0)
         ircbuf->count += bytes;
+    return bytes;
+}
 
-        msglen = find_whole_line(buf + origcount, bytes);
-        if (msglen >= 0) {
-            ircbuf->msglen = origcount + msglen;
-            return buf;
+int
+ircbuf_lines(struct ircbuf *ircbuf, struct ircline *lines, int max)
+{
+    char *end = ircbuf->buf + ircbuf->count;
+    int n = 0;
+
+    while (n < max) {
+        // Only search characters that have not been searched before.
+        // memchr() is vectorized, so this is much faster than a byte loop.
+        char *from = ircbuf->buf + ircbuf->scanned;
+        char *newline = memchr(from, '\n', end - from);
+        if (!newline) {
+            ircbuf->scanned = ircbuf->count;
+            break;
         }
+
+        char *text = ircbuf->buf + ircbuf->start;
+        ircbuf->start = ircbuf->scanned = newline + 1 - ircbuf->buf;
+
+        if (ircbuf->discarding) {
+            // That was the tail of an overlong line.
+            ircbuf->discarding = false;
+            continue;
+        }
+
+        // Lines should end in CR/LF, but tolerate a bare LF.
+        char *term = newline;
+        if (term > text && term[-1] == '\r')
+            term--;
+        *term = '\0';
+
+        lines[n].text = text;
+        lines[n].len = term - text;
+        n++;
     }
 
-    // Buffer full without a newline; currently unhandled. 
-    // In the future, this function should clear the buffer and pretend like
-    // the extremely long line never occurred.
-    // I don't think Rizon permits such strings anyway.
-    assert(0);
-    return NULL;
+    return n;
 }
 
-// Parses the name and inserts \0 appropriately.
-static bool
-parsename(char *name, struct ircname *out)
+// Does one read, then hands every whole line to on_lines.
+static void
+conn_readable(struct ircwatch *watch)
 {
-    // Names are formatted:
-    // foo!~bar@host.name
-    assert(name[0] != ':');
-    assert(!strchr(name, ' '));
+    struct ircconn *conn = watch->data;
+
+    int bytes = ircbuf_read(&conn->in, watch->fd);
+    if (bytes > 0)
+        conn->input_ms = now_ms();
+    if (bytes == 0) {
+        fprintf(stderr, "Connection closed by remote host.\n");
+        ircconn_close(conn);
+        return;
+    }
+    if (bytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+        perror("read()");
+        ircconn_close(conn);
+        return;
+    }
 
-    char *exclam = strchr(name, '!');
-    char *atsign = strchr(name, '@');
-    if (!exclam || !atsign || atsign < exclam)
-        return false;
+    struct ircline lines[IRCCONN_BATCH];
+    int n;
+    while (ircconn_isopen(conn) && (n = ircbuf_lines(&conn->in, lines, IRCCONN_BATCH)) > 0)
+        conn->on_lines(conn, lines, n);
+}
 
-    *exclam = '\0';
-    *atsign = '\0';
+static struct ircslice
+slice(char *s, int len)
+{
+    struct ircslice slice = { s, len };
+    return slice;
+}
 
-    out->nick = name;
-    out->user = exclam + 1;
-    out->host = atsign + 1;
-    return true;
+// Breaks up a prefix such as "foo!~bar@host.name" in place.
+static void
+parsename(struct ircslice prefix, struct ircname *out)
+{
+    char *end = prefix.s + prefix.len;
+    char *atsign = memchr(prefix.s, '@', prefix.len);
+    char *exclam = memchr(prefix.s, '!', (atsign ? atsign : end) - prefix.s);
+
+    char *nick_end = exclam ? exclam : atsign ? atsign : end;
+    out->nick = slice(prefix.s, nick_end - prefix.s);
+    out->user = slice(end, 0);
+    out->host = slice(end, 0);
+
+    if (exclam) {
+        char *user_end = atsign ? atsign : end;
+        out->user = slice(exclam + 1, user_end - (exclam + 1));
+    }
+    if (atsign)
+        out->host = slice(atsign + 1, end - (atsign + 1));
+
+    // Terminate the pieces, now that the separators have been found.
+    if (exclam)
+        *exclam = '\0';
+    if (atsign)
+        *atsign = '\0';
 }
 
-static bool
-try_parseping(char *line, struct ircmsg *msg)
+// Commands the bot understands, and the parameters each one needs.
+struct ircmsg_spec {
+    const char *name;
+    enum ircmsgtype type;
+    int minparams;
+    bool from_user; // Whether the prefix must be a user.
+};
+
+static const struct ircmsg_spec SPECS[] = {
+    { "JOIN",    IRCMSG_JOIN,    1, true  },
+    { "KICK",    IRCMSG_KICK,    2, true  },
+    { "PART",    IRCMSG_PART,    1, true  },
+    { "PING",    IRCMSG_PING,    1, false },
+    { "PRIVMSG", IRCMSG_PRIVMSG, 2, true  },
+    { "BATCH",   IRCMSG_BATCH,   1, false },
+    { "CAP",     IRCMSG_CAP,     3, false },
+    { "NICK",    IRCMSG_NICK,    1, true  },
+    { "QUIT",    IRCMSG_QUIT,    0, true  },
+    { "ACCOUNT", IRCMSG_ACCOUNT, 1, true  },
+    { "PONG",    IRCMSG_PONG,    1, false },
+};
+
+static const struct ircmsg_spec *
+find_spec(struct ircslice command)
 {
-    // PING messages are formatted:
-    // PING :responsetext
-    if (strlen(line) < 7 || strstr(line, "PING :") != line)
-        return false;
-    
-    msg->type = IRCMSG_PING;
-    msg->u.ping.text = &line[6]; // First character after ':'.
-    return true;
+    // Switch on the first letter, then confirm the whole command.
+    const struct ircmsg_spec *spec;
+    switch (command.s[0]) {
+      case 'A': spec = &SPECS[9]; break;
+      case 'B': spec = &SPECS[5]; break;
+      case 'C': spec = &SPECS[6]; break;
+      case 'J': spec = &SPECS[0]; break;
+      case 'K': spec = &SPECS[1]; break;
+      case 'N': spec = &SPECS[7]; break;
+      case 'Q': spec = &SPECS[8]; break;
+      case 'P':
+        switch (command.s[1]) {
+          case 'A': spec = &SPECS[2]; break;
+          case 'I': spec = &SPECS[3]; break;
+          case 'O': spec = &SPECS[10]; break;
+          case 'R': spec = &SPECS[4]; break;
+          default:  return NULL;
+        }
+        break;
+      default:
+        return NULL;
+    }
+
+    if ((int) strlen(spec->name) != command.len || memcmp(spec->name, command.s, command.len))
+        return NULL;
+    return spec;
 }
 
-static bool
-try_parsepart(char *line, struct ircmsg *msg)
+// Returns the next space-delimited word at *|p|, terminating it and
+// advancing *|p| past any spaces that follow.
+static struct ircslice
+nextword(char **p, char *end)
 {
-    // PART messages are formatted:
-    // :foo!~bar@host.name PART #channel
-    if (line[0] != ':')
-        return false;
+    char *start = *p;
+    char *space = memchr(start, ' ', end - start);
+    char *stop = space ? space : end;
+
+    *stop = '\0';
+    *p = stop;
+    if (space) {
+        do {
+            (*p)++;
+        } while (*p < end && **p == ' ');
+    }
+    return slice(start, stop - start);
+}
 
-    char *space = strchr(line, ' ');
-    if (!space)
-        return false;
+static void
+fill_typed(struct ircmsg *msg)
+{
+    struct ircslice *params = msg->params;
+    struct ircslice none = slice(msg->command.s + msg->command.len, 0);
+
+    switch (msg->type) {
+      case IRCMSG_PING:
+        msg->u.ping.text = params[0];
+        break;
+
+      case IRCMSG_PART:
+        msg->u.part.name = msg->name;
+        msg->u.part.chan = params[0];
+        msg->u.part.reason = msg->nparams > 1 ? params[1] : none;
+        break;
+
+      case IRCMSG_JOIN:
+        msg->u.join.name = msg->name;
+        msg->u.join.chan = params[0];
+        // Formatted with extended-join: JOIN <chan> <account> :<realname>
+        msg->u.join.account = msg->nparams > 2 ? params[1] : none;
+        break;
+
+      case IRCMSG_PRIVMSG: {
+        struct ircslice *account = irc_tag(msg, "account");
+        msg->u.privmsg.name = msg->name;
+        msg->u.privmsg.chan = params[0];
+        msg->u.privmsg.text = params[1];
+        msg->u.privmsg.account = account ? *account : none;
+        break;
+      }
+
+      case IRCMSG_KICK:
+        msg->u.kick.name = msg->name;
+        msg->u.kick.chan = params[0];
+        msg->u.kick.kickee = params[1];
+        msg->u.kick.reason = msg->nparams > 2 ? params[2] : none;
+        break;
+
+      case IRCMSG_QUIT:
+        msg->u.quit.name = msg->name;
+        msg->u.quit.reason = msg->nparams > 0 ? params[0] : none;
+        break;
+
+      case IRCMSG_NICK:
+        msg->u.nick.name = msg->name;
+        msg->u.nick.nick = params[0];
+        break;
+
+      case IRCMSG_ACCOUNT:
+        msg->u.account.name = msg->name;
+        msg->u.account.account = params[0];
+        break;
+
+      case IRCMSG_PONG:
+        // Formatted: PONG <server> :<text>
+        msg->u.pong.text = params[msg->nparams - 1];
+        break;
+
+      case IRCMSG_CAP:
+        // Formatted: CAP <target> <subcmd> [*] :<caps>
+        msg->u.cap.subcmd = params[1];
+        msg->u.cap.caps = params[msg->nparams - 1];
+        msg->u.cap.more = msg->nparams > 3 && strcmp(params[2].s, "*") == 0;
+        break;
+
+      case IRCMSG_BATCH:
+        // Formatted: BATCH +<ref> <type> [params...], or BATCH -<ref>
+        msg->u.batch.ref = params[0];
+        msg->u.batch.type = msg->nparams > 1 ? params[1] : none;
+        break;
+
+      default:
+        break;
+    }
+}
 
-    char *part = space + 1;
-    if (strstr(part, "PART #") != part)
-        return false;
+// Undoes the escaping of a tag value in place.
+static struct ircslice
+unescape_tag(struct ircslice value)
+{
+    char *out = value.s;
+    for (int i = 0; i < value.len; ++i) {
+        char c = value.s[i];
+        if (c == '\\' && i + 1 < value.len) {
+            switch (value.s[++i]) {
+              case ':': c = ';';  break;
+              case 's': c = ' ';  break;
+              case 'r': c = '\r'; break;
+              case 'n': c = '\n'; break;
+              default:  c = value.s[i]; break;
+            }
+        } else if (c == '\\') {
+            break; // A trailing backslash is dropped.
+        }
+        *out++ = c;
+    }
+    *out = '\0';
+    return slice(value.s, out - value.s);
+}
 
-    // Failure after this point implies a malformed message.
-    *space = '\0';
-    if (!parsename(line + 1, &msg->u.part.name)) {
-        msg->type = IRCMSG_UNKNOWN;
-        return true;
+// Splits "key=value;key2;key3=value3" in place.
+static void
+parsetags(struct ircslice tags, struct ircmsg *msg)
+{
+    char *p = tags.s;
+    char *end = tags.s + tags.len;
+
+    while (p < end && msg->ntags < IRC_MAX_TAGS) {
+        char *semi = memchr(p, ';', end - p);
+        char *stop = semi ? semi : end;
+        char *equals = memchr(p, '=', stop - p);
+        *stop = '\0';
+
+        struct irctag *tag = &msg->tags[msg->ntags];
+        if (equals) {
+            *equals = '\0';
+            tag->key = slice(p, equals - p);
+            tag->value = unescape_tag(slice(equals + 1, stop - (equals + 1)));
+        } else {
+            tag->key = slice(p, stop - p);
+            tag->value = slice(stop, 0);
+        }
+        if (tag->key.len > 0)
+            msg->ntags++;
+
+        p = stop + 1;
     }
+}
 
-    msg->u.part.chan = part + strlen("PART ");
-    msg->type = IRCMSG_PART;
-    return true;
+bool
+irc_name_equal(const char *a, const char *b)
+{
+    while (*a && irc_fold(*a) == irc_fold(*b)) {
+        a++;
+        b++;
+    }
+    return *a == *b;
 }
 
-static bool
-try_parsejoin(char *line, struct ircmsg *msg)
+struct ircslice *
+irc_tag(struct ircmsg *msg, const char *key)
 {
-    // JOIN messages are formatted:
-    // :foo!~bar@host.name JOIN :#channel
-    if (line[0] != ':')
-        return false;
+    for (int i = 0; i < msg->ntags; ++i) {
+        if (strcmp(msg->tags[i].key.s, key) == 0)
+            return &msg->tags[i].value;
+    }
+    return NULL;
+}
 
-    char *space = strchr(line, ' ');
-    if (!space)
-        return false;
+// Tokenizes the line in a single pass, then classifies it by its command.
+void
+irc_parseline(char *line, int len, struct ircmsg *msg)
+{
+    char *p = line;
+    char *end = line + len;
 
-    char *join = space + 1;
-    if (strstr(join, "JOIN :#") != join)
-        return false;
+    memset(msg, 0, sizeof *msg);
+    msg->type = IRCMSG_UNKNOWN;
+    msg->prefix = slice(end, 0);
+    parsename(msg->prefix, &msg->name);
 
-    // Failure after this point implies a malformed message.
-    *space = '\0';
-    if (!parsename(line + 1, &msg->u.join.name)) {
-        msg->type = IRCMSG_UNKNOWN;
-        return true;
+    if (p < end && *p == '@') {
+        p++;
+        parsetags(nextword(&p, end), msg);
     }
 
-    msg->u.join.chan = join + strlen("JOIN :");
-    msg->type = IRCMSG_JOIN;
-    return true;
+    if (p < end && *p == ':') {
+        p++;
+        msg->prefix = nextword(&p, end);
+        parsename(msg->prefix, &msg->name);
+    }
+
+    msg->command = nextword(&p, end);
+    if (msg->command.len == 0)
+        return;
+
+    while (p < end && msg->nparams < IRC_MAX_PARAMS) {
+        // The trailing parameter (and the last allowed one) takes the rest.
+        if (*p == ':' || msg->nparams == IRC_MAX_PARAMS - 1) {
+            if (*p == ':')
+                p++;
+            msg->params[msg->nparams++] = slice(p, end - p);
+            break;
+        }
+        msg->params[msg->nparams++] = nextword(&p, end);
+    }
+
+    struct ircslice cmd = msg->command;
+    if (cmd.len == 3 && isdigit((unsigned char) cmd.s[0]) &&
+        isdigit((unsigned char) cmd.s[1]) && isdigit((unsigned char) cmd.s[2]))
+    {
+        msg->type = IRCMSG_NUMERIC;
+        msg->numeric = (cmd.s[0] - '0') * 100 + (cmd.s[1] - '0') * 10 + (cmd.s[2] - '0');
+        return;
+    }
+
+    const struct ircmsg_spec *spec = find_spec(cmd);
+    if (!spec || msg->nparams < spec->minparams)
+        return;
+    if (spec->from_user && (msg->prefix.len == 0 || msg->name.host.len == 0))
+        return;
+
+    msg->type = spec->type;
+    fill_typed(msg);
+}
+
+// Capabilities the bot asks for, if the server offers them.
+static const struct {
+    const char *name;
+    enum irccap cap;
+} CAPS[] = {
+    { "message-tags",      IRCCAP_MESSAGE_TAGS },
+    { "server-time",       IRCCAP_SERVER_TIME },
+    { "batch",             IRCCAP_BATCH },
+    { "userhost-in-names", IRCCAP_USERHOST_IN_NAMES },
+    { "account-tag",       IRCCAP_ACCOUNT_TAG },
+    { "account-notify",    IRCCAP_ACCOUNT_NOTIFY },
+    { "extended-join",     IRCCAP_EXTENDED_JOIN },
+};
+
+// Maps a space-separated list of capabilities (values such as "sasl=PLAIN"
+// are ignored) to the ones in CAPS.
+static unsigned
+known_caps(struct ircslice list)
+{
+    unsigned caps = 0;
+    char *p = list.s;
+    char *end = list.s + list.len;
+
+    while (p < end) {
+        char *space = memchr(p, ' ', end - p);
+        char *stop = space ? space : end;
+        char *equals = memchr(p, '=', stop - p);
+        int len = (equals ? equals : stop) - p;
+
+        // "-cap" in an ACK means the cap was disabled; skip it.
+        for (size_t i = 0; i < sizeof CAPS / sizeof CAPS[0]; ++i) {
+            if ((int) strlen(CAPS[i].name) == len && memcmp(CAPS[i].name, p, len) == 0)
+                caps |= CAPS[i].cap;
+        }
+        p = stop + 1;
+    }
+    return caps;
 }
 
 static bool
-try_parseprivmsg(char *line, struct ircmsg *msg)
+cap_end(struct ircconn *conn)
 {
-    // PRIVMSG messages are formatted:
-    // :foo!~bar@host.name PRIVMSG channel :text
-    if (line[0] != ':')
-        return false;
+    if (!conn->cap_negotiating)
+        return true;
+    conn->cap_negotiating = false;
+    return irc_send(conn, "CAP END\r\n");
+}
 
-    char *space = strchr(line, ' ');
-    if (!space)
-        return false;
+bool
+irc_cap_handle(struct ircconn *conn, struct ircmsg *msg)
+{
+    struct ircmsg_cap *cap = &msg->u.cap;
+    const char *subcmd = cap->subcmd.s;
+
+    if (strcmp(subcmd, "LS") == 0) {
+        conn->caps_wanted |= known_caps(cap->caps);
+        if (cap->more)
+            return true;
+        if (!conn->caps_wanted)
+            return cap_end(conn);
+
+        char req[256] = "";
+        for (size_t i = 0; i < sizeof CAPS / sizeof CAPS[0]; ++i) {
+            if (conn->caps_wanted & CAPS[i].cap) {
+                strcat(req, req[0] ? " " : "");
+                strcat(req, CAPS[i].name);
+            }
+        }
+        return irc_send(conn, "CAP REQ :%s\r\n", req);
+    }
 
-    char *privmsg = space + 1;
-    if (strstr(privmsg, "PRIVMSG ") != privmsg)
-        return false;
+    if (strcmp(subcmd, "ACK") == 0) {
+        conn->caps |= known_caps(cap->caps);
+        return cap_end(conn);
+    }
 
-    char *chan = privmsg + strlen("PRIVMSG ");
-    char *chanspace = strchr(chan, ' ');
-    if (!chanspace || chanspace[1] != ':')
-        return false;
+    if (strcmp(subcmd, "NAK") == 0)
+        return cap_end(conn);
 
-    // Failure after this point implies a malformed message.
-    *space = '\0';
-    if (!parsename(line + 1, &msg->u.privmsg.name)) {
-        msg->type = IRCMSG_UNKNOWN;
-        return true;
-    }
+    if (strcmp(subcmd, "DEL") == 0)
+        conn->caps &= ~known_caps(cap->caps);
 
-    *chanspace = '\0';
-    msg->u.privmsg.chan = chan;
-    msg->u.privmsg.text = chanspace + strlen(" :");
-    msg->type = IRCMSG_PRIVMSG;
     return true;
 }
 
-static bool
-try_parsekick(char *line, struct ircmsg *msg)
+// A batch being collected: its lines as they came, tags and all. Each is
+// parsed only as it is dispatched, once the batch closes.
+struct ircbatch {
+    struct ircbatch *next;
+    char *ref;  // Without the leading '+'.
+    char *type;
+
+    char *text;   // The lines, each null-terminated.
+    int textlen;
+    int textcap;
+    int *offsets; // Where each line starts in |text|, and one past the last.
+    int nlines;
+    int linecap;
+};
+
+static void
+free_batch(struct ircbatch *batch)
 {
-    // KICK messages are formatted:
-    // :foo!~bar@host.name KICK channel kickee :reason
-    if (line[0] != ':')
-        return false;
+    if (!batch)
+        return;
+    free(batch->ref);
+    free(batch->type);
+    free(batch->text);
+    free(batch->offsets);
+    free(batch);
+}
 
-    char *space = strchr(line, ' ');
-    if (!space)
-        return false;
+static void
+free_batches(struct ircconn *conn)
+{
+    while (conn->batches) {
+        struct ircbatch *next = conn->batches->next;
+        free_batch(conn->batches);
+        conn->batches = next;
+    }
+    free_batch(conn->done_batch);
+    conn->done_batch = NULL;
+    conn->nbatches = 0;
+    conn->batched_lines = 0;
+    conn->batched_bytes = 0;
+}
 
-    char *kick = space + 1;
-    if (strstr(kick, "KICK ") != kick)
-        return false;
+static struct ircbatch **
+find_batch(struct ircconn *conn, const char *ref, int len)
+{
+    struct ircbatch **link;
+    for (link = &conn->batches; *link; link = &(*link)->next) {
+        if (strncmp((*link)->ref, ref, len) == 0 && (*link)->ref[len] == '\0')
+            break;
+    }
+    return link;
+}
 
-    char *chan = kick + strlen("KICK ");
-    char *chanspace = strchr(chan, ' ');
-    if (!chanspace)
-        return false;
+// The value of a raw line's "batch" tag, or an empty slice. The tags are
+// only looked at, since the line has to be kept as it is.
+static struct ircslice
+raw_batch_ref(char *line, int len)
+{
+    if (len == 0 || line[0] != '@')
+        return slice(line, 0);
+
+    char *end = memchr(line, ' ', len);
+    if (!end)
+        end = line + len;
+    for (char *p = line + 1; p < end; ) {
+        char *stop = memchr(p, ';', end - p);
+        if (!stop)
+            stop = end;
+        if (stop - p > 6 && memcmp(p, "batch=", 6) == 0)
+            return slice(p + 6, stop - (p + 6));
+        p = stop + 1;
+    }
+    return slice(line, 0);
+}
 
-    char *kickee = chanspace + 1;
-    char *kickeespace = strchr(kickee, ' ');
-    if (!kickeespace || kickeespace[1] != ':')
+static bool
+batch_append(struct ircconn *conn, struct ircbatch *batch, struct ircline *line)
+{
+    int len = line->len;
+    if (conn->batched_lines >= IRCBATCH_MAX_LINES ||
+        len + 1 > IRCBATCH_MAX_BYTES - conn->batched_bytes)
+    {
         return false;
+    }
 
-    char *reason = kickeespace + strlen(" :");
+    if (batch->textlen + len + 1 > batch->textcap) {
+        int cap = batch->textcap ? batch->textcap * 2 : 4096;
+        while (cap < batch->textlen + len + 1)
+            cap *= 2;
+        char *text = realloc(batch->text, cap);
+        if (!text)
+            return false;
+        batch->text = text;
+        batch->textcap = cap;
+    }
+    if (batch->nlines == batch->linecap) {
+        int cap = batch->linecap ? batch->linecap * 2 : 64;
+        int *offsets = realloc(batch->offsets, (cap + 1) * sizeof *offsets);
+        if (!offsets)
+            return false;
+        batch->offsets = offsets;
+        batch->linecap = cap;
+    }
 
-    // Failure after this point implies a malformed message.
-    *space = '\0';
-    if (!parsename(line + 1, &msg->u.kick.name)) {
-        msg->type = IRCMSG_UNKNOWN;
-        return true;
+    batch->offsets[batch->nlines++] = batch->textlen;
+    memcpy(batch->text + batch->textlen, line->text, len);
+    batch->text[batch->textlen + len] = '\0';
+    batch->textlen += len + 1;
+    batch->offsets[batch->nlines] = batch->textlen;
+    conn->batched_lines++;
+    conn->batched_bytes += len + 1;
+    return true;
+}
+
+bool
+irc_batch_collect(struct ircconn *conn, struct ircline *line, struct ircmsg *msg)
+{
+    free_batch(conn->done_batch);
+    conn->done_batch = NULL;
+
+    // Lines of an open batch are held back without being parsed.
+    if (conn->batches) {
+        struct ircslice ref = raw_batch_ref(line->text, line->len);
+        struct ircbatch *batch = ref.len ? *find_batch(conn, ref.s, ref.len) : NULL;
+        if (batch && batch_append(conn, batch, line))
+            return true;
     }
 
-    *chanspace = '\0';
-    msg->u.kick.chan = chan;
+    irc_parseline(line->text, line->len, msg);
+    if (msg->type != IRCMSG_BATCH)
+        return false;
 
-    *kickeespace = '\0';
-    msg->u.kick.kickee = kickee;
+    const char *ref = msg->u.batch.ref.s;
+    if (ref[0] == '+') {
+        if (conn->nbatches >= IRCBATCH_MAX_OPEN)
+            return true; // Its lines will be dispatched one by one.
+
+        struct ircbatch *batch = calloc(1, sizeof *batch);
+        if (!batch || !(batch->ref = strdup(ref + 1)) ||
+            !(batch->type = strdup(msg->u.batch.type.s)))
+        {
+            free_batch(batch);
+            return true;
+        }
+        batch->next = conn->batches;
+        conn->batches = batch;
+        conn->nbatches++;
+        return true;
+    }
 
-    msg->u.kick.reason = reason;
-    msg->type = IRCMSG_KICK;
+    if (ref[0] == '-') {
+        struct ircbatch **link = find_batch(conn, ref + 1, strlen(ref + 1));
+        struct ircbatch *batch = *link;
+        if (!batch)
+            return true;
+
+        *link = batch->next;
+        conn->nbatches--;
+        conn->batched_lines -= batch->nlines;
+        conn->batched_bytes -= batch->textlen;
+        conn->done_batch = batch;
+
+        msg->u.batch.ref = slice(batch->ref, strlen(batch->ref));
+        msg->u.batch.type = slice(batch->type, strlen(batch->type));
+        msg->u.batch.group = batch;
+        msg->u.batch.nlines = batch->nlines;
+        return false;
+    }
     return true;
 }
 
 void
-irc_parseline(char *line, struct ircmsg *msg)
-{
-    try_parseping(line, msg)
-    || try_parsepart(line, msg)
-    || try_parsejoin(line, msg)
-    || try_parseprivmsg(line, msg)
-    || try_parsekick(line, msg)
-    || (msg->type = IRCMSG_UNKNOWN);
+irc_batch_line(struct ircmsg_batch *batch, int i, struct ircmsg *msg)
+{
+    struct ircbatch *group = batch->group;
+    int start = group->offsets[i];
+    irc_parseline(group->text + start, group->offsets[i + 1] - start - 1, msg);
 }
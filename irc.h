@@ -29,93 +29,498 @@
 
 enum ircmsgtype {
     IRCMSG_UNKNOWN,
+    IRCMSG_NUMERIC,
     IRCMSG_PING,
     IRCMSG_PART,
     IRCMSG_JOIN,
     IRCMSG_PRIVMSG,
-    IRCMSG_KICK
+    IRCMSG_KICK,
+    IRCMSG_CAP,
+    IRCMSG_BATCH,
+    IRCMSG_QUIT,
+    IRCMSG_NICK,
+    IRCMSG_ACCOUNT,
+    IRCMSG_PONG
+};
+
+// A piece of a received line. Also null-terminated, for convenience.
+struct ircslice {
+    char *s;
+    int len;
 };
 
 // Represents names such as "foo!~bar@the.host.name".
+// For a server name, |nick| is the whole name and the others are empty.
 struct ircname {
-    char *nick; // "foo" in the above example.
-    char *user; // "bar" in the above example.
-    char *host; // "the.host.name" in the above example.
+    struct ircslice nick; // "foo" in the above example.
+    struct ircslice user; // "~bar" in the above example.
+    struct ircslice host; // "the.host.name" in the above example.
 };
 
 // Messages of type IRCMSG_PING.
 struct ircmsg_ping {
-    char *text;
+    struct ircslice text;
+};
+
+// Messages of type IRCMSG_PONG.
+struct ircmsg_pong {
+    struct ircslice text; // Whatever the PING said.
 };
 
 // Messages of type IRCMSG_PART.
 struct ircmsg_part {
     struct ircname name;
-    char *chan;
+    struct ircslice chan;
+    struct ircslice reason; // Possibly empty.
 };
 
 // Messages of type IRCMSG_JOIN.
 struct ircmsg_join {
     struct ircname name;
-    char *chan;
+    struct ircslice chan;
+    struct ircslice account; // With extended-join: "*" if logged out. Otherwise empty.
 };
 
 // Messages of type IRCMSG_PRIVMSG.
 struct ircmsg_privmsg {
     struct ircname name;
-    char *chan;
-    char *text;
+    struct ircslice chan;    // The target: a channel, or the bot's own nick.
+    struct ircslice text;
+    struct ircslice account; // From the account tag. Empty if there was none.
 };
 
 // Messages of type IRCMSG_KICK.
 struct ircmsg_kick {
     struct ircname name;
-    char *chan;
-    char *kickee;
-    char *reason;
+    struct ircslice chan;
+    struct ircslice kickee;
+    struct ircslice reason; // Possibly empty.
+};
+
+// Messages of type IRCMSG_QUIT.
+struct ircmsg_quit {
+    struct ircname name;
+    struct ircslice reason; // Possibly empty.
+};
+
+// Messages of type IRCMSG_NICK.
+struct ircmsg_nick {
+    struct ircname name;  // Still under the old nick.
+    struct ircslice nick; // The new one.
+};
+
+// Messages of type IRCMSG_ACCOUNT, sent with account-notify.
+struct ircmsg_account {
+    struct ircname name;
+    struct ircslice account; // "*" on logging out.
+};
+
+// Messages of type IRCMSG_CAP.
+struct ircmsg_cap {
+    struct ircslice subcmd; // "LS", "ACK", "NAK", ...
+    struct ircslice caps;   // Space-separated capabilities.
+    bool more;              // Whether this is one of several LS lines.
+};
+
+struct ircmsg;
+
+struct ircbatch;
+
+// Messages of type IRCMSG_BATCH. As parsed, these are the "BATCH +ref type"
+// and "BATCH -ref" markers; irc_batch_collect() turns the closing marker
+// into the whole group, with every line that was tagged with |ref|. Those
+// are read with irc_batch_line().
+struct ircmsg_batch {
+    struct ircslice ref;     // Including the leading '+' or '-'.
+    struct ircslice type;    // e.g. "netsplit". Empty on the closing marker.
+    struct ircbatch *group;  // NULL but for a whole group.
+    int nlines;
+};
+
+// An IRCv3 message tag. Escapes in |value| have already been undone.
+struct irctag {
+    struct ircslice key;
+    struct ircslice value;
 };
 
-// Represents generic messages.
+// The protocol allows at most 15 parameters.
+#define IRC_MAX_PARAMS 15
+
+// Tags past this many are ignored.
+#define IRC_MAX_TAGS 32
+
+// Represents generic messages:
+//   [@tags] [:prefix] command [params...] [:trailing]
+// The trailing parameter, if any, is the last of |params|.
 struct ircmsg {
     enum ircmsgtype type;
+    struct irctag tags[IRC_MAX_TAGS];
+    int ntags;
+    struct ircslice prefix;  // Empty if the message had none.
+    struct ircname name;     // |prefix|, broken up.
+    struct ircslice command;
+    int numeric;             // For IRCMSG_NUMERIC, the command as a number.
+    struct ircslice params[IRC_MAX_PARAMS];
+    int nparams;
+
+    // Typed views of the parameters, according to |type|.
     union {
         struct ircmsg_ping ping;
+        struct ircmsg_pong pong;
         struct ircmsg_part part;
         struct ircmsg_join join;
         struct ircmsg_privmsg privmsg;
         struct ircmsg_kick kick;
+        struct ircmsg_quit quit;
+        struct ircmsg_nick nick;
+        struct ircmsg_account account;
+        struct ircmsg_cap cap;
+        struct ircmsg_batch batch;
     } u;
 };
 
 // Buffer for incoming network traffic.
+// Lines are handed out in place, and stay valid until the next read into the
+// buffer. Unconsumed input is only moved to the front when the end is reached.
 struct ircbuf {
-    char *buf; // Buffer for incoming messages.
-    int max;   // Maximum length of the buffer.
-    int count; // Number of written characters from the start of |buf|.
+    char *buf;   // Buffer for incoming messages.
+    int max;     // Maximum length of the buffer.
+    int start;   // Offset of the first character not yet handed out.
+    int count;   // Number of written characters from the start of |buf|.
+    int scanned; // Characters before this offset are known not to end a line.
+
+    // Set when a line did not fit in the buffer. Its remainder is dropped as
+    // it arrives, up to and including the newline.
+    bool discarding;
+};
 
-    // Length of the active line in the buffer, or -1.
-    // Includes final null-terminator.
-    int msglen;
+// A line handed out by an ircbuf: null-terminated, without its CR/LF.
+struct ircline {
+    char *text;
+    int len;
 };
 
 void ircbuf_init(struct ircbuf *ircbuf, char *buf, int len);
 
-// Connection functions.
-int irc_connect(const char *server, const char *port);
-void irc_disconnect(int fd);
+// Does a single read() into the buffer, with read()'s return value.
+int ircbuf_read(struct ircbuf *ircbuf, int fd);
+
+// Hands out up to |max| whole lines from the buffer, returning how many.
+int ircbuf_lines(struct ircbuf *ircbuf, struct ircline *lines, int max);
+
+// Something the event loop watches: a file descriptor plus the callbacks to
+// run when it becomes readable or writable.
+struct ircwatch {
+    int fd;
+    bool want_write; // Whether on_writable is currently armed.
+    void (*on_readable)(struct ircwatch *watch); // Also called on hangup or error.
+    void (*on_writable)(struct ircwatch *watch);
+    void *data;
+};
+
+// A callback to run once, some time from now. Embed it in whatever it acts
+// on, which must stay put while the timer is scheduled.
+struct irctimer {
+    struct irctimer *next;
+    struct irctimer **pprev; // NULL while not scheduled.
+    long long expires_ms;
+    void (*fire)(struct irctimer *timer);
+    void *data;
+};
+
+// Timers live in a hierarchical wheel: each level has IRCWHEEL_SLOTS slots,
+// and each slot of a level spans a whole turn of the level below. Timers are
+// scheduled and cancelled in O(1), and those due far off move down a level
+// each time the level below comes around to them.
+#define IRCWHEEL_TICK_MS 10
+#define IRCWHEEL_BITS 6
+#define IRCWHEEL_SLOTS (1 << IRCWHEEL_BITS)
+#define IRCWHEEL_LEVELS 4 // Spans about 1.9 days; later timers go around again.
+
+// An epoll-based event loop.
+struct ircloop {
+    int epfd;
+    bool running;
+
+    struct irctimer *wheel[IRCWHEEL_LEVELS][IRCWHEEL_SLOTS];
+    unsigned long long tick; // The next tick to run, counted from |start_ms|.
+    long long start_ms;
+    int ntimers;
+};
+
+bool ircloop_init(struct ircloop *loop);
+void ircloop_free(struct ircloop *loop);
+bool ircloop_add(struct ircloop *loop, struct ircwatch *watch);
+bool ircloop_want_write(struct ircloop *loop, struct ircwatch *watch, bool want);
+void ircloop_remove(struct ircloop *loop, struct ircwatch *watch);
+
+// Dispatches events and runs timers until ircloop_stop() is called.
+void ircloop_run(struct ircloop *loop);
+void ircloop_stop(struct ircloop *loop);
+
+void irctimer_init(struct irctimer *timer, void (*fire)(struct irctimer *timer), void *data);
+bool irctimer_pending(const struct irctimer *timer);
+
+// Schedules |timer| to fire |delay_ms| from now, moving it if it was already
+// scheduled. Timers never fire early, and at most a tick late.
+void ircloop_schedule(struct ircloop *loop, struct irctimer *timer, long delay_ms);
+void ircloop_cancel(struct ircloop *loop, struct irctimer *timer);
+
+// Most output an ircconn will hold while waiting to send it.
+#define IRCCONN_OUT_MAX (64 * 1024)
+
+// Most queued lines handed to a single writev().
+#define IRCCONN_IOV 64
+
+// Flood control: servers disconnect clients that send too much, too fast.
+// Lines are paced with a token bucket that holds up to |burst| lines and
+// refills one line every |interval_ms|. The defaults are safe nearly anywhere.
+struct ircflood {
+    int burst;
+    int interval_ms;
+};
+
+#define IRCFLOOD_BURST 5
+#define IRCFLOOD_INTERVAL_MS 2000
+
+// Keepalive: once the server has been quiet for |idle_ms|, the bot sends a
+// PING, and drops the connection if nothing at all arrives within
+// |timeout_ms|. That finds half-open connections long before TCP would.
+struct irckeepalive {
+    int idle_ms;
+    int timeout_ms;
+};
+
+#define IRCKEEPALIVE_IDLE_MS 30000
+#define IRCKEEPALIVE_TIMEOUT_MS 15000
+
+// A FIFO of lines waiting to be sent.
+struct ircqline;
+struct ircqueue {
+    struct ircqline *head;
+    struct ircqline *tail;
+};
+
+struct irctarget;
+
+// IRCv3 capabilities the bot asks for, as bits in ircconn->caps.
+enum irccap {
+    IRCCAP_MESSAGE_TAGS      = 1 << 0,
+    IRCCAP_SERVER_TIME       = 1 << 1,
+    IRCCAP_BATCH             = 1 << 2,
+    IRCCAP_USERHOST_IN_NAMES = 1 << 3, // NAMES replies carry nick!user@host.
+    IRCCAP_ACCOUNT_TAG       = 1 << 4, // Messages say which account sent them.
+    IRCCAP_ACCOUNT_NOTIFY    = 1 << 5, // ACCOUNT messages on log in and out.
+    IRCCAP_EXTENDED_JOIN     = 1 << 6  // JOINs carry the account.
+};
+
+// Most lines passed to a single on_lines call.
+#define IRCCONN_BATCH 64
+
+// Bounds on what one connection may hold back in open batches. Lines past
+// them are dispatched on their own, as if they were not batched, and so are
+// the lines of batches opened past IRCBATCH_MAX_OPEN.
+#define IRCBATCH_MAX_OPEN 8
+#define IRCBATCH_MAX_LINES 4096
+#define IRCBATCH_MAX_BYTES (1 << 20)
+
+// A non-blocking connection to a server, driven by an ircloop.
+struct ircconn {
+    struct ircwatch watch;
+    struct ircloop *loop;
+    struct ircbuf in;
+
+    unsigned caps;         // Enabled capabilities, from enum irccap.
+    unsigned caps_wanted;  // Offered by the server during CAP LS.
+    bool cap_negotiating;  // Whether CAP END is still owed to the server.
+
+    struct ircbatch *batches;    // Open batches.
+    struct ircbatch *done_batch; // Last batch handed out by irc_batch_collect().
+    int nbatches;                // Open, and what they hold between them.
+    int batched_lines;
+    int batched_bytes;
+
+    // Output waits in one of three places. Protocol traffic (PONG, JOIN,
+    // ...) goes to |control|, which is always served first. PRIVMSGs are
+    // queued per target, and targets take turns, so that one busy channel
+    // cannot starve the others. Lines leave either for |ready| only as the
+    // flood bucket allows, and |ready| is then written out with writev().
+    struct ircqueue control;
+    struct irctarget *targets;      // Round-robin order; only those with lines.
+    struct irctarget *targets_tail;
+    struct ircqueue ready;
+    int ready_sent;  // Bytes of ready.head that the socket already took.
+    int queued;      // Bytes in all of the above, bounded by IRCCONN_OUT_MAX.
+
+    struct ircflood flood;
+    long credit_ms;             // Bucket level, in milliseconds of refill.
+    long long refilled_ms;      // When the bucket was last topped up.
+    struct irctimer flood_timer; // Scheduled while lines wait on the bucket.
+
+    struct irckeepalive keepalive;
+    long long input_ms;         // When the server last sent anything.
+    long long ping_ms;          // When our last PING went out, or 0.
+    int lag_ms;                 // Round trip of the last PING, or -1 if none yet.
+    struct irctimer keepalive_timer;
+
+    // Called with every whole line that arrived in one read, in batches of
+    // at most IRCCONN_BATCH lines.
+    void (*on_lines)(struct ircconn *conn, struct ircline *lines, int nlines);
+
+    // Called once when the connection goes away, after the fd is closed.
+    void (*on_close)(struct ircconn *conn);
+
+    void *data;
+};
+
+// Takes ownership of |fd|, which must already be connected.
+bool ircconn_init(struct ircconn *conn, struct ircloop *loop, int fd, char *buf, int len);
+void ircconn_close(struct ircconn *conn);
+bool ircconn_isopen(struct ircconn *conn);
+
+// Changes the pacing of output. The bucket starts out full.
+void ircconn_set_flood(struct ircconn *conn, int burst, int interval_ms);
+
+void ircconn_set_keepalive(struct ircconn *conn, int idle_ms, int timeout_ms);
+
+// Opens a TCP connection without blocking the loop, after a cut-down Happy
+// Eyeballs (RFC 8305): addresses alternate between IPv6 and IPv4, and each
+// attempt gets IRCCONNECT_DELAY_MS to itself before the next one starts
+// alongside it. The first to connect wins; each gives up after
+// IRCCONNECT_TIMEOUT_MS.
+#define IRCCONNECT_DELAY_MS 250
+#define IRCCONNECT_TIMEOUT_MS 10000
+#define IRCCONNECT_ATTEMPTS 4 // Most attempts in flight at once.
+
+struct ircconnector;
+struct irclookup;
+struct addrinfo;
+
+struct ircattempt {
+    struct ircwatch watch; // fd is -1 if the slot is free.
+    struct irctimer timeout;
+    struct addrinfo *addr;
+    struct ircconnector *connector;
+};
+
+struct ircconnector {
+    struct ircloop *loop;
+    struct irclookup *lookup; // The name lookup, while it is running.
+    struct ircwatch resolved; // Fires when |lookup| is done.
+    struct addrinfo *addrs;
+    struct addrinfo **order; // |addrs|, families interleaved.
+    int naddrs;
+    int next;                // Index into |order| of the next to try.
+    struct ircattempt attempts[IRCCONNECT_ATTEMPTS];
+    struct irctimer delay;   // Starts the next attempt.
+
+    // Called once, with the connected socket, or -1 if every address failed.
+    void (*on_connect)(struct ircconnector *connector, int fd);
+    void *data;
+};
+
+// Resolves |server| on a thread of its own, so a slow resolver never holds
+// up the loop, then starts connecting. A name that does not resolve counts as
+// every address failing. Returns false, without ever calling |on_connect|,
+// only if the lookup could not be started at all.
+bool ircconnector_start(struct ircconnector *connector, struct ircloop *loop,
+                        const char *server, const char *port);
+bool ircconnector_busy(struct ircconnector *connector);
+
+// Abandons all attempts, without calling |on_connect|.
+void ircconnector_cancel(struct ircconnector *connector);
 
 // Raw sending functions.
-bool irc_vsend(int fd, const char *fmt, va_list argp);
-bool irc_send(int fd, const char *fmt, ...);
+// Output is queued and paced by the flood bucket; these only fail if the
+// connection is gone or its queue is full.
+bool irc_vsend(struct ircconn *conn, const char *fmt, va_list argp);
+bool irc_send(struct ircconn *conn, const char *fmt, ...);
 
 // Helpful wrappers for the raw sending functions.
-bool irc_pong(int fd, const char *response);
-bool irc_join(int fd, const char *chan);
-bool irc_nick(int fd, const char *nick, const char *passwd);
-bool irc_privmsg(int fd, const char *chan, const char *fmt, ...);
+bool irc_pong(struct ircconn *conn, const char *response);
+bool irc_join(struct ircconn *conn, const char *chan);
+bool irc_nick(struct ircconn *conn, const char *nick, const char *passwd);
+bool irc_privmsg(struct ircconn *conn, const char *chan, const char *fmt, ...);
+
+// The protocol limit on a line, including the CR/LF.
+#define IRC_LINE_MAX 512
+
+// Room left for the ":nick!user@host " that the server puts in front of our
+// messages when relaying them, which also counts against IRC_LINE_MAX.
+#define IRC_PREFIX_RESERVE 100
+
+// Builds a reply out of many entries, packing as many as fit into each
+// PRIVMSG. Lines are only ever broken between entries, and each starts with
+// the same |head| (e.g. "PRs for nick "), cut to half a line if longer.
+struct ircreply {
+    struct ircconn *conn;
+    const char *chan;
+    const char *head;
+    int headlen;
+    char text[IRC_LINE_MAX]; // The line being built.
+    int len;
+    int max;      // Longest text that still fits in a PRIVMSG to |chan|.
+    int nentries;
+    int nlines;
+
+    // Called with each finished line. By default, lines are sent to |chan|
+    // with irc_privmsg(); set this after irc_reply_init() to collect them
+    // elsewhere, e.g. on a thread that must not touch the connection.
+    bool (*emit)(struct ircreply *reply, const char *line, int len);
+    void *data;
+};
+
+void irc_reply_init(struct ircreply *reply, struct ircconn *conn, const char *chan,
+                    const char *head);
+
+// Adds one entry, starting a new line first if it would not fit. An entry too
+// long for a line of its own is truncated.
+bool irc_reply_add(struct ircreply *reply, const char *fmt, ...);
+
+// Emits the last, partly filled line.
+bool irc_reply_finish(struct ircreply *reply);
+
+// Nicks and channel names compare with RFC 1459 casemapping, where "{}|^"
+// count as the lowercase of "[]\~".
+static inline char
+irc_fold(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A' + 'a';
+    switch (c) {
+      case '[':  return '{';
+      case ']':  return '}';
+      case '\\': return '|';
+      case '~':  return '^';
+      default:   return c;
+    }
+}
+
+bool irc_name_equal(const char *a, const char *b);
 
 // Receiving functions.
-char *irc_getline(int fd, struct ircbuf *ircbuf);
-void irc_parseline(char *line, struct ircmsg *msg);
+// Splits the line in place (|len| characters, null-terminated) into |msg|.
+void irc_parseline(char *line, int len, struct ircmsg *msg);
+
+// Returns the value of the tag named |key|, or NULL if the message has none.
+struct ircslice *irc_tag(struct ircmsg *msg, const char *key);
+
+// Measures lag from the answers to the bot's own PINGs. Call with every
+// IRCMSG_PONG message.
+bool irc_pong_handle(struct ircconn *conn, struct ircmsg *msg);
+
+// Drives capability negotiation, which irc_nick() starts. Call with every
+// IRCMSG_CAP message.
+bool irc_cap_handle(struct ircconn *conn, struct ircmsg *msg);
+
+// Call with every line, in place of irc_parseline(). Returns true if the
+// line belongs to an open batch and was held back; otherwise |msg| is the
+// parsed line, to dispatch. When a batch closes, |msg| becomes the whole
+// group, which stays valid until the next call.
+bool irc_batch_collect(struct ircconn *conn, struct ircline *line, struct ircmsg *msg);
+
+// Parses the |i|th line of a whole group. Parsing works in place, so each
+// line may be parsed only once.
+void irc_batch_line(struct ircmsg_batch *batch, int i, struct ircmsg *msg);
 
 #endif // prbot_irc_h__
@@ -0,0 +1,335 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "db.h"
+#include "lifts.h"
+#include "parse.h"
+
+// A name that can be looked up: a lift's own name, or one of its aliases.
+struct lift_key {
+    char *key; // Lowercase.
+    int len;
+    struct lift *lift;
+};
+
+static struct lift **lifts;
+static int nlifts;
+
+static struct lift_key *keys;
+static int nkeys;
+
+// The perfect hash (hash and displace). A key first hashes to a bucket; the
+// bucket's seed then sends it to a slot that no other key occupies.
+static uint32_t *seeds;
+static int nbuckets;
+static int *slots; // Index into |keys|, or -1.
+static int nslots;
+
+// Attempts at seeding one bucket before the table is grown.
+#define MAX_SEED (1 << 16)
+
+// FNV-1a over the lowercased name, finished with a mixer so that nearby
+// seeds give unrelated hashes.
+static uint32_t
+hash(const char *s, int len, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (int i = 0; i < len; ++i) {
+        h ^= (unsigned char) to_lower(s[i]);
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static struct lift *
+find_id(int id)
+{
+    for (int i = 0; i < nlifts; ++i) {
+        if (lifts[i]->id == id)
+            return lifts[i];
+    }
+    return NULL;
+}
+
+static bool
+add_key(const char *name, struct lift *lift)
+{
+    struct lift_key *grown = realloc(keys, (nkeys + 1) * sizeof *grown);
+    if (!grown)
+        return false;
+    keys = grown;
+
+    struct lift_key *key = &keys[nkeys];
+    key->len = strlen(name);
+    key->key = malloc(key->len + 1);
+    if (!key->key)
+        return false;
+    for (int i = 0; i <= key->len; ++i)
+        key->key[i] = to_lower(name[i]);
+    key->lift = lift;
+    nkeys++;
+    return true;
+}
+
+bool
+lifts_add(int id, const char *name, const char *category, bool bodyweight)
+{
+    if (strlen(name) >= DB_NAME_MAX || find_id(id)) {
+        fprintf(stderr, "Bad lift: %d, \"%s\"\n", id, name);
+        return false;
+    }
+
+    struct lift **grown = realloc(lifts, (nlifts + 1) * sizeof *grown);
+    if (!grown)
+        return false;
+    lifts = grown;
+
+    struct lift *lift = calloc(1, sizeof *lift);
+    if (!lift)
+        return false;
+    lifts[nlifts++] = lift;
+
+    lift->id = id;
+    lift->bodyweight = bodyweight;
+    lift->name = strdup(name);
+    lift->category = strdup(category ? category : "");
+    if (!lift->name || !lift->category)
+        return false;
+    return add_key(name, lift);
+}
+
+bool
+lifts_alias(const char *alias, int id)
+{
+    struct lift *lift = find_id(id);
+    if (!lift) {
+        fprintf(stderr, "Alias \"%s\" is for unknown lift %d\n", alias, id);
+        return false;
+    }
+    return add_key(alias, lift);
+}
+
+static int
+compare_keys(const void *a, const void *b)
+{
+    return strcmp(((const struct lift_key *) a)->key, ((const struct lift_key *) b)->key);
+}
+
+// Bucket indices, largest bucket first, for placing the hardest ones early.
+static int *bucket_order;
+static int *bucket_size;
+
+static int
+compare_buckets(const void *a, const void *b)
+{
+    return bucket_size[*(const int *) b] - bucket_size[*(const int *) a];
+}
+
+// Tries to place every key in a table of |nslots|. Fails if some bucket
+// cannot be seeded, in which case the caller grows the table.
+static bool
+place_keys(int *bucket_of)
+{
+    for (int i = 0; i < nslots; ++i)
+        slots[i] = -1;
+
+    int *members = malloc((nkeys + 1) * sizeof *members);
+    int *wanted = malloc((nkeys + 1) * sizeof *wanted);
+    if (!members || !wanted) {
+        free(members);
+        free(wanted);
+        return false;
+    }
+
+    bool ok = true;
+    for (int b = 0; ok && b < nbuckets; ++b) {
+        int bucket = bucket_order[b];
+        int n = 0;
+        for (int k = 0; k < nkeys; ++k) {
+            if (bucket_of[k] == bucket)
+                members[n++] = k;
+        }
+        if (n == 0)
+            break; // The rest are empty too.
+
+        uint32_t seed;
+        for (seed = 1; seed < MAX_SEED; ++seed) {
+            int placed;
+            for (placed = 0; placed < n; ++placed) {
+                struct lift_key *key = &keys[members[placed]];
+                int slot = hash(key->key, key->len, seed) % nslots;
+                if (slots[slot] >= 0)
+                    break;
+                // Claim it now, so the bucket's own keys cannot collide.
+                slots[slot] = members[placed];
+                wanted[placed] = slot;
+            }
+            if (placed == n)
+                break;
+            for (int i = 0; i < placed; ++i)
+                slots[wanted[i]] = -1;
+        }
+        if (seed == MAX_SEED)
+            ok = false;
+        seeds[bucket] = seed;
+    }
+
+    free(members);
+    free(wanted);
+    return ok;
+}
+
+bool
+lifts_build(void)
+{
+    // Duplicates would never hash apart. The same name twice for the same
+    // lift is harmless; for two different lifts, it is ambiguous.
+    qsort(keys, nkeys, sizeof *keys, compare_keys);
+    int n = 0;
+    for (int i = 0; i < nkeys; ++i) {
+        if (n > 0 && strcmp(keys[n - 1].key, keys[i].key) == 0) {
+            if (keys[n - 1].lift != keys[i].lift) {
+                fprintf(stderr, "Lift name \"%s\" is ambiguous\n", keys[i].key);
+                return false;
+            }
+            free(keys[i].key);
+            continue;
+        }
+        keys[n++] = keys[i];
+    }
+    nkeys = n;
+
+    // Average two keys per bucket, and a table a quarter larger than needed.
+    nbuckets = nkeys / 2 + 1;
+    nslots = nkeys + nkeys / 4 + 1;
+
+    int *bucket_of = malloc((nkeys + 1) * sizeof *bucket_of);
+    seeds = calloc(nbuckets, sizeof *seeds);
+    bucket_order = malloc(nbuckets * sizeof *bucket_order);
+    bucket_size = calloc(nbuckets, sizeof *bucket_size);
+    bool ok = bucket_of && seeds && bucket_order && bucket_size;
+
+    if (ok) {
+        for (int k = 0; k < nkeys; ++k) {
+            bucket_of[k] = hash(keys[k].key, keys[k].len, 0) % nbuckets;
+            bucket_size[bucket_of[k]]++;
+        }
+        for (int b = 0; b < nbuckets; ++b)
+            bucket_order[b] = b;
+        qsort(bucket_order, nbuckets, sizeof *bucket_order, compare_buckets);
+    }
+
+    while (ok) {
+        int *grown = realloc(slots, nslots * sizeof *grown);
+        if (!grown) {
+            ok = false;
+            break;
+        }
+        slots = grown;
+        if (place_keys(bucket_of))
+            break;
+        nslots += nslots / 4 + 1;
+    }
+
+    free(bucket_of);
+    free(bucket_order);
+    free(bucket_size);
+    bucket_order = bucket_size = NULL;
+    return ok;
+}
+
+bool
+lifts_load(void)
+{
+    bool ok = true;
+
+    sqlite3_stmt *stmt = db_stmt(DB_ALL_LIFTS);
+    int retval;
+    while (ok && (retval = sqlite3_step(stmt)) == SQLITE_ROW) {
+        ok = lifts_add(sqlite3_column_int(stmt, 0),
+                       (const char *) sqlite3_column_text(stmt, 1),
+                       (const char *) sqlite3_column_text(stmt, 2),
+                       sqlite3_column_int(stmt, 3));
+    }
+    ok = ok && retval == SQLITE_DONE;
+    db_stmt_done(stmt);
+
+    stmt = db_stmt(DB_ALL_LIFT_ALIASES);
+    while (ok && (retval = sqlite3_step(stmt)) == SQLITE_ROW)
+        ok = lifts_alias((const char *) sqlite3_column_text(stmt, 0), sqlite3_column_int(stmt, 1));
+    ok = ok && retval == SQLITE_DONE;
+    db_stmt_done(stmt);
+
+    if (!ok) {
+        fprintf(stderr, "Failed to load lifts: %s\n", db_errmsg());
+        return false;
+    }
+    return lifts_build();
+}
+
+const struct lift *
+lifts_find(const char *name, int len)
+{
+    if (nslots == 0)
+        return NULL;
+
+    uint32_t bucket = hash(name, len, 0) % nbuckets;
+    int k = slots[hash(name, len, seeds[bucket]) % nslots];
+    if (k < 0 || keys[k].len != len)
+        return NULL;
+
+    for (int i = 0; i < len; ++i) {
+        if (to_lower(name[i]) != keys[k].key[i])
+            return NULL;
+    }
+    return keys[k].lift;
+}
+
+void
+lifts_free(void)
+{
+    for (int i = 0; i < nlifts; ++i) {
+        free(lifts[i]->name);
+        free(lifts[i]->category);
+        free(lifts[i]);
+    }
+    for (int i = 0; i < nkeys; ++i)
+        free(keys[i].key);
+    free(lifts);
+    free(keys);
+    free(seeds);
+    free(slots);
+    lifts = NULL;
+    keys = NULL;
+    seeds = NULL;
+    slots = NULL;
+    nlifts = nkeys = nbuckets = nslots = 0;
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Registry of known lifts and the aliases they go by ("bp", "ohp", ...).
+// It is loaded from the database once at startup, then frozen into a
+// perfect hash, so lookups take the same time however many names there are.
+
+#include <stdbool.h>
+
+#ifndef prbot_lifts_h__
+#define prbot_lifts_h__
+
+struct lift {
+    int id;          // lifts.id in the database.
+    char *name;      // Canonical name, as stored with PRs.
+    char *category;  // e.g. "squat", "press", "pull" or "olympic". Possibly empty.
+    bool bodyweight; // Whether the lifter's own weight is part of the load.
+};
+
+// Building the registry: add every lift and alias, then build the hash.
+bool lifts_add(int id, const char *name, const char *category, bool bodyweight);
+bool lifts_alias(const char *alias, int id);
+bool lifts_build(void);
+
+// Does all of the above from the lifts and lift_aliases tables. Must run
+// before db_worker_start().
+bool lifts_load(void);
+
+// Case-insensitive lookup of a name or alias, or NULL if unknown.
+const struct lift *lifts_find(const char *name, int len);
+
+void lifts_free(void);
+
+#endif // prbot_lifts_h__
@@ -0,0 +1,559 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "irc.h"
+#include "members.h"
+
+// Smallest table a set starts out with. Must be a power of two.
+#define MEMBERS_MIN_SLOTS 8
+
+// An interned nick or user@host. Nicks never contain '@', and user@hosts
+// always do, so the two can share a table without mixing.
+struct members_str {
+    char *s;       // As last seen; compared with RFC 1459 casemapping.
+    uint32_t hash;
+    uint32_t refs; // For a nick, channels it is in; for a user@host, nicks it belongs to.
+    uint32_t host; // For a nick, its user@host if known. For a free ID, the next free one.
+};
+
+struct members_chan {
+    char *name;
+    struct members_idset nicks;
+    bool synced; // Whether the NAMES list has ended.
+};
+
+// FNV-1a over the folded string.
+static uint32_t
+hash_name(const char *s, int len)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; ++i) {
+        h ^= (unsigned char) irc_fold(s[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static bool
+names_equal(const char *a, const char *b, int len)
+{
+    for (int i = 0; i < len; ++i) {
+        if (a[i] == '\0' || irc_fold(a[i]) != irc_fold(b[i]))
+            return false;
+    }
+    return a[len] == '\0';
+}
+
+// The string table is hashed by the strings; channels by the IDs themselves.
+static uint32_t
+slot_hash(struct members *m, struct members_idset *set, uint32_t id)
+{
+    if (set == &m->names)
+        return m->strs[id].hash;
+    uint32_t h = id * 2654435761u;
+    return h ^ (h >> 16);
+}
+
+static void
+idset_place(struct members *m, struct members_idset *set, uint32_t id)
+{
+    uint32_t mask = set->cap - 1;
+    uint32_t i = slot_hash(m, set, id) & mask;
+    while (set->slots[i] != 0)
+        i = (i + 1) & mask;
+    set->slots[i] = id;
+}
+
+// Adds |id|, which must not be in the set yet. Grows at three quarters full.
+static bool
+idset_add(struct members *m, struct members_idset *set, uint32_t id)
+{
+    if ((set->count + 1) * 4 > set->cap * 3) {
+        // Rehashed in place, since the hash depends on which set this is.
+        uint32_t *old = set->slots;
+        uint32_t oldcap = set->cap;
+        uint32_t cap = oldcap ? oldcap * 2 : MEMBERS_MIN_SLOTS;
+        uint32_t *slots = calloc(cap, sizeof *slots);
+        if (!slots)
+            return false;
+
+        set->slots = slots;
+        set->cap = cap;
+        for (uint32_t i = 0; i < oldcap; ++i) {
+            if (old[i] != 0)
+                idset_place(m, set, old[i]);
+        }
+        free(old);
+    }
+
+    idset_place(m, set, id);
+    set->count++;
+    return true;
+}
+
+// Returns the slot holding |id|, or -1.
+static long
+idset_find(struct members *m, struct members_idset *set, uint32_t id)
+{
+    if (set->cap == 0)
+        return -1;
+    uint32_t mask = set->cap - 1;
+    for (uint32_t i = slot_hash(m, set, id) & mask; set->slots[i] != 0; i = (i + 1) & mask) {
+        if (set->slots[i] == id)
+            return i;
+    }
+    return -1;
+}
+
+// Empties slot |i|, shifting later entries of the probe run back into the
+// hole, so lookups never need tombstones.
+static void
+idset_remove_at(struct members *m, struct members_idset *set, uint32_t i)
+{
+    uint32_t mask = set->cap - 1;
+    for (uint32_t j = (i + 1) & mask; set->slots[j] != 0; j = (j + 1) & mask) {
+        // An entry may move back only if its home slot is not in (i, j].
+        uint32_t home = slot_hash(m, set, set->slots[j]) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            set->slots[i] = set->slots[j];
+            i = j;
+        }
+    }
+    set->slots[i] = 0;
+    set->count--;
+}
+
+static uint32_t
+lookup(struct members *m, const char *s, int len, uint32_t hash)
+{
+    if (m->names.cap == 0)
+        return 0;
+    uint32_t mask = m->names.cap - 1;
+    for (uint32_t i = hash & mask; m->names.slots[i] != 0; i = (i + 1) & mask) {
+        uint32_t id = m->names.slots[i];
+        if (m->strs[id].hash == hash && names_equal(m->strs[id].s, s, len))
+            return id;
+    }
+    return 0;
+}
+
+// Returns the string's ID, interning it with no references if it is new.
+// Returns 0 if out of memory.
+static uint32_t
+intern(struct members *m, const char *s, int len)
+{
+    if (m->closed)
+        return 0;
+
+    uint32_t hash = hash_name(s, len);
+    uint32_t id = lookup(m, s, len, hash);
+    if (id)
+        return id;
+
+    char *copy = malloc(len + 1);
+    if (!copy)
+        return 0;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+
+    if (m->free_id) {
+        id = m->free_id;
+        m->free_id = m->strs[id].host;
+    } else {
+        if (m->nstrs == 0)
+            m->nstrs = 1; // ID 0 means "none".
+        if (m->nstrs >= m->strcap) {
+            uint32_t cap = m->strcap ? m->strcap * 2 : 64;
+            struct members_str *strs = realloc(m->strs, cap * sizeof *strs);
+            if (!strs) {
+                free(copy);
+                return 0;
+            }
+            m->strs = strs;
+            m->strcap = cap;
+        }
+        id = m->nstrs++;
+    }
+
+    struct members_str str = { copy, hash, 0, 0 };
+    m->strs[id] = str;
+    if (!idset_add(m, &m->names, id)) {
+        free(copy);
+        m->strs[id].s = NULL;
+        m->strs[id].host = m->free_id;
+        m->free_id = id;
+        return 0;
+    }
+    return id;
+}
+
+// Drops a reference, and the string with its last one. A string that was
+// just interned and never referenced is dropped as well.
+static void
+unref(struct members *m, uint32_t id)
+{
+    struct members_str *str = &m->strs[id];
+    if (str->refs > 0 && --str->refs > 0)
+        return;
+
+    uint32_t host = str->host;
+    idset_remove_at(m, &m->names, idset_find(m, &m->names, id));
+    free(str->s);
+    str->s = NULL;
+    str->host = m->free_id;
+    m->free_id = id;
+
+    if (host)
+        unref(m, host);
+}
+
+static void
+set_host(struct members *m, uint32_t id, const char *userhost, int len)
+{
+    uint32_t host = intern(m, userhost, len);
+    if (!host || m->strs[id].host == host)
+        return;
+
+    uint32_t old = m->strs[id].host;
+    m->strs[id].host = host;
+    m->strs[host].refs++;
+    if (old)
+        unref(m, old);
+}
+
+static struct members_chan *
+find_chan(struct members *m, const char *name)
+{
+    int len = strlen(name);
+    for (int i = 0; i < m->nchans; ++i) {
+        if (names_equal(m->chans[i].name, name, len))
+            return &m->chans[i];
+    }
+    return NULL;
+}
+
+static void
+clear_chan(struct members *m, struct members_chan *chan)
+{
+    for (uint32_t i = 0; i < chan->nicks.cap; ++i) {
+        if (chan->nicks.slots[i] != 0)
+            unref(m, chan->nicks.slots[i]);
+    }
+    free(chan->nicks.slots);
+    memset(&chan->nicks, 0, sizeof chan->nicks);
+    chan->synced = false;
+}
+
+// Adds |nick| to |chan|, noting its user@host if given.
+static void
+add_member(struct members *m, struct members_chan *chan, const char *nick, int len,
+           const char *userhost, int hostlen)
+{
+    uint32_t id = intern(m, nick, len);
+    if (!id)
+        return;
+
+    if (idset_find(m, &chan->nicks, id) < 0) {
+        if (!idset_add(m, &chan->nicks, id)) {
+            if (m->strs[id].refs == 0)
+                unref(m, id);
+            return;
+        }
+        m->strs[id].refs++;
+    }
+    if (hostlen > 0)
+        set_host(m, id, userhost, hostlen);
+}
+
+// Takes |id| out of |chan|, if it is there.
+static void
+remove_member(struct members *m, struct members_chan *chan, uint32_t id)
+{
+    long slot = idset_find(m, &chan->nicks, id);
+    if (slot < 0)
+        return;
+    idset_remove_at(m, &chan->nicks, slot);
+    unref(m, id);
+}
+
+void
+members_init(struct members *m)
+{
+    memset(m, 0, sizeof *m);
+}
+
+void
+members_free(struct members *m)
+{
+    for (int i = 0; i < m->nchans; ++i) {
+        free(m->chans[i].nicks.slots);
+        free(m->chans[i].name);
+    }
+    free(m->chans);
+    for (uint32_t id = 1; id < m->nstrs; ++id)
+        free(m->strs[id].s);
+    free(m->strs);
+    free(m->names.slots);
+    members_init(m);
+    m->closed = true;
+}
+
+void
+members_join_self(struct members *m, const char *chan)
+{
+    if (m->closed)
+        return;
+
+    struct members_chan *c = find_chan(m, chan);
+    if (c) {
+        clear_chan(m, c);
+        return;
+    }
+
+    struct members_chan *chans = realloc(m->chans, (m->nchans + 1) * sizeof *chans);
+    if (!chans)
+        return;
+    m->chans = chans;
+
+    struct members_chan fresh = { strdup(chan), { NULL, 0, 0 }, false };
+    if (fresh.name)
+        m->chans[m->nchans++] = fresh;
+}
+
+void
+members_leave_self(struct members *m, const char *chan)
+{
+    struct members_chan *c = find_chan(m, chan);
+    if (!c)
+        return;
+    clear_chan(m, c);
+    free(c->name);
+    *c = m->chans[--m->nchans];
+}
+
+void
+members_join(struct members *m, const char *chan, const char *nick, const char *user,
+             const char *host)
+{
+    struct members_chan *c = find_chan(m, chan);
+    if (!c)
+        return;
+
+    char userhost[512];
+    int hostlen = 0;
+    if (user && host && *host)
+        hostlen = snprintf(userhost, sizeof userhost, "%s@%s", user, host);
+    if (hostlen >= (int) sizeof userhost)
+        hostlen = 0;
+    add_member(m, c, nick, strlen(nick), userhost, hostlen);
+}
+
+void
+members_part(struct members *m, const char *chan, const char *nick)
+{
+    struct members_chan *c = find_chan(m, chan);
+    int len = strlen(nick);
+    uint32_t id = lookup(m, nick, len, hash_name(nick, len));
+    if (c && id)
+        remove_member(m, c, id);
+}
+
+void
+members_quit(struct members *m, const char *nick)
+{
+    int len = strlen(nick);
+    uint32_t id = lookup(m, nick, len, hash_name(nick, len));
+
+    // Once the last reference goes, so does the ID.
+    for (int i = 0; id && i < m->nchans; ++i) {
+        bool last = m->strs[id].refs == 1;
+        long slot = idset_find(m, &m->chans[i].nicks, id);
+        if (slot < 0)
+            continue;
+        idset_remove_at(m, &m->chans[i].nicks, slot);
+        unref(m, id);
+        if (last)
+            break;
+    }
+}
+
+void
+members_quit_many(struct members *m, const char **nicks, int n)
+{
+    uint32_t *ids = malloc(n * sizeof *ids);
+    if (!ids) {
+        for (int i = 0; i < n; ++i)
+            members_quit(m, nicks[i]);
+        return;
+    }
+
+    int nids = 0;
+    for (int i = 0; i < n; ++i) {
+        int len = strlen(nicks[i]);
+        uint32_t id = lookup(m, nicks[i], len, hash_name(nicks[i], len));
+        if (id)
+            ids[nids++] = id;
+    }
+
+    // One pass over the channels, each emptied of everyone at once. An ID
+    // is struck from the list with its last reference, since the string
+    // table may hand it out again later.
+    for (int i = 0; i < m->nchans && nids > 0; ++i) {
+        struct members_idset *set = &m->chans[i].nicks;
+        for (int k = 0; k < nids; ) {
+            uint32_t id = ids[k];
+            bool last = m->strs[id].refs == 1;
+            long slot = idset_find(m, set, id);
+            if (slot >= 0) {
+                idset_remove_at(m, set, slot);
+                unref(m, id);
+                if (last) {
+                    ids[k] = ids[--nids];
+                    continue;
+                }
+            }
+            k++;
+        }
+    }
+    free(ids);
+}
+
+void
+members_rename(struct members *m, const char *nick, const char *newnick)
+{
+    int len = strlen(nick);
+    uint32_t id = lookup(m, nick, len, hash_name(nick, len));
+    if (!id)
+        return;
+
+    // A change of case only: same ID, new spelling.
+    int newlen = strlen(newnick);
+    if (names_equal(m->strs[id].s, newnick, newlen)) {
+        char *copy = strdup(newnick);
+        if (copy) {
+            free(m->strs[id].s);
+            m->strs[id].s = copy;
+        }
+        return;
+    }
+
+    uint32_t newid = intern(m, newnick, newlen);
+    if (!newid) {
+        members_quit(m, nick);
+        return;
+    }
+
+    // The user@host moves over before the old nick can let go of it.
+    uint32_t host = m->strs[id].host;
+    if (host && !m->strs[newid].host) {
+        m->strs[newid].host = host;
+        m->strs[host].refs++;
+    }
+
+    // Hold on to |id| until every channel is done with it.
+    m->strs[id].refs++;
+    for (int i = 0; i < m->nchans; ++i) {
+        struct members_chan *c = &m->chans[i];
+        long slot = idset_find(m, &c->nicks, id);
+        if (slot < 0)
+            continue;
+        idset_remove_at(m, &c->nicks, slot);
+        unref(m, id);
+        if (idset_find(m, &c->nicks, newid) < 0 && idset_add(m, &c->nicks, newid))
+            m->strs[newid].refs++;
+    }
+    unref(m, id);
+    if (m->strs[newid].refs == 0)
+        unref(m, newid);
+}
+
+void
+members_names(struct members *m, const char *chan, const char *names)
+{
+    struct members_chan *c = find_chan(m, chan);
+    if (!c)
+        return;
+
+    const char *p = names;
+    while (*p) {
+        while (*p == ' ')
+            p++;
+        // Status prefixes; several of them with multi-prefix.
+        while (*p && strchr("~&@%+", *p))
+            p++;
+
+        const char *nick = p;
+        while (*p && *p != ' ' && *p != '!')
+            p++;
+        int len = p - nick;
+
+        const char *userhost = p;
+        int hostlen = 0;
+        if (*p == '!') {
+            userhost = ++p;
+            while (*p && *p != ' ')
+                p++;
+            hostlen = p - userhost;
+        }
+
+        if (len > 0)
+            add_member(m, c, nick, len, userhost, hostlen);
+    }
+}
+
+void
+members_names_end(struct members *m, const char *chan)
+{
+    struct members_chan *c = find_chan(m, chan);
+    if (c)
+        c->synced = true;
+}
+
+int
+members_count(struct members *m, const char *chan)
+{
+    struct members_chan *c = find_chan(m, chan);
+    return c && c->synced ? (int) c->nicks.count : -1;
+}
+
+const char *
+members_userhost(struct members *m, const char *nick)
+{
+    int len = strlen(nick);
+    uint32_t id = lookup(m, nick, len, hash_name(nick, len));
+    return id && m->strs[id].host ? m->strs[m->strs[id].host].s : NULL;
+}
+
+void
+members_each(struct members *m, const char *chan, members_cb cb, void *data)
+{
+    struct members_chan *c = find_chan(m, chan);
+    for (uint32_t i = 0; c && i < c->nicks.cap; ++i) {
+        uint32_t id = c->nicks.slots[i];
+        if (id != 0 && !cb(m->strs[id].s, data))
+            return;
+    }
+}
@@ -0,0 +1,99 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Who is in each of the bot's channels, on one connection. The bot's own
+// JOIN starts a channel afresh, NAMES fills it in, and JOIN, PART, KICK, QUIT
+// and NICK keep it up to date from then on.
+//
+// Every nick and user@host is interned once, however many channels it turns
+// up in, and a channel is just an open-addressing set of 32-bit string IDs.
+// Everything is O(1) per channel, which keeps netsplits cheap. Nicks compare
+// as IRC compares them, with RFC 1459 casemapping ("[]\~" are "{}|^").
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef prbot_members_h__
+#define prbot_members_h__
+
+// A hash set of string IDs. 0 marks an empty slot.
+struct members_idset {
+    uint32_t *slots;
+    uint32_t cap;   // A power of two, or 0.
+    uint32_t count;
+};
+
+struct members_str;
+struct members_chan;
+
+struct members {
+    struct members_str *strs; // Indexed by ID. ID 0 is never used.
+    uint32_t nstrs;
+    uint32_t strcap;
+    uint32_t free_id;         // Head of the list of IDs to reuse, or 0.
+    struct members_idset names; // Every live ID, by its string.
+
+    struct members_chan *chans;
+    int nchans;
+
+    bool closed;              // Freed: ignore everything until the next init.
+};
+
+void members_init(struct members *m);
+
+// Forgets everything, as after a disconnect. Until members_init() is called
+// again, nothing more is recorded, so stray messages can't allocate anything.
+void members_free(struct members *m);
+
+// The bot joined or left |chan| itself.
+void members_join_self(struct members *m, const char *chan);
+void members_leave_self(struct members *m, const char *chan);
+
+// Someone else joined or left |chan| (a KICK counts as leaving). Channels
+// the bot is not in are ignored. |user| and |host| may be NULL.
+void members_join(struct members *m, const char *chan, const char *nick, const char *user,
+                  const char *host);
+void members_part(struct members *m, const char *chan, const char *nick);
+
+// Someone left every channel, or changed their nick in all of them.
+void members_quit(struct members *m, const char *nick);
+void members_rename(struct members *m, const char *nick, const char *newnick);
+
+// The QUITs of a netsplit, all at once: the channels are gone through once,
+// rather than once per nick.
+void members_quit_many(struct members *m, const char **nicks, int n);
+
+// A 353 reply's list of names: nicks separated by spaces, each possibly
+// behind status prefixes ("@+nick") and, with userhost-in-names, followed by
+// "!user@host". The 366 reply ends the list.
+void members_names(struct members *m, const char *chan, const char *names);
+void members_names_end(struct members *m, const char *chan);
+
+// Queries. A channel's count is -1 until the bot is in it and has the
+// whole NAMES list.
+int members_count(struct members *m, const char *chan);
+const char *members_userhost(struct members *m, const char *nick); // Or NULL if unknown.
+
+// Runs |cb| on each nick in |chan|, in no particular order, stopping early
+// if it returns false. The members must not change in the meantime.
+typedef bool (*members_cb)(const char *nick, void *data);
+void members_each(struct members *m, const char *chan, members_cb cb, void *data);
+
+#endif // prbot_members_h__
@@ -0,0 +1,171 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+
+#include "parse.h"
+
+void
+skip_spaces(char **p)
+{
+    while (is_space(**p))
+        (*p)++;
+}
+
+// Matches |word| case-insensitively, as a whole word.
+bool
+skip_word(char **p, const char *word)
+{
+    char *s = *p;
+    while (*word && to_lower(*s) == *word) {
+        s++;
+        word++;
+    }
+    if (*word || !at_word_end(s))
+        return false;
+    *p = s;
+    return true;
+}
+
+// Reads a positive count, such as sets or reps.
+bool
+parse_count(char **p, int *out)
+{
+    char *s = *p;
+    int n = 0;
+    while (is_digit(*s)) {
+        if (n >= 100000)
+            return false;
+        n = n * 10 + (*s++ - '0');
+    }
+    if (s == *p || n == 0)
+        return false;
+    *p = s;
+    *out = n;
+    return true;
+}
+
+// Reads "<sets>x<reps>", allowing spaces around the 'x'.
+bool
+parse_sets_reps(char **p, int *sets, int *reps)
+{
+    char *s = *p;
+    if (!parse_count(&s, sets))
+        return false;
+    skip_spaces(&s);
+    if (*s != 'x' && *s != 'X')
+        return false;
+    s++;
+    skip_spaces(&s);
+    if (!parse_count(&s, reps) || !at_word_end(s))
+        return false;
+    *p = s;
+    return true;
+}
+
+// Reads "<number>[ ]<unit>" into kilograms. The number is accumulated as an
+// integer and scaled once, so "102.5" is exactly what strtod() would give.
+bool
+parse_weight(char **p, double *kgs)
+{
+    static const double POW10[] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+    char *s = *p;
+    long long mantissa = 0;
+    int digits = 0;
+    int decimals = -1; // Digits after the point, once one is seen.
+
+    for (;; s++) {
+        if (is_digit(*s)) {
+            if (++digits > 12)
+                return false;
+            mantissa = mantissa * 10 + (*s - '0');
+            if (decimals >= 0 && ++decimals > 6)
+                return false;
+        } else if (*s == '.' && decimals < 0) {
+            decimals = 0;
+        } else {
+            break;
+        }
+    }
+    if (digits == 0 || mantissa == 0)
+        return false;
+
+    double weight = (double) mantissa / POW10[decimals > 0 ? decimals : 0];
+
+    skip_spaces(&s);
+    if (skip_word(&s, "kg") || skip_word(&s, "kgs")) {
+        *kgs = weight;
+    } else if (skip_word(&s, "lb") || skip_word(&s, "lbs")) {
+        *kgs = lb2kg(weight);
+    } else {
+        return false;
+    }
+    *p = s;
+    return true;
+}
+
+// Parses |msg| in place: on success, |pr->lift| points into it, lowercased.
+bool
+tryparse_pr(char *msg, struct prbot_pr *pr)
+{
+    char *p = msg;
+    skip_spaces(&p);
+
+    // The lift is everything up to the first number, less a trailing "of".
+    char *lift = p;
+    while (*p && !is_digit(*p))
+        p++;
+    char *lift_end = p;
+    while (lift_end > lift && is_space(lift_end[-1]))
+        lift_end--;
+    if (lift_end - lift >= 3 && is_space(lift_end[-3]) &&
+        to_lower(lift_end[-2]) == 'o' && to_lower(lift_end[-1]) == 'f')
+    {
+        lift_end -= 3;
+        while (lift_end > lift && is_space(lift_end[-1]))
+            lift_end--;
+    }
+    if (lift_end == lift)
+        return false;
+
+    if (parse_sets_reps(&p, &pr->sets, &pr->reps)) {
+        // "3x5 @ 100kg", or "3x5 at 100kg".
+        skip_spaces(&p);
+        if (*p == '@')
+            p++;
+        else
+            skip_word(&p, "at");
+        skip_spaces(&p);
+        if (!parse_weight(&p, &pr->kgs))
+            return false;
+    } else {
+        if (!parse_weight(&p, &pr->kgs))
+            return false;
+        skip_spaces(&p);
+        if (!parse_sets_reps(&p, &pr->sets, &pr->reps))
+            return false;
+    }
+
+    *lift_end = '\0';
+    for (char *c = lift; *c != '\0'; ++c)
+        *c = to_lower(*c);
+    pr->lift = lift;
+    return true;
+}
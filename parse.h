@@ -0,0 +1,88 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// PR syntax. The lift comes first, then the weight and the sets and reps,
+// in either order:
+//
+//   squat of 100kg 5x5
+//   squat 3x5 @ 100kg
+//   bench press of 225.5 lbs 3 x 5
+//
+// Anything after that is ignored. Only ASCII is special, so none of this
+// depends on the locale.
+
+#include <stdbool.h>
+
+#include "db.h"
+
+#ifndef prbot_parse_h__
+#define prbot_parse_h__
+
+static inline double
+kg2lb(double kgs)
+{
+    return kgs * 2.205;
+}
+
+static inline double
+lb2kg(double lbs)
+{
+    return lbs / 2.205;
+}
+
+static inline bool
+is_space(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static inline bool
+is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline char
+to_lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static inline bool
+at_word_end(const char *p)
+{
+    return *p == '\0' || is_space(*p);
+}
+
+void skip_spaces(char **p);
+
+// Matches |word| case-insensitively, as a whole word, and skips past it.
+bool skip_word(char **p, const char *word);
+
+// Parsers for the pieces of a PR. Each advances *|p| past what it read, and
+// leaves it alone on failure.
+bool parse_count(char **p, int *out);
+bool parse_sets_reps(char **p, int *sets, int *reps);
+bool parse_weight(char **p, double *kgs);
+
+// Parses a whole PR in place: on success, |pr->lift| points into |msg|, lowercased.
+bool tryparse_pr(char *msg, struct prbot_pr *pr);
+
+#endif // prbot_parse_h__
@@ -22,400 +22,1539 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
-#include <sqlite3.h>
-#include <regex.h>
 
+#include "auth.h"
+#include "bulk.h"
+#include "config.h"
+#include "db.h"
 #include "irc.h"
+#include "lifts.h"
+#include "members.h"
+#include "parse.h"
+#include "prcache.h"
+#include "ratelimit.h"
 
-#define BUF_LEN 1024
+// Big enough that one read() can pick up a whole burst of lines.
+#define IRC_BUF_LEN (16 * 1024)
 
+// Defaults, used for anything the configuration file leaves out.
+// Without a configuration file, the bot joins IRC_CHANNEL on IRC_HOST.
+#define CONFIG_NAME "prbot.conf"
 #define DATABASE_NAME "prbot.sqlite3"
+#define DATABASE_SYNCHRONOUS "FULL"
 #define IRC_HOST "irc.rizon.net"
 #define IRC_PORT "6667"
 #define IRC_NICK "prbot"
 #define IRC_CHANNEL "#prbottest"
 
-static const char INITIALIZE_DB[] =
-    "CREATE TABLE IF NOT EXISTS prs ("
-    "    id INTEGER PRIMARY KEY AUTOINCREMENT,"
-    "    nick VARCHAR(255) NOT NULL,"
-    "    lift VARCHAR(255) NOT NULL,"
-    "    date INTEGER NOT NULL,"
-    "    sets INTEGER NOT NULL,"
-    "    reps INTEGER NOT NULL,"
-    "    kgs REAL NOT NULL"
-    ");";
-
-static const char TOP_PRS[] =
-    "SELECT * "
-    "FROM "
-    "   (SELECT nick, lift, date, sets, reps, kgs"
-    "    FROM prs"
-    "    WHERE nick = ?"
-    "    ORDER BY date DESC) "
-    "GROUP BY lift, nick "
-    "ORDER BY lift ASC;";
-
-static const char INSERT_PR[] =
-    "INSERT INTO prs (nick, lift, date, sets, reps, kgs)"
-    "VALUES (?, ?, ?, ?, ?, ?)";
-
-static const char *LIFTS[] = {
-    "bench press",
-    "overhead press",
-    "squat",
-    "front squat",
-    "power clean"
-};
+// Lost connections are retried after a delay that doubles with each failure
+// in a row, from RECONNECT_MIN_MS up to RECONNECT_MAX_MS, less a random part
+// of up to half so that bots sharing a server don't all come back at once.
+#define RECONNECT_MIN_MS 1000
+#define RECONNECT_MAX_MS (5 * 60 * 1000)
 
-struct prbot_pr {
-    char *nick;
-    char *lift;
-    time_t date;
-    int sets;
-    int reps;
-    double kgs;
+// State for one server connection. Every network shares the database.
+struct network {
+    struct config_network *config;
+    struct ircloop *loop;
+    struct ircconnector connector;
+    struct irctimer reconnect;
+    int failures;           // Connections in a row that never got registered.
+    struct ircconn conn;
+    char nick[64];          // Our nick right now: the config's until 001 says otherwise.
+    struct members members; // Who is in our channels; reset on disconnect.
+    struct auth auth;       // Who is logged in as whom; also reset on disconnect.
+    struct ratelimit limits;
+    char buf[IRC_BUF_LEN];
 };
 
-static double inline
-kg2lb(double kgs)
+static bool
+handle_ping(struct ircconn *conn, struct ircmsg_ping *ping)
+{
+    irc_pong(conn, ping->text.s);
+    return true;
+}
+
+// Records the nick the server knows us by. Too long a nick is ignored: it
+// can't have been ours.
+static void
+set_nick(struct network *network, const char *nick)
 {
-    return kgs * 2.205;
+    if (strlen(nick) < sizeof network->nick)
+        strcpy(network->nick, nick);
 }
 
-static double inline
-lb2kg(double lbs)
+// Whether |nick| is the bot itself.
+static bool
+is_self(struct ircconn *conn, const char *nick)
 {
-    return lbs / 2.205;
+    struct network *network = conn->data;
+    return irc_name_equal(nick, network->nick);
 }
 
-// Global database handle ( :( ).
-static sqlite3 *db;
+static bool
+handle_part(struct ircconn *conn, struct ircmsg_part *part)
+{
+    struct network *network = conn->data;
+    if (is_self(conn, part->name.nick.s))
+        members_leave_self(&network->members, part->chan.s);
+    else
+        members_part(&network->members, part->chan.s, part->name.nick.s);
+    return true;
+}
 
 static bool
-insert_pr(struct prbot_pr *pr)
+handle_join(struct ircconn *conn, struct ircmsg_join *join)
 {
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare(db, INSERT_PR, -1, &stmt, NULL) != SQLITE_OK) {
-        // Something broke. :(
-        return false;
+    struct network *network = conn->data;
+    if (is_self(conn, join->name.nick.s)) {
+        members_join_self(&network->members, join->chan.s);
+    } else {
+        members_join(&network->members, join->chan.s, join->name.nick.s,
+                     join->name.user.s, join->name.host.s);
     }
-    sqlite3_bind_text(stmt, 1, pr->nick, -1, NULL);
-    sqlite3_bind_text(stmt, 2, pr->lift, -1, NULL);
-    sqlite3_bind_int64(stmt, 3, (sqlite3_int64) pr->date);
-    sqlite3_bind_int(stmt, 4, pr->sets);
-    sqlite3_bind_int(stmt, 5, pr->reps);
-    sqlite3_bind_double(stmt, 6, pr->kgs);
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-        // Couldn't run this statement.
+    if (join->account.len > 0)
+        auth_learn(&network->auth, join->name.nick.s, join->account.s);
+    return true;
+}
+
+// Where to send the reply to a command, once the database thread is done with it.
+struct reply_to {
+    struct ircconn *conn;
+    char chan[DB_NAME_MAX];
+    char nick[DB_NAME_MAX];
+};
+
+static bool
+reply_to_init(struct reply_to *to, struct ircconn *conn, struct ircmsg_privmsg *msg)
+{
+    to->conn = conn;
+    if (msg->chan.len >= (int) sizeof to->chan || msg->name.nick.len >= (int) sizeof to->nick)
         return false;
+
+    memcpy(to->chan, msg->chan.s, msg->chan.len + 1);
+    memcpy(to->nick, msg->name.nick.s, msg->name.nick.len + 1);
+    return true;
+}
+
+// Hands the job to the database thread, or apologizes if it is backed up.
+// Takes ownership of |job|.
+static void
+submit_job(struct db_job *job, struct reply_to *to)
+{
+    if (db_submit(job))
+        return;
+
+    irc_privmsg(to->conn, to->chan, "%s: I'm swamped, try again in a bit", to->nick);
+    free(job);
+}
+
+struct record_job {
+    struct db_job job; // Must be first.
+    struct reply_to to;
+    struct prbot_pr pr;
+    char nick[DB_NAME_MAX];
+    char lift[DB_NAME_MAX];
+    bool ok;
+};
+
+static void history_forget(const struct prbot_pr *pr);
+
+static void
+record_committed(struct prbot_pr *pr, bool ok, void *data)
+{
+    struct record_job *rj = data;
+    if (ok)
+        history_forget(pr);
+    rj->ok = ok;
+    db_complete(&rj->job);
+}
+
+// Database thread: the job completes once the PR has been group-committed.
+static void
+record_run(struct db_job *job)
+{
+    struct record_job *rj = (struct record_job *) job;
+    if (!db_queue_pr(&rj->pr, record_committed, rj)) {
+        rj->ok = false;
+        db_complete(job);
     }
-    if (sqlite3_finalize(stmt)) {
-        // Couldn't finalize statement.
-        return false;
+}
+
+static void
+record_done(struct db_job *job)
+{
+    struct record_job *rj = (struct record_job *) job;
+    struct reply_to *to = &rj->to;
+    struct prbot_pr *pr = &rj->pr;
+
+    if (rj->ok) {
+        irc_privmsg(to->conn, to->chan, "%s: recorded your PR for %s of %.2fkg %dx%d",
+                    to->nick, pr->lift, pr->kgs, pr->sets, pr->reps);
+    } else {
+        irc_privmsg(to->conn, to->chan, "%s: couldn't record your PR, try again later :(",
+                    to->nick);
     }
-    return true;
+    free(rj);
 }
 
-static const char NEW_PR_PATTERN[] = "^(.+) of ([0-9]+)(\\.[0-9]+)?(kg|lb) ([0-9]+)x([0-9]+)";
-static regex_t new_pr_regex;
+// PRs are only recorded for nicks logged in to services as themselves.
+static void
+record_authorized(struct ircconn *conn, const char *nick, const char *account, void *data)
+{
+    (void) nick;
+    struct record_job *rj = data;
+    if (!conn) {
+        free(rj);
+        return;
+    }
+
+    if (!account || !irc_name_equal(account, rj->nick)) {
+        irc_privmsg(conn, rj->to.chan, "%s: haha, no. Identify to services as %s first.",
+                    rj->to.nick, rj->to.nick);
+        free(rj);
+        return;
+    }
+    submit_job(&rj->job, &rj->to);
+}
 
 static bool
-tryparse_pr(char *msg, struct prbot_pr *pr)
-{
-#define NUM_MATCHES 7
-    // There are 7 match groups:
-    //
-    // 0. full string
-    // 1. lift
-    // 2. weight (whole part)
-    // 3. weight (decimal part)
-    // 4. unit
-    // 5. sets
-    // 6. reps
-    regmatch_t matches[NUM_MATCHES];
-
-    if (regexec(&new_pr_regex, msg, NUM_MATCHES, matches, 0)) {
-        return false;
+handle_cmd_record(struct ircconn *conn, struct ircmsg_privmsg *msg, char *head)
+{
+    struct prbot_pr pr;
+
+    if (!tryparse_pr(head, &pr)) {
+        irc_privmsg(conn, msg->chan.s, "%s: check your syntax, expected: "
+                                   "<lift> of <weight><unit> <sets>x<reps> "
+                                   "or <lift> <sets>x<reps> @ <weight><unit>",
+                    msg->name.nick.s);
+        return true;
     }
 
-    // The regexp will match the full unit, so we can just predicate on the
-    // first character (l for lb, k for kg).
-    bool needs_conv_from_lb = msg[matches[4].rm_so] == 'l';
+    const struct lift *lift = lifts_find(pr.lift, strlen(pr.lift));
+    if (!lift) {
+        irc_privmsg(conn, msg->chan.s, "%s: sorry, I don't think \"%s\" is a real lift",
+                    msg->name.nick.s, pr.lift);
+        return true;
+    }
 
-    // Null-terminate some parts of the string so they can be parsed.
-    for (size_t i = 0; i < NUM_MATCHES; ++i) {
-        if (i == 2) {
-            // But don't null-terminate the whole weight.
-            continue;
-        }
-        msg[matches[i].rm_eo] = '\0';
+    struct record_job *rj = calloc(1, sizeof *rj);
+    if (!rj || !reply_to_init(&rj->to, conn, msg) ||
+        msg->name.nick.len >= (int) sizeof rj->nick)
+    {
+        free(rj);
+        irc_privmsg(conn, msg->chan.s, "%s: couldn't record your PR, try again later :(",
+                    msg->name.nick.s);
+        return true;
     }
-#undef NUM_MATCHES
 
-    pr->lift = msg + matches[1].rm_so;
-    for (char *c = pr->lift; *c != '\0'; ++c) {
+    // Normalize nicknames to lowercase, so we don't get duplicates of nicknames.
+    memcpy(rj->nick, msg->name.nick.s, msg->name.nick.len + 1);
+    for (char *c = rj->nick; *c != '\0'; ++c) {
         *c = tolower(*c);
     }
-    pr->kgs = atof(msg + matches[2].rm_so);
-    if (needs_conv_from_lb) {
-        pr->kgs = lb2kg(pr->kgs);
+
+    // Aliases are recorded under the lift's own name, which the registry
+    // keeps shorter than DB_NAME_MAX.
+    strcpy(rj->lift, lift->name);
+
+    rj->pr = pr;
+    rj->pr.nick = rj->nick;
+    rj->pr.lift = rj->lift;
+    rj->pr.date = time(NULL);
+    rj->job.run = record_run;
+    rj->job.done = record_done;
+
+    struct network *network = conn->data;
+    if (!auth_check(&network->auth, conn, msg, record_authorized, rj)) {
+        irc_privmsg(conn, msg->chan.s, "%s: I'm swamped, try again in a bit", msg->name.nick.s);
+        free(rj);
     }
-    pr->sets = atoi(msg + matches[5].rm_so);
-    pr->reps = atoi(msg + matches[6].rm_so);
     return true;
 }
 
+// Reply lines built on the database thread, to be sent from the job's done().
+struct held_reply {
+    char *lines; // Null-terminated, one after the other.
+    int len;
+    int nlines;
+};
+
+// Database thread: an ircreply emit() that holds on to each finished line.
 static bool
-handle_ping(int fd, struct ircmsg_ping *ping)
+held_reply_emit(struct ircreply *reply, const char *line, int len)
+{
+    struct held_reply *held = reply->data;
+    char *lines = realloc(held->lines, held->len + len + 1);
+    if (!lines)
+        return false;
+
+    memcpy(lines + held->len, line, len + 1);
+    held->lines = lines;
+    held->len += len + 1;
+    held->nlines++;
+    return true;
+}
+
+static void
+held_reply_init(struct held_reply *held, struct ircreply *reply, struct reply_to *to,
+                const char *head)
+{
+    irc_reply_init(reply, NULL, to->chan, head);
+    reply->emit = held_reply_emit;
+    reply->data = held;
+}
+
+// Network thread: sends the lines, and frees them.
+static void
+held_reply_send(struct held_reply *held, struct reply_to *to)
 {
-    irc_pong(fd, ping->text);
+    const char *line = held->lines;
+    for (int i = 0; i < held->nlines; ++i) {
+        irc_privmsg(to->conn, to->chan, "%s", line);
+        line += strlen(line) + 1;
+    }
+    free(held->lines);
+    held->lines = NULL;
+}
+
+struct records_job {
+    struct db_job job; // Must be first.
+    struct reply_to to;
+    char nick[DB_NAME_MAX];
+    char head[DB_NAME_MAX + 16];
+    struct held_reply reply;
+    bool ok;
+};
+
+static bool
+records_row(const struct prbot_pr *pr, void *data)
+{
+    return irc_reply_add(data, "| %s of %.2fkg %dx%d ", pr->lift, pr->kgs, pr->sets, pr->reps);
+}
+
+// Database thread: packs the nick's PRs into as few lines as possible, row
+// by row, as they come out of the database or the cache.
+static void
+records_run(struct db_job *job)
+{
+    struct records_job *rj = (struct records_job *) job;
+
+    struct ircreply reply;
+    held_reply_init(&rj->reply, &reply, &rj->to, rj->head);
+
+    bool ok = db_top_prs(rj->nick, records_row, &reply);
+    if (ok && reply.nentries == 0)
+        ok = irc_reply_add(&reply, "| none");
+    rj->ok = ok && irc_reply_finish(&reply);
+    db_complete(job);
+}
+
+static void
+records_done(struct db_job *job)
+{
+    struct records_job *rj = (struct records_job *) job;
+    struct reply_to *to = &rj->to;
+
+    if (rj->ok)
+        held_reply_send(&rj->reply, to);
+    else
+        irc_privmsg(to->conn, to->chan, "%s: sorry, couldn't get PRs (iterate)", to->nick);
+    free(rj->reply.lines);
+    free(rj);
+}
+
+static bool
+handle_cmd_records(struct ircconn *conn, struct ircmsg_privmsg *msg, char *head) {
+    // Normalize the nickname to lowercase, because that keeps the database
+    // consistent (as is done in other places). Anything after it is ignored.
+    for (char *c = head; *c != '\0'; ++c) {
+        *c = tolower(*c);
+        if (is_space(*c)) {
+            *c = '\0';
+            break;
+        }
+    }
+
+    struct records_job *rj = calloc(1, sizeof *rj);
+    if (!rj || !reply_to_init(&rj->to, conn, msg) || strlen(head) >= sizeof rj->nick) {
+        free(rj);
+        irc_privmsg(conn, msg->chan.s, "%s: sorry, couldn't get PRs", msg->name.nick.s);
+        return true;
+    }
+
+    strcpy(rj->nick, head);
+    snprintf(rj->head, sizeof rj->head, "PRs for %s ", rj->nick);
+    rj->job.run = records_run;
+    rj->job.done = records_done;
+
+    submit_job(&rj->job, &rj->to);
     return true;
 }
 
+// Leaderboard sizes.
+#define TOP_DEFAULT 5
+#define TOP_MAX 20
+
+struct top_job {
+    struct db_job job; // Must be first.
+    struct reply_to to;
+    int lift_id;
+    int n;
+    bool in_lbs;
+    bool by_e1rm;
+    char head[DB_NAME_MAX * 2 + 32];
+    struct held_reply reply;
+    bool ok;
+
+    // For "here": who was in the channel, sorted by cmp_nicks(). Only they
+    // are ranked. The names are stored after the pointers, at the end of
+    // the job itself, so freeing the job frees them too.
+    bool only_here;
+    int nhere;
+    const char *here[];
+};
+
+// Orders nicks as IRC compares them, for searching |here|.
+static int
+cmp_nicks(const void *a, const void *b)
+{
+    const char *x = *(const char **) a;
+    const char *y = *(const char **) b;
+    while (*x && irc_fold(*x) == irc_fold(*y)) {
+        x++;
+        y++;
+    }
+    return (unsigned char) irc_fold(*x) - (unsigned char) irc_fold(*y);
+}
+
+// Database thread: reads the top N straight off the leaderboard index. For
+// "here", lifters who are not in the channel are skipped on the way down.
+static void
+top_run(struct db_job *job)
+{
+    struct top_job *tj = (struct top_job *) job;
+
+    // Queued PRs should count, too.
+    db_flush();
+
+    struct ircreply reply;
+    held_reply_init(&tj->reply, &reply, &tj->to, tj->head);
+
+    sqlite3_stmt *stmt = db_stmt(tj->by_e1rm ? DB_TOP_BY_E1RM : DB_TOP_BY_KGS);
+    sqlite3_bind_int(stmt, 1, tj->lift_id);
+    sqlite3_bind_int(stmt, 2, tj->only_here ? -1 : tj->n); // A negative LIMIT is none.
+
+    bool ok = true;
+    int retval = SQLITE_DONE;
+    int rank = 0;
+    while (ok && rank < tj->n && (retval = sqlite3_step(stmt)) == SQLITE_ROW) {
+        // 0. nick, 1. date, 2. sets, 3. reps, 4. kgs, 5. e1rm
+        const char *nick = (const char *) sqlite3_column_text(stmt, 0);
+        if (tj->only_here && !bsearch(&nick, tj->here, tj->nhere, sizeof *tj->here, cmp_nicks))
+            continue;
+        int sets = sqlite3_column_int(stmt, 2);
+        int reps = sqlite3_column_int(stmt, 3);
+        double kgs = sqlite3_column_double(stmt, 4);
+        double e1rm = sqlite3_column_double(stmt, 5);
+        const char *unit = tj->in_lbs ? "lb" : "kg";
+        if (tj->in_lbs) {
+            kgs = kg2lb(kgs);
+            e1rm = kg2lb(e1rm);
+        }
+
+        if (tj->by_e1rm) {
+            ok = irc_reply_add(&reply, "| %d. %s %.1f%s (%.1f%s %dx%d) ", ++rank, nick,
+                               e1rm, unit, kgs, unit, sets, reps);
+        } else {
+            ok = irc_reply_add(&reply, "| %d. %s %.1f%s %dx%d ", ++rank, nick,
+                               kgs, unit, sets, reps);
+        }
+    }
+    if (ok && retval != SQLITE_DONE && retval != SQLITE_ROW)
+        ok = false;
+    db_stmt_done(stmt);
+
+    if (ok && reply.nentries == 0)
+        ok = irc_reply_add(&reply, "| nobody yet");
+    tj->ok = ok && irc_reply_finish(&reply);
+    db_complete(job);
+}
+
+static void
+top_done(struct db_job *job)
+{
+    struct top_job *tj = (struct top_job *) job;
+    if (tj->ok)
+        held_reply_send(&tj->reply, &tj->to);
+    else
+        irc_privmsg(tj->to.conn, tj->to.chan, "%s: sorry, couldn't get the leaderboard",
+                    tj->to.nick);
+    free(tj->reply.lines);
+    free(tj);
+}
+
+// Cuts the last word off |s|, returning it, or NULL if there is only one.
+static char *
+pop_last_word(char *s)
+{
+    char *end = s + strlen(s);
+    while (end > s && is_space(end[-1]))
+        *--end = '\0';
+
+    char *word = end;
+    while (word > s && !is_space(word[-1]))
+        word--;
+    if (word == s)
+        return NULL;
+
+    word[-1] = '\0';
+    return word;
+}
+
+// Sizes up a channel's nicks, for top_job_new().
 static bool
-handle_part(int fd, struct ircmsg_part *part)
+top_size_here(const char *nick, void *data)
 {
+    size_t *size = data;
+    *size += sizeof (const char *) + strlen(nick) + 1;
     return true;
 }
 
+struct top_here {
+    struct top_job *tj;
+    char *next; // Where the next name goes.
+};
+
 static bool
-handle_join(int fd, struct ircmsg_join *join)
+top_add_here(const char *nick, void *data)
 {
+    struct top_here *th = data;
+    strcpy(th->next, nick);
+    th->tj->here[th->tj->nhere++] = th->next;
+    th->next += strlen(nick) + 1;
     return true;
 }
 
+// Makes a job for the leaderboard of |chan|'s members, or of everyone if
+// |chan| is NULL. Returns NULL if out of memory.
+static struct top_job *
+top_job_new(struct members *members, const char *chan)
+{
+    if (!chan)
+        return calloc(1, sizeof (struct top_job));
+
+    size_t size = 0;
+    members_each(members, chan, top_size_here, &size);
+    struct top_job *tj = calloc(1, sizeof *tj + size);
+    if (!tj)
+        return NULL;
+
+    int count = members_count(members, chan);
+    struct top_here th = { tj, (char *) (tj->here + count) };
+    tj->only_here = true;
+    members_each(members, chan, top_add_here, &th);
+    assert(tj->nhere == count);
+    qsort(tj->here, tj->nhere, sizeof *tj->here, cmp_nicks);
+    return tj;
+}
+
+// top <lift> [N] [kg|lb] [e1rm] [here], with the options in any order.
 static bool
-handle_cmd_record(int fd, struct ircmsg_privmsg *msg, char *head)
+handle_cmd_top(struct ircconn *conn, struct ircmsg_privmsg *msg, char *args)
 {
-    struct prbot_pr pr;
+    struct network *network = conn->data;
+    int n = TOP_DEFAULT;
+    bool in_lbs = false;
+    bool by_e1rm = false;
+    bool here = false;
 
-    if (!tryparse_pr(head, &pr)) {
-        irc_privmsg(fd, msg->chan, "%s: check your syntax, expected: "
-                                   "<lift> of <weight><unit> <sets>x<reps>",
-                    msg->name.nick);
-        return true;
-    }
+    for (;;) {
+        char *word = pop_last_word(args);
+        if (!word)
+            break;
 
-    bool lift_ok = false;
-    for (size_t i = 0; i < sizeof LIFTS / sizeof LIFTS[0]; ++i) {
-        if (strcmp(LIFTS[i], pr.lift) == 0) {
-            lift_ok = true;
+        char *p = word;
+        if (skip_word(&p, "e1rm") || skip_word(&p, "1rm")) {
+            by_e1rm = true;
+        } else if (skip_word(&p, "kg") || skip_word(&p, "kgs")) {
+            in_lbs = false;
+        } else if (skip_word(&p, "lb") || skip_word(&p, "lbs")) {
+            in_lbs = true;
+        } else if (skip_word(&p, "here")) {
+            here = true;
+        } else if (parse_count(&p, &n) && *p == '\0') {
+            if (n > TOP_MAX)
+                n = TOP_MAX;
+        } else {
+            // Part of the lift's name; put it back.
+            word[-1] = ' ';
             break;
         }
     }
 
-    if (!lift_ok) {
-        irc_privmsg(fd, msg->chan, "%s: sorry, I don't think \"%s\" is a real lift",
-                    msg->name.nick, pr.lift);
+    const struct lift *lift = lifts_find(args, strlen(args));
+    if (!lift) {
+        irc_privmsg(conn, msg->chan.s, "%s: sorry, I don't think \"%s\" is a real lift",
+                    msg->name.nick.s, args);
         return true;
     }
 
-    // Normalize nicknames to lowercase, so we don't get duplicates of nicknames.
-    char nick_lower[BUF_LEN];
-    strcpy(nick_lower, msg->name.nick);
-
-    for (char *c = nick_lower; *c != '\0'; ++c) {
-        *c = tolower(*c);
+    // Until the NAMES list is in, there is nobody to rank.
+    if (here && members_count(&network->members, msg->chan.s) < 0) {
+        irc_privmsg(conn, msg->chan.s, "%s: sorry, I don't know who's here yet",
+                    msg->name.nick.s);
+        return true;
     }
 
-    // TODO: remove me later and use a proper verification thing
-    if (strcmp(nick_lower, "number1stunna")) {
-        irc_privmsg(fd, msg->chan, "%s: haha, no.",
-                    msg->name.nick);
+    struct top_job *tj = top_job_new(&network->members, here ? msg->chan.s : NULL);
+    if (!tj || !reply_to_init(&tj->to, conn, msg)) {
+        free(tj);
+        irc_privmsg(conn, msg->chan.s, "%s: sorry, couldn't get the leaderboard",
+                    msg->name.nick.s);
         return true;
     }
 
-    pr.nick = nick_lower;
-    pr.date = time(NULL);
+    tj->lift_id = lift->id;
+    tj->n = n;
+    tj->in_lbs = in_lbs;
+    tj->by_e1rm = by_e1rm;
+    snprintf(tj->head, sizeof tj->head, "Top %s by %s%s%s ", lift->name,
+             by_e1rm ? "e1RM" : "weight", here ? " in " : "", here ? tj->to.chan : "");
+    tj->job.run = top_run;
+    tj->job.done = top_done;
 
-    if (!insert_pr(&pr)) {
-        irc_privmsg(fd, msg->chan, "%s: couldn't record your PR, try again later :(",
-                    msg->name.nick);
-        return true;
-    }
+    submit_job(&tj->job, &tj->to);
+    return true;
+}
+
+// Entries per page of history.
+#define HISTORY_PAGE_LEN 10
+
+struct history_job {
+    struct db_job job; // Must be first.
+    struct reply_to to;
+    char nick[DB_NAME_MAX];
+    const struct lift *lift;
+    int page;
+    struct held_reply reply;
+    const char *error; // Set instead of |reply| when there is nothing to show.
+    bool ok;
+};
 
-    irc_privmsg(fd, msg->chan, "%s: recorded your PR for %s of %.2fkg %dx%d",
-                msg->name.nick, pr.lift, pr.kgs, pr.sets, pr.reps);
+// Database thread only: where recently served pages ended. Asking for the
+// next page then continues from that key, rather than seeking to it.
+#define HISTORY_CURSORS 64
+static struct {
+    sqlite3_int64 nick_id;
+    int lift_id;
+    int page;
+    sqlite3_int64 date;
+    sqlite3_int64 id;
+} history_cursors[HISTORY_CURSORS];
 
+static unsigned
+history_cursor_slot(sqlite3_int64 nick_id, int lift_id, int page)
+{
+    return ((unsigned) nick_id * 31u + lift_id) * 31u + page;
+}
+
+static bool
+history_recall(sqlite3_int64 nick_id, int lift_id, int page, sqlite3_int64 *date,
+               sqlite3_int64 *id)
+{
+    unsigned slot = history_cursor_slot(nick_id, lift_id, page) % HISTORY_CURSORS;
+    if (history_cursors[slot].page != page || history_cursors[slot].nick_id != nick_id ||
+        history_cursors[slot].lift_id != lift_id)
+    {
+        return false;
+    }
+    *date = history_cursors[slot].date;
+    *id = history_cursors[slot].id;
     return true;
 }
 
+static void
+history_remember(sqlite3_int64 nick_id, int lift_id, int page, sqlite3_int64 date,
+                 sqlite3_int64 id)
+{
+    unsigned slot = history_cursor_slot(nick_id, lift_id, page) % HISTORY_CURSORS;
+    history_cursors[slot].nick_id = nick_id;
+    history_cursors[slot].lift_id = lift_id;
+    history_cursors[slot].page = page;
+    history_cursors[slot].date = date;
+    history_cursors[slot].id = id;
+}
+
+// Database thread: a new PR moves every page of the nick's history for that
+// lift along by one, so none of their cursors can be trusted any more.
+static void
+history_forget(const struct prbot_pr *pr)
+{
+    const struct lift *lift = lifts_find(pr->lift, strlen(pr->lift));
+    if (!lift)
+        return;
+
+    sqlite3_stmt *stmt = db_stmt(DB_NICK_ID);
+    sqlite3_bind_text(stmt, 1, pr->nick, -1, SQLITE_STATIC);
+    sqlite3_int64 nick_id = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+    db_stmt_done(stmt);
+
+    // Page 0 is never recalled, so it marks a slot as empty.
+    for (int i = 0; i < HISTORY_CURSORS; ++i) {
+        if (history_cursors[i].nick_id == nick_id && history_cursors[i].lift_id == lift->id)
+            history_cursors[i].page = 0;
+    }
+}
+
+// Finds the (date, id) key that ended page |page|. Starts from the latest
+// cursor at or before it, and seeks forward a page at a time from there, so
+// each step costs one page of the index however deep the page is. Returns
+// false if the history ends before |page| does.
 static bool
-handle_cmd_records(int fd, struct ircmsg_privmsg *msg, char *head) {
-    // Normalize the nickname to lowercase, because that keeps the database
-    // consistent (as is done in other places).
-    for (char *c = head; *c != '\0'; ++c) {
-        *c = tolower(*c);
-        // Also turn the trailing CR/LF to NUL so we can use the nickname as a
-        // null-terminated string.
-        if (*c == '\r' || *c == '\n') {
-            *c = '\0';
-            break;
+history_page_end(sqlite3_int64 nick_id, int lift_id, int page,
+                 sqlite3_int64 *date, sqlite3_int64 *id)
+{
+    int known = page;
+    while (known > 0 && !history_recall(nick_id, lift_id, known, date, id))
+        known--;
+    if (known == 0)
+        *date = *id = INT64_MAX;
+
+    for (; known < page; ++known) {
+        sqlite3_stmt *stmt = db_stmt(DB_HISTORY_SEEK);
+        sqlite3_bind_int64(stmt, 1, nick_id);
+        sqlite3_bind_int(stmt, 2, lift_id);
+        sqlite3_bind_int64(stmt, 3, *date);
+        sqlite3_bind_int64(stmt, 4, *id);
+        sqlite3_bind_int(stmt, 5, HISTORY_PAGE_LEN - 1);
+        bool found = sqlite3_step(stmt) == SQLITE_ROW;
+        if (found) {
+            *date = sqlite3_column_int64(stmt, 0);
+            *id = sqlite3_column_int64(stmt, 1);
         }
+        db_stmt_done(stmt);
+        if (!found)
+            return false;
+        history_remember(nick_id, lift_id, known + 1, *date, *id);
     }
+    return true;
+}
 
-    sqlite3_stmt *stmt;
-    char out[BUF_LEN] = "\0";
-    char *cur = out;
+// Database thread: reads a single page, never the whole history.
+static void
+history_run(struct db_job *job)
+{
+    struct history_job *hj = (struct history_job *) job;
+    int lift_id = hj->lift->id;
 
-    if (sqlite3_prepare(db, TOP_PRS, -1, &stmt, NULL) != SQLITE_OK) {
-        // Something broke. :(
-        irc_privmsg(fd, msg->chan, "%s: sorry, couldn't get PRs (prepare)");
-        return true;
+    // Queued PRs are part of the history, too.
+    db_flush();
+
+    sqlite3_stmt *stmt = db_stmt(DB_NICK_ID);
+    sqlite3_bind_text(stmt, 1, hj->nick, -1, SQLITE_STATIC);
+    sqlite3_int64 nick_id = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+    db_stmt_done(stmt);
+
+    double best = 0;
+    bool any = false;
+    if (nick_id >= 0) {
+        stmt = db_stmt(DB_BEST_E1RM);
+        sqlite3_bind_int64(stmt, 1, nick_id);
+        sqlite3_bind_int(stmt, 2, lift_id);
+        if ((any = sqlite3_step(stmt) == SQLITE_ROW))
+            best = sqlite3_column_double(stmt, 0);
+        db_stmt_done(stmt);
     }
 
-    sqlite3_bind_text(stmt, 1, head, -1, NULL);
+    if (!any) {
+        hj->error = "no history for that";
+        hj->ok = true;
+        db_complete(job);
+        return;
+    }
 
+    // There is no page count, so a page past the end shows up as the one
+    // before it running out, or as an empty page.
+    sqlite3_int64 date, id;
+    if (!history_page_end(nick_id, lift_id, hj->page - 1, &date, &id)) {
+        hj->error = "there aren't that many pages";
+        hj->ok = true;
+        db_complete(job);
+        return;
+    }
+
+    char head[DB_NAME_MAX * 2 + 64];
+    snprintf(head, sizeof head, "%s history for %s, page %d, best e1RM %.1fkg ",
+             hj->lift->name, hj->nick, hj->page, best);
+    struct ircreply reply;
+    held_reply_init(&hj->reply, &reply, &hj->to, head);
+
+    stmt = db_stmt(DB_HISTORY_PAGE);
+    sqlite3_bind_int64(stmt, 1, nick_id);
+    sqlite3_bind_int(stmt, 2, lift_id);
+    sqlite3_bind_int64(stmt, 3, date);
+    sqlite3_bind_int64(stmt, 4, id);
+    sqlite3_bind_int(stmt, 5, HISTORY_PAGE_LEN);
+
+    bool ok = true;
     int retval;
-    do {
-        switch ((retval = sqlite3_step(stmt))) {
-            case SQLITE_DONE:
-                break;
-
-            case SQLITE_ROW: {
-                // There are 6 columns:
-                //
-                // 0. nick
-                // 1. lift
-                // 2. date
-                // 3. sets
-                // 4. reps
-                // 5. kgs
-                const char *nick = (const char *) sqlite3_column_text(stmt, 0);
-                const char *lift = (const char *) sqlite3_column_text(stmt, 1);
-                long date = (long) sqlite3_column_int64(stmt, 2);
-                int sets = sqlite3_column_int(stmt, 3);
-                int reps = sqlite3_column_int(stmt, 4);
-                double kgs = sqlite3_column_double(stmt, 5);
-
-                int n = snprintf(cur, BUF_LEN - (int) (cur - out), "| %s of %.2fkg %dx%d ", lift, kgs, sets, reps);
-                if (n < 0) {
-                    // TODO: split output over multiple lines, rather than just silencing it
-                    goto finalize;
-                }
-                cur += n;
-
-                break;
-           }
-
-            default:
-                // Some error occured during PR retrieval.
-                irc_privmsg(fd, msg->chan, "%s: sorry, couldn't get PRs (iterate)");
-                return true;
+    while (ok && (retval = sqlite3_step(stmt)) == SQLITE_ROW) {
+        // 0. id, 1. date, 2. sets, 3. reps, 4. kgs, 5. e1rm
+        id = sqlite3_column_int64(stmt, 0);
+        date = sqlite3_column_int64(stmt, 1);
+
+        char day[16];
+        time_t when = date;
+        struct tm tm;
+        strftime(day, sizeof day, "%Y-%m-%d", gmtime_r(&when, &tm));
+
+        ok = irc_reply_add(&reply, "| %s %.1fkg %dx%d (e1RM %.1f) ", day,
+                           sqlite3_column_double(stmt, 4), sqlite3_column_int(stmt, 2),
+                           sqlite3_column_int(stmt, 3), sqlite3_column_double(stmt, 5));
+    }
+    if (ok && retval != SQLITE_DONE)
+        ok = false;
+    db_stmt_done(stmt);
+
+    if (ok && reply.nentries == 0) {
+        hj->error = "there aren't that many pages";
+        hj->ok = true;
+        db_complete(job);
+        return;
+    }
+    if (ok)
+        history_remember(nick_id, lift_id, hj->page, date, id);
+    hj->ok = ok && irc_reply_finish(&reply);
+    db_complete(job);
+}
+
+static void
+history_done(struct db_job *job)
+{
+    struct history_job *hj = (struct history_job *) job;
+    struct reply_to *to = &hj->to;
+
+    if (!hj->ok)
+        irc_privmsg(to->conn, to->chan, "%s: sorry, couldn't get the history", to->nick);
+    else if (hj->error)
+        irc_privmsg(to->conn, to->chan, "%s: %s", to->nick, hj->error);
+    else
+        held_reply_send(&hj->reply, to);
+    free(hj->reply.lines);
+    free(hj);
+}
+
+// history <nick> <lift> [page N]
+static bool
+handle_cmd_history(struct ircconn *conn, struct ircmsg_privmsg *msg, char *args)
+{
+    int page = 1;
+    char *last = pop_last_word(args);
+    char *before = last ? pop_last_word(args) : NULL;
+    char *p = last;
+    char *q = before;
+    if (before && skip_word(&q, "page") && parse_count(&p, &page) && *p == '\0') {
+        // Consumed.
+    } else {
+        page = 1;
+        if (before)
+            before[-1] = ' ';
+        if (last)
+            last[-1] = ' ';
+    }
+
+    char *lift_name = args;
+    while (*lift_name && !is_space(*lift_name))
+        lift_name++;
+    if (*lift_name)
+        *lift_name++ = '\0';
+    while (is_space(*lift_name))
+        lift_name++;
+
+    const struct lift *lift = lifts_find(lift_name, strlen(lift_name));
+    if (!lift) {
+        irc_privmsg(conn, msg->chan.s, "%s: sorry, I don't think \"%s\" is a real lift",
+                    msg->name.nick.s, lift_name);
+        return true;
+    }
+
+    struct history_job *hj = calloc(1, sizeof *hj);
+    if (!hj || !reply_to_init(&hj->to, conn, msg) || strlen(args) >= sizeof hj->nick) {
+        free(hj);
+        irc_privmsg(conn, msg->chan.s, "%s: sorry, couldn't get the history", msg->name.nick.s);
+        return true;
+    }
+
+    // Nicks are stored in lowercase.
+    for (int i = 0; args[i]; ++i)
+        hj->nick[i] = to_lower(args[i]);
+    hj->lift = lift;
+    hj->page = page;
+    hj->job.run = history_run;
+    hj->job.done = history_done;
+
+    submit_job(&hj->job, &hj->to);
+    return true;
+}
+
+static bool handle_cmd_help(struct ircconn *conn, struct ircmsg_privmsg *msg, char *args);
+
+// Roughly what a command costs to serve, from a canned reply to a database
+// write, in units of the rate limits.
+enum cost_class {
+    COST_CHEAP = 1,
+    COST_QUERY = 2,
+    COST_WRITE = 3
+};
+
+struct command {
+    const char *name;
+    const char *aliases[4]; // NULL-terminated.
+    const char *args;       // Argument syntax, for help.
+    int minargs;            // Words the arguments must have at least.
+    enum cost_class cost;
+    bool (*handler)(struct ircconn *conn, struct ircmsg_privmsg *msg, char *args);
+    const char *help;
+};
+
+static const struct command COMMANDS[] = {
+    { "record", { "rec", "pr" }, "<lift> of <weight><unit> <sets>x<reps>", 2, COST_WRITE,
+      handle_cmd_record, "records a PR; also <lift> <sets>x<reps> @ <weight><unit>" },
+    { "records", { "prs" }, "<nick>", 1, COST_QUERY,
+      handle_cmd_records, "lists the heaviest PR for each of <nick>'s lifts" },
+    { "top", { "leaderboard" }, "<lift> [N] [kg|lb] [e1rm] [here]", 1, COST_QUERY,
+      handle_cmd_top, "ranks the best lifters of <lift>, by weight or by estimated 1RM; "
+                      "\"here\" ranks only who is in the channel" },
+    { "history", { "progress" }, "<nick> <lift> [page N]", 2, COST_QUERY,
+      handle_cmd_history, "shows <nick>'s <lift> PRs over time, newest first, with e1RM" },
+    { "help", { "commands" }, "[command]", 0, COST_CHEAP,
+      handle_cmd_help, "lists commands, or explains one" },
+};
+
+#define NUM_COMMANDS ((int) (sizeof COMMANDS / sizeof COMMANDS[0]))
+
+// Every command name and alias, hashed into an open-addressing table.
+// Must be a power of two, and comfortably more than the number of names.
+#define COMMAND_SLOTS 64
+static const struct command *command_slots[COMMAND_SLOTS];
+static const char *command_keys[COMMAND_SLOTS];
+
+static uint32_t
+command_hash(const char *s, int len)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; ++i) {
+        h ^= (unsigned char) to_lower(s[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void
+add_command_key(const char *key, const struct command *command)
+{
+    uint32_t i = command_hash(key, strlen(key));
+    while (command_slots[i & (COMMAND_SLOTS - 1)])
+        i++;
+    command_slots[i & (COMMAND_SLOTS - 1)] = command;
+    command_keys[i & (COMMAND_SLOTS - 1)] = key;
+}
+
+static void
+commands_init(void)
+{
+    for (int i = 0; i < NUM_COMMANDS; ++i) {
+        add_command_key(COMMANDS[i].name, &COMMANDS[i]);
+        for (const char *const *alias = COMMANDS[i].aliases; *alias; ++alias)
+            add_command_key(*alias, &COMMANDS[i]);
+    }
+}
+
+// Case-insensitive lookup of a command name or alias.
+static const struct command *
+find_command(const char *name, int len)
+{
+    for (uint32_t i = command_hash(name, len); ; ++i) {
+        int slot = i & (COMMAND_SLOTS - 1);
+        if (!command_slots[slot])
+            return NULL;
+        if (strncasecmp(command_keys[slot], name, len) == 0 && command_keys[slot][len] == '\0')
+            return command_slots[slot];
+    }
+}
+
+static int
+count_words(const char *s)
+{
+    int n = 0;
+    while (*s) {
+        while (is_space(*s))
+            s++;
+        if (!*s)
+            break;
+        n++;
+        while (*s && !is_space(*s))
+            s++;
+    }
+    return n;
+}
+
+static bool
+handle_cmd_help(struct ircconn *conn, struct ircmsg_privmsg *msg, char *args)
+{
+    int len = 0;
+    while (args[len] && !is_space(args[len]))
+        len++;
+
+    if (len > 0) {
+        const struct command *command = find_command(args, len);
+        if (!command) {
+            irc_privmsg(conn, msg->chan.s, "%s: no such command", msg->name.nick.s);
+            return true;
         }
-    } while (retval == SQLITE_ROW);
 
-finalize:
-    if (sqlite3_finalize(stmt)) {
-        // Couldn't finalize statement.
-        irc_privmsg(fd, msg->chan, "%s: sorry, couldn't get PRs (finalize)");
+        char aliases[128] = "";
+        for (const char *const *alias = command->aliases; *alias; ++alias) {
+            size_t used = strlen(aliases);
+            snprintf(aliases + used, sizeof aliases - used, "%s%s",
+                     used ? ", " : " (also ", *alias);
+        }
+        if (aliases[0])
+            strncat(aliases, ")", sizeof aliases - strlen(aliases) - 1);
+
+        irc_privmsg(conn, msg->chan.s, "%s: %s %s%s: %s", msg->name.nick.s,
+                    command->name, command->args, aliases, command->help);
         return true;
     }
 
-    irc_privmsg(fd, msg->chan, "PRs for %s %s",
-                head, out[0] == '\0' ? "| none" : out);
+    char head[DB_NAME_MAX + 16];
+    snprintf(head, sizeof head, "%s: commands: ", msg->name.nick.s);
+
+    struct ircreply reply;
+    irc_reply_init(&reply, conn, msg->chan.s, head);
+    for (int i = 0; i < NUM_COMMANDS; ++i)
+        irc_reply_add(&reply, "%s%s %s", i ? " | " : "", COMMANDS[i].name, COMMANDS[i].args);
+    irc_reply_finish(&reply);
     return true;
 }
 
-static inline bool
-BeginsWith(char *s1, char *s2)
+// If |text| starts by addressing |nick| ("nick: ", "nick, " or "nick "),
+// returns what follows. Otherwise, returns NULL.
+static char *
+skip_address(char *text, const char *nick)
 {
-    return (strncasecmp(s1, s2, strlen(s2)) == 0);
+    // Nicks compare as IRC compares them, with RFC 1459 casemapping.
+    char *p = text;
+    for (; *nick; ++nick, ++p) {
+        if (irc_fold(*p) != irc_fold(*nick))
+            return NULL;
+    }
+
+    if (*p == ':' || *p == ',')
+        p++;
+    else if (!is_space(*p))
+        return NULL;
+
+    while (is_space(*p))
+        p++;
+    return p;
 }
 
 static bool
-handle_privmsg(int fd, struct ircmsg_privmsg *msg)
+handle_privmsg(struct ircconn *conn, struct ircmsg_privmsg *msg)
 {
-    // Only handle messages directed at the bot.
-    if (strncmp(msg->text, IRC_NICK, strlen(IRC_NICK)) != 0)
+    struct network *network = conn->data;
+    const char *nick = network->nick;
+
+    // Private queries need no addressing, and are answered in private.
+    struct ircmsg_privmsg query;
+    const char *chan = msg->chan.s; // Or NULL for a private query.
+    char *cmd = skip_address(msg->text.s, nick);
+    if (irc_name_equal(msg->chan.s, nick)) {
+        if (!cmd)
+            cmd = msg->text.s;
+        query = *msg;
+        query.chan = msg->name.nick;
+        msg = &query;
+        chan = NULL;
+    } else if (!cmd) {
+        // Only handle messages directed at the bot.
         return true;
+    }
 
-    // Only handle messages in a channel.
-    if (msg->chan[0] != '#')
+    int len = 0;
+    while (cmd[len] && !is_space(cmd[len]))
+        len++;
+    if (len == 0)
         return true;
 
-    char *cmd = msg->text + strlen(IRC_NICK ": ");
+    const struct command *command = find_command(cmd, len);
+    char *args = cmd + len;
+    while (is_space(*args))
+        args++;
+    bool runs = command && count_words(args) >= command->minargs;
 
-    if (BeginsWith(cmd, "help"))
-        return handle_cmd_help(fd, msg, head + 4);
-    if (BeginsWith(cmd, "record "))
-        return handle_cmd_record(fd, msg, head + 7);
-    if (BeginsWith(cmd, "records "))
-        return handle_cmd_records(fd, msg, head + 8);
+    // Abuse is shed here, before any reply and before the handler does any
+    // database work. A command that won't run still costs its one line.
+    switch (ratelimit_charge(&network->limits, msg->name.user.s, msg->name.host.s, chan,
+                             runs ? command->cost : COST_CHEAP)) {
+      case RATELIMIT_OK:
+        break;
+      case RATELIMIT_WARN:
+        irc_privmsg(conn, msg->chan.s, "%s: slow down.", msg->name.nick.s);
+        return true;
+      case RATELIMIT_DROP:
+        return true;
+    }
 
-    irc_privmsg(fd, msg->chan, "%s: shut the fuck up.", msg->name.nick);
+    if (!command) {
+        irc_privmsg(conn, msg->chan.s, "%s: shut the fuck up.", msg->name.nick.s);
+        return true;
+    }
+    if (!runs) {
+        irc_privmsg(conn, msg->chan.s, "%s: usage: %s %s", msg->name.nick.s,
+                    command->name, command->args);
+        return true;
+    }
+    return command->handler(conn, msg, args);
+}
+
+static bool
+handle_kick(struct ircconn *conn, struct ircmsg_kick *kick)
+{
+    struct network *network = conn->data;
+    if (is_self(conn, kick->kickee.s))
+        members_leave_self(&network->members, kick->chan.s);
+    else
+        members_part(&network->members, kick->chan.s, kick->kickee.s);
+    return true;
+}
+
+static bool
+handle_quit(struct ircconn *conn, struct ircmsg_quit *quit)
+{
+    struct network *network = conn->data;
+    members_quit(&network->members, quit->name.nick.s);
+    auth_forget(&network->auth, quit->name.nick.s);
     return true;
 }
 
 static bool
-handle_kick(int fd, struct ircmsg_kick *kick)
+handle_nick(struct ircconn *conn, struct ircmsg_nick *nick)
 {
+    struct network *network = conn->data;
+    if (is_self(conn, nick->name.nick.s))
+        set_nick(network, nick->nick.s);
+    members_rename(&network->members, nick->name.nick.s, nick->nick.s);
+    auth_forget(&network->auth, nick->name.nick.s);
+    auth_forget(&network->auth, nick->nick.s);
     return true;
 }
 
 static bool
-dispatch_handler(int fd, struct ircmsg *msg)
+handle_account(struct ircconn *conn, struct ircmsg_account *account)
+{
+    struct network *network = conn->data;
+    auth_learn(&network->auth, account->name.nick.s, account->account.s);
+    return true;
+}
+
+static bool
+handle_numeric(struct ircconn *conn, struct ircmsg *msg)
+{
+    struct network *network = conn->data;
+    struct ircslice *params = msg->params;
+    int n = msg->nparams;
+
+    switch (msg->numeric) {
+      case 1: // RPL_WELCOME: <me> :Welcome to the network
+        // Registered: join up, and count this as a connection that worked.
+        network->failures = 0;
+        if (n >= 1)
+            set_nick(network, params[0].s);
+        for (int i = 0; i < network->config->nchannels; ++i)
+            irc_join(conn, network->config->channels[i]);
+        break;
+      case 353: // RPL_NAMREPLY: <me> [=*@] <chan> :<names>
+        if (n >= 3)
+            members_names(&network->members, params[n - 2].s, params[n - 1].s);
+        break;
+      case 366: // RPL_ENDOFNAMES: <me> <chan> :End of /NAMES list.
+        if (n >= 2)
+            members_names_end(&network->members, params[1].s);
+        break;
+      case 330: // RPL_WHOISACCOUNT: <me> <nick> <account> :is logged in as
+        if (n >= 3)
+            auth_whois_account(&network->auth, params[1].s, params[2].s);
+        break;
+      case 307: // RPL_WHOISREGNICK: <me> <nick> :has identified for this nick
+        // Not which account, though, and that needn't be the nick.
+        if (n >= 2)
+            auth_whois_regnick(&network->auth, params[1].s);
+        break;
+      case 318: // RPL_ENDOFWHOIS: <me> <nick> :End of /WHOIS list.
+      case 401: // ERR_NOSUCHNICK: <me> <nick> :No such nick/channel
+        if (n >= 2)
+            auth_whois_end(&network->auth, conn, params[1].s);
+        break;
+    }
+    return true;
+}
+
+static bool dispatch_handler(struct ircconn *conn, struct ircmsg *msg);
+
+// Grouped events are handled one by one, except for the QUITs of a netsplit,
+// which can number in the thousands: those are handed over all at once.
+static bool
+handle_batch(struct ircconn *conn, struct ircmsg_batch *batch)
+{
+    const char **quits = NULL;
+    if (batch->type.len == 8 && !memcmp(batch->type.s, "netsplit", 8))
+        quits = malloc(batch->nlines * sizeof *quits);
+    int nquits = 0;
+
+    // A handler may close the connection, which frees the batch.
+    for (int i = 0; i < batch->nlines && ircconn_isopen(conn); ++i) {
+        struct ircmsg msg;
+        irc_batch_line(batch, i, &msg);
+        if (quits && msg.type == IRCMSG_QUIT) {
+            quits[nquits++] = msg.u.quit.name.nick.s;
+            continue;
+        }
+        if (!dispatch_handler(conn, &msg)) {
+            free(quits);
+            return false;
+        }
+    }
+
+    if (nquits > 0 && ircconn_isopen(conn)) {
+        struct network *network = conn->data;
+        members_quit_many(&network->members, quits, nquits);
+        auth_forget_many(&network->auth, quits, nquits);
+    }
+    free(quits);
+    return true;
+}
+
+static bool
+dispatch_handler(struct ircconn *conn, struct ircmsg *msg)
 {
     switch (msg->type) {
       case IRCMSG_UNKNOWN:  return true;
-      case IRCMSG_PING:     return handle_ping(fd, &msg->u.ping);
-      case IRCMSG_PART:     return handle_part(fd, &msg->u.part);
-      case IRCMSG_JOIN:     return handle_join(fd, &msg->u.join);
-      case IRCMSG_PRIVMSG:  return handle_privmsg(fd, &msg->u.privmsg);
-      case IRCMSG_KICK:     return handle_kick(fd, &msg->u.kick);
+      case IRCMSG_NUMERIC:  return handle_numeric(conn, msg);
+      case IRCMSG_PING:     return handle_ping(conn, &msg->u.ping);
+      case IRCMSG_PART:     return handle_part(conn, &msg->u.part);
+      case IRCMSG_JOIN:     return handle_join(conn, &msg->u.join);
+      case IRCMSG_PRIVMSG:  return handle_privmsg(conn, &msg->u.privmsg);
+      case IRCMSG_KICK:     return handle_kick(conn, &msg->u.kick);
+      case IRCMSG_CAP:      return irc_cap_handle(conn, msg);
+      case IRCMSG_BATCH:    return handle_batch(conn, &msg->u.batch);
+      case IRCMSG_QUIT:     return handle_quit(conn, &msg->u.quit);
+      case IRCMSG_NICK:     return handle_nick(conn, &msg->u.nick);
+      case IRCMSG_ACCOUNT:  return handle_account(conn, &msg->u.account);
+      case IRCMSG_PONG:     irc_pong_handle(conn, msg); return true;
       default:              return false;
     }
 }
 
+// Exit status, set when the loop is stopped.
+static int status;
+
+static struct network *networks;
+static int nnetworks;
+
+static void schedule_reconnect(struct network *network);
+
+static void
+on_lines(struct ircconn *conn, struct ircline *lines, int nlines)
+{
+    // Stop as soon as a handler closes the connection: on_close() has
+    // already let go of everything the rest would update.
+    for (int i = 0; i < nlines && ircconn_isopen(conn); ++i) {
+        printf("%s\n", lines[i].text);
+
+        struct ircmsg msg;
+        if (irc_batch_collect(conn, &lines[i], &msg))
+            continue;
+        if (!dispatch_handler(conn, &msg)) {
+            status = 2;
+            ircloop_stop(conn->loop);
+            return;
+        }
+    }
+}
+
+static void
+on_close(struct ircconn *conn)
+{
+    struct network *network = conn->data;
+    fprintf(stderr, "Disconnected from %s.\n", network->config->host);
+    members_free(&network->members);
+    auth_free(&network->auth);
+    ratelimit_free(&network->limits);
+
+    if (conn->loop->running)
+        schedule_reconnect(network);
+}
+
+static void
+on_db_result(struct ircwatch *watch)
+{
+    (void) watch;
+    db_reap();
+}
+
+// Reads the configuration, falling back to the built-in defaults.
+// An explicitly named file must exist; the default one is optional.
+static bool
+load_config(struct config *config, const char *filename)
+{
+    if (filename || access(CONFIG_NAME, F_OK) == 0) {
+        if (!config_load(config, filename ? filename : CONFIG_NAME))
+            return false;
+    } else {
+        struct config_network *network = config_add_network(config, IRC_HOST, IRC_PORT, IRC_NICK);
+        if (!network || !config_add_channel(network, IRC_CHANNEL))
+            return false;
+    }
+
+    if (!config->database && !(config->database = strdup(DATABASE_NAME)))
+        return false;
+    if (!config->synchronous && !(config->synchronous = strdup(DATABASE_SYNCHRONOUS)))
+        return false;
+    return true;
+}
+
+static void
+on_connect(struct ircconnector *connector, int fd)
+{
+    struct network *network = connector->data;
+    struct config_network *config = network->config;
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open connection to %s.\n", config->host);
+        schedule_reconnect(network);
+        return;
+    }
+
+    set_nick(network, config->nick);
+    members_init(&network->members);
+    auth_init(&network->auth);
+    ratelimit_init(&network->limits);
+    network->conn.on_lines = on_lines;
+    network->conn.on_close = on_close;
+    network->conn.data = network;
+    if (!ircconn_init(&network->conn, network->loop, fd, network->buf, IRC_BUF_LEN)) {
+        close(fd);
+        schedule_reconnect(network);
+        return;
+    }
+    fprintf(stderr, "Connected to %s.\n", config->host);
+
+    if (config->flood_burst || config->flood_interval_ms >= 0) {
+        ircconn_set_flood(&network->conn,
+                          config->flood_burst ? config->flood_burst : IRCFLOOD_BURST,
+                          config->flood_interval_ms >= 0 ? config->flood_interval_ms
+                                                         : IRCFLOOD_INTERVAL_MS);
+    }
+    if (config->keepalive_idle_ms >= 0 || config->keepalive_timeout_ms > 0) {
+        ircconn_set_keepalive(&network->conn,
+                              config->keepalive_idle_ms >= 0 ? config->keepalive_idle_ms
+                                                             : IRCKEEPALIVE_IDLE_MS,
+                              config->keepalive_timeout_ms > 0 ? config->keepalive_timeout_ms
+                                                               : IRCKEEPALIVE_TIMEOUT_MS);
+    }
+
+    // Channels are joined once the server says welcome.
+    irc_nick(&network->conn, config->nick, NULL);
+}
+
+static void
+connect_network(struct network *network)
+{
+    struct config_network *config = network->config;
+    network->connector.on_connect = on_connect;
+    network->connector.data = network;
+    if (!ircconnector_start(&network->connector, network->loop, config->host, config->port)) {
+        fprintf(stderr, "Failed to start connecting to %s.\n", config->host);
+        schedule_reconnect(network);
+    }
+}
+
+static void
+on_reconnect(struct irctimer *timer)
+{
+    connect_network(timer->data);
+}
+
+static void
+schedule_reconnect(struct network *network)
+{
+    int shift = network->failures < 16 ? network->failures : 16;
+    long delay = (long) RECONNECT_MIN_MS << shift;
+    if (delay > RECONNECT_MAX_MS)
+        delay = RECONNECT_MAX_MS;
+    delay -= random() % (delay / 2 + 1);
+    network->failures++;
+
+    fprintf(stderr, "Reconnecting to %s in %ld ms.\n", network->config->host, delay);
+    ircloop_schedule(network->loop, &network->reconnect, delay);
+}
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [-c config]\n"
+                    "       %s [-c config] [-f csv|jsonl] import|export [file]\n",
+            argv0, argv0);
+}
+
+// Runs "import" or "export" on |file|, or on stdin or stdout if it is NULL or "-".
+static bool
+run_bulk(const char *mode, const char *file, const char *format)
+{
+    bool import = strcmp(mode, "import") == 0;
+    bool stdio = !file || strcmp(file, "-") == 0;
+    const char *name = stdio ? (import ? "stdin" : "stdout") : file;
+
+    enum bulk_format fmt = bulk_format_for(name);
+    if (format && strcmp(format, "csv") == 0) {
+        fmt = BULK_CSV;
+    } else if (format && strcmp(format, "jsonl") == 0) {
+        fmt = BULK_JSONL;
+    } else if (format) {
+        fprintf(stderr, "unknown format \"%s\"\n", format);
+        return false;
+    }
+
+    FILE *f = stdio ? (import ? stdin : stdout) : fopen(file, import ? "r" : "w");
+    if (!f) {
+        perror(file);
+        return false;
+    }
+
+    bool ok = import ? bulk_import(f, name, fmt) : bulk_export(f, fmt);
+    if (!stdio && fclose(f) != 0 && ok) {
+        perror(file);
+        ok = false;
+    }
+    return ok;
+}
+
 int
 main(int argc, char *argv[])
 {
-    // Compile some regexes.
-    if (regcomp(&new_pr_regex, NEW_PR_PATTERN, REG_EXTENDED)) {
-        fprintf(stderr, "Failed to compile regex.\n");
+    const char *config_name = NULL;
+    const char *format = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:f:")) != -1) {
+        switch (opt) {
+          case 'c': config_name = optarg; break;
+          case 'f': format = optarg; break;
+          default:  usage(argv[0]); return 1;
+        }
+    }
+
+    // Bulk modes move PRs in or out of the database, then exit.
+    const char *mode = optind < argc ? argv[optind] : NULL;
+    if (mode && ((strcmp(mode, "import") != 0 && strcmp(mode, "export") != 0) ||
+                 argc - optind > 2))
+    {
+        usage(argv[0]);
         return 1;
     }
 
-    // Initialize SQLite gunk.
-    if (sqlite3_open(DATABASE_NAME, &db)) {
-        fprintf(stderr, "Failed to open database: %s\n", sqlite3_errmsg(db));
+    struct config config = { 0 };
+    if (!load_config(&config, config_name)) {
+        fprintf(stderr, "Failed to load configuration.\n");
         return 1;
     }
 
-    if (sqlite3_exec(db, INITIALIZE_DB, 0, 0, 0)) {
-        fprintf(stderr, "Failed to initialize database: %s\n", sqlite3_errmsg(db));
+    // Initialize SQLite gunk, and read the lifts while the database is still ours.
+    if (!db_open(config.database, config.synchronous) || !db_migrate() || !db_prepare() ||
+        !lifts_load())
+    {
+        db_close();
         return 1;
     }
- 
-    // Kick off the IRC connection.
-    char buf[BUF_LEN];
-    struct ircbuf ircbuf;
-    ircbuf_init(&ircbuf, buf, BUF_LEN);
 
-    int fd = irc_connect(IRC_HOST, IRC_PORT);
-    if (fd < 0) {
-        fprintf(stderr, "Failed to open connection.\n");
+    if (mode) {
+        bool ok = run_bulk(mode, argv[optind + 1], format);
+        db_close();
+        lifts_free();
+        config_free(&config);
+        return ok ? 0 : 1;
+    }
+
+    struct ircloop loop;
+    if (!ircloop_init(&loop)) {
+        db_close();
         return 1;
     }
 
-    irc_nick(fd, IRC_NICK, NULL);
-    irc_join(fd, IRC_CHANNEL);
+    // Kick off the IRC connections.
+    nnetworks = config.nnetworks;
+    networks = calloc(nnetworks, sizeof *networks);
+    if (!networks) {
+        db_close();
+        return 1;
+    }
+    srandom(time(NULL) ^ getpid());
+    for (int i = 0; i < nnetworks; ++i) {
+        struct network *network = &networks[i];
+        network->config = &config.networks[i];
+        network->loop = &loop;
+        network->conn.watch.fd = -1;
+        irctimer_init(&network->reconnect, on_reconnect, network);
+        connect_network(network);
+    }
 
-    char *line;
-    while ((line = irc_getline(fd, &ircbuf))) {
-        printf("%s\n", line);
+    if (!db_worker_start()) {
+        db_close();
+        return 1;
+    }
 
-        struct ircmsg msg;
-        irc_parseline(line, &msg);
-        if (!dispatch_handler(fd, &msg))
-            return 2;
+    // Replies to database jobs are sent as their results arrive.
+    struct ircwatch db_watch = {
+        .fd = db_result_fd(),
+        .on_readable = on_db_result
+    };
+    if (!ircloop_add(&loop, &db_watch)) {
+        db_worker_stop();
+        db_reap();
+        db_close();
+        return 1;
     }
 
-    return 0;
+    commands_init();
+    ircloop_run(&loop);
+
+    for (int i = 0; i < nnetworks; ++i) {
+        ircloop_cancel(&loop, &networks[i].reconnect);
+        ircconnector_cancel(&networks[i].connector);
+        ircconn_close(&networks[i].conn);
+    }
+    db_worker_stop();
+    db_reap();
+
+    // How the cache did over the bot's run. Only the worker touched it.
+    struct prcache_stats stats;
+    prcache_stats(&stats);
+    fprintf(stderr, "PR cache: %lu hits, %lu misses, %lu evictions, %d nicks in %ld bytes\n",
+            stats.hits, stats.misses, stats.evictions, stats.entries, stats.bytes);
+
+    db_close();
+    lifts_free();
+    ircloop_free(&loop);
+    free(networks);
+    config_free(&config);
+    return status;
 }
@@ -0,0 +1,201 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prcache.h"
+
+// One nick's PRs. The nick and lift names are stored right after |prs|.
+struct entry {
+    struct entry *chain;      // Next in the same hash bucket.
+    struct entry *newer;      // LRU order.
+    struct entry *older;
+    long size;
+    char *nick;
+    int nprs;
+    struct prbot_pr prs[];
+};
+
+// Must be a power of two.
+#define NUM_BUCKETS 1024
+
+static struct entry *buckets[NUM_BUCKETS];
+static struct entry *newest;
+static struct entry *oldest;
+static struct prcache_stats stats;
+
+static uint32_t
+hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+    for (; *s; ++s) {
+        h ^= (unsigned char) *s;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct entry **
+find(const char *nick)
+{
+    struct entry **link = &buckets[hash(nick) & (NUM_BUCKETS - 1)];
+    while (*link && strcmp((*link)->nick, nick) != 0)
+        link = &(*link)->chain;
+    return link;
+}
+
+static void
+unlink_lru(struct entry *entry)
+{
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        newest = entry->older;
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        oldest = entry->newer;
+}
+
+static void
+push_newest(struct entry *entry)
+{
+    entry->newer = NULL;
+    entry->older = newest;
+    if (newest)
+        newest->newer = entry;
+    else
+        oldest = entry;
+    newest = entry;
+}
+
+static void
+drop(struct entry **link)
+{
+    struct entry *entry = *link;
+    *link = entry->chain;
+    unlink_lru(entry);
+    stats.bytes -= entry->size;
+    stats.entries--;
+    free(entry);
+}
+
+bool
+prcache_lookup(const char *nick, const struct prbot_pr **prs, int *nprs)
+{
+    struct entry *entry = *find(nick);
+    if (!entry) {
+        stats.misses++;
+        return false;
+    }
+
+    stats.hits++;
+    unlink_lru(entry);
+    push_newest(entry);
+    *prs = entry->prs;
+    *nprs = entry->nprs;
+    return true;
+}
+
+void
+prcache_put(const char *nick, const struct prbot_pr *prs, int nprs)
+{
+    struct entry **link = find(nick);
+    if (*link)
+        drop(link);
+
+    long size = sizeof(struct entry) + nprs * sizeof(struct prbot_pr) + strlen(nick) + 1;
+    for (int i = 0; i < nprs; ++i)
+        size += strlen(prs[i].lift) + 1;
+    if (size > PRCACHE_BUDGET)
+        return;
+
+    while (stats.bytes + size > PRCACHE_BUDGET) {
+        drop(find(oldest->nick));
+        stats.evictions++;
+    }
+
+    struct entry *entry = malloc(size);
+    if (!entry)
+        return;
+    entry->size = size;
+    entry->nprs = nprs;
+
+    // Lay out the strings after the PRs.
+    char *strings = (char *) &entry->prs[nprs];
+    entry->nick = strings;
+    strings = stpcpy(strings, nick) + 1;
+    for (int i = 0; i < nprs; ++i) {
+        entry->prs[i] = prs[i];
+        entry->prs[i].nick = entry->nick;
+        entry->prs[i].lift = strings;
+        strings = stpcpy(strings, prs[i].lift) + 1;
+    }
+
+    // |link| may have moved, if evictions touched its bucket.
+    link = find(nick);
+    entry->chain = *link;
+    *link = entry;
+    push_newest(entry);
+    stats.bytes += size;
+    stats.entries++;
+}
+
+void
+prcache_update(const struct prbot_pr *pr)
+{
+    struct entry **link = find(pr->nick);
+    struct entry *entry = *link;
+    if (!entry)
+        return;
+
+    for (int i = 0; i < entry->nprs; ++i) {
+        struct prbot_pr *cached = &entry->prs[i];
+        if (strcmp(cached->lift, pr->lift) != 0)
+            continue;
+
+        // Same rule as DB_UPDATE_BEST_PR: only a heavier PR wins.
+        if (pr->kgs > cached->kgs) {
+            cached->date = pr->date;
+            cached->sets = pr->sets;
+            cached->reps = pr->reps;
+            cached->kgs = pr->kgs;
+        }
+        return;
+    }
+
+    // A new lift changes the entry's shape; refetch it when next asked for.
+    drop(link);
+}
+
+void
+prcache_stats(struct prcache_stats *out)
+{
+    *out = stats;
+}
+
+void
+prcache_clear(void)
+{
+    while (oldest)
+        drop(find(oldest->nick));
+}
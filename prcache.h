@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// In-memory LRU cache of each nick's best PRs, as returned by DB_TOP_PRS.
+// Owned by whichever thread owns the database; there is no locking.
+
+#include <stdbool.h>
+
+#include "db.h"
+
+#ifndef prbot_prcache_h__
+#define prbot_prcache_h__
+
+// Most memory the cache may use, counting entries and their strings.
+#define PRCACHE_BUDGET (1024 * 1024)
+
+struct prcache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    long bytes;
+    int entries;
+};
+
+// On a hit, points |prs| at the nick's best PRs, sorted by lift. They stay
+// valid until the next call into the cache.
+bool prcache_lookup(const char *nick, const struct prbot_pr **prs, int *nprs);
+
+// Caches a copy of the nick's best PRs, evicting the least recently used
+// nicks to stay within PRCACHE_BUDGET.
+void prcache_put(const char *nick, const struct prbot_pr *prs, int nprs);
+
+// Write-through for a committed PR: updates the nick's entry in place, or
+// drops it if the PR is for a lift the entry does not have yet.
+void prcache_update(const struct prbot_pr *pr);
+
+void prcache_stats(struct prcache_stats *stats);
+void prcache_clear(void);
+
+#endif // prbot_prcache_h__
@@ -0,0 +1,143 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "irc.h"
+#include "ratelimit.h"
+
+struct ratelimit_entry {
+    uint64_t key;     // Hash of the user@host or channel; 0 if free.
+    long long tat_ms; // When the bucket will be full again.
+    bool warned;      // Whether a warning went out since the last OK.
+};
+
+static long long
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a of "user@host" or of a channel name, 64 bits wide so that distinct
+// keys practically never share a bucket.
+static uint64_t
+hash_key(const char *a, const char *b)
+{
+    uint64_t h = 14695981039346656037u;
+    for (const char *s = a; s && *s; ++s) {
+        h ^= (unsigned char) irc_fold(*s);
+        h *= 1099511628211u;
+    }
+    if (b) {
+        h ^= '@';
+        h *= 1099511628211u;
+    }
+    for (const char *s = b; s && *s; ++s) {
+        h ^= (unsigned char) irc_fold(*s);
+        h *= 1099511628211u;
+    }
+    return h ? h : 1;
+}
+
+// Finds the key's bucket, or gives it one that isn't |keep|.
+static struct ratelimit_entry *
+find_bucket(struct ratelimit *rl, uint64_t key, long long now, struct ratelimit_entry *keep)
+{
+    struct ratelimit_entry *victim = NULL;
+    for (int i = 0; i < RATELIMIT_PROBE; ++i) {
+        struct ratelimit_entry *e = &rl->table[(key + i) & (RATELIMIT_SLOTS - 1)];
+        if (e->key == key)
+            return e;
+        if (e != keep && (!victim || e->tat_ms < victim->tat_ms))
+            victim = e;
+    }
+
+    victim->key = key;
+    victim->tat_ms = now;
+    victim->warned = false;
+    return victim;
+}
+
+// Where the bucket's timestamp would move to, or -1 if it can't pay.
+static long long
+try_pay(struct ratelimit_entry *e, long long now, int cost, int burst, int interval_ms)
+{
+    long long tat = (e->tat_ms > now ? e->tat_ms : now) + (long long) cost * interval_ms;
+    return tat - now <= (long long) burst * interval_ms ? tat : -1;
+}
+
+void
+ratelimit_init(struct ratelimit *rl)
+{
+    rl->table = NULL;
+    rl->closed = false;
+}
+
+void
+ratelimit_free(struct ratelimit *rl)
+{
+    free(rl->table);
+    ratelimit_init(rl);
+    rl->closed = true;
+}
+
+enum ratelimit_verdict
+ratelimit_charge(struct ratelimit *rl, const char *user, const char *host, const char *chan,
+                 int cost)
+{
+    // Nobody is left to answer once the connection is gone.
+    if (rl->closed)
+        return RATELIMIT_DROP;
+
+    // Without memory for buckets, let everything through.
+    if (!rl->table && !(rl->table = calloc(RATELIMIT_SLOTS, sizeof *rl->table)))
+        return RATELIMIT_OK;
+
+    long long now = now_ms();
+    struct ratelimit_entry *u = find_bucket(rl, hash_key(user, host), now, NULL);
+    struct ratelimit_entry *c = chan ? find_bucket(rl, hash_key(chan, NULL), now, u) : NULL;
+
+    long long utat = try_pay(u, now, cost, RATELIMIT_USER_BURST, RATELIMIT_USER_INTERVAL_MS);
+    long long ctat = c ? try_pay(c, now, cost, RATELIMIT_CHAN_BURST,
+                                 RATELIMIT_CHAN_INTERVAL_MS) : 0;
+
+    if (utat >= 0 && ctat >= 0) {
+        u->tat_ms = utat;
+        u->warned = false;
+        if (c) {
+            c->tat_ms = ctat;
+            c->warned = false;
+        }
+        return RATELIMIT_OK;
+    }
+
+    // One warning per bucket, until it pays again.
+    struct ratelimit_entry *over = utat < 0 ? u : c;
+    if (over->warned)
+        return RATELIMIT_DROP;
+    over->warned = true;
+    return RATELIMIT_WARN;
+}
@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Per-user and per-channel limits on commands, so that nobody can make the
+// bot burn its flood budget and the database's time by spamming.
+//
+// Each limit is a token bucket, kept as the single timestamp of the generic
+// cell rate algorithm: the time at which the bucket will be full again.
+// Buckets live in a fixed-size open-addressing table, so memory is bounded
+// however many users there are, and every check is O(1).
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef prbot_ratelimit_h__
+#define prbot_ratelimit_h__
+
+// A key may live in any of RATELIMIT_PROBE slots from its hash. A full
+// neighborhood gives up the bucket closest to full, which loses the least.
+#define RATELIMIT_SLOTS 4096 // Must be a power of two.
+#define RATELIMIT_PROBE 8
+
+// Each user (by user@host, so changing nicks doesn't help) may spend up to
+// |burst| units at once, and gets one back every |interval_ms|. Channels,
+// shared by everyone in them, have a bigger bucket.
+#define RATELIMIT_USER_BURST 6
+#define RATELIMIT_USER_INTERVAL_MS 3000
+#define RATELIMIT_CHAN_BURST 20
+#define RATELIMIT_CHAN_INTERVAL_MS 1000
+
+struct ratelimit_entry;
+
+struct ratelimit {
+    struct ratelimit_entry *table; // RATELIMIT_SLOTS entries, allocated on first use.
+    bool closed;                   // Freed: every command is dropped until the next init.
+};
+
+enum ratelimit_verdict {
+    RATELIMIT_OK,
+    RATELIMIT_WARN, // Over the limit for the first time since the last OK.
+    RATELIMIT_DROP  // Still over it: drop the command without a word.
+};
+
+void ratelimit_init(struct ratelimit *rl);
+
+// Forgets every bucket. Until ratelimit_init() is called again, every
+// command is dropped and nothing is allocated.
+void ratelimit_free(struct ratelimit *rl);
+
+// Charges |cost| units to the user's bucket and, unless |chan| is NULL, to
+// the channel's. Nothing is charged unless both can pay.
+enum ratelimit_verdict ratelimit_charge(struct ratelimit *rl, const char *user,
+                                        const char *host, const char *chan, int cost);
+
+#endif // prbot_ratelimit_h__
@@ -0,0 +1,92 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Loads the example in config.h, exactly as it is written there, and checks
+// that every setting in it comes through.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "test.h"
+
+// Copies the example out of config.h's opening comment into |out|: the
+// indented lines after "For example:", with the comment markers taken off.
+static bool
+extract_example(const char *header, FILE *out)
+{
+    FILE *in = fopen(header, "r");
+    if (!in)
+        return false;
+
+    char line[256];
+    bool in_example = false;
+    int nlines = 0;
+    while (fgets(line, sizeof line, in)) {
+        if (in_example) {
+            if (strncmp(line, "//", 2) != 0)
+                break;
+            fputs(strncmp(line, "//   ", 5) == 0 ? line + 5 : "\n", out);
+            nlines++;
+        }
+        if (strncmp(line, "//", 2) == 0 && strstr(line, "For example:"))
+            in_example = true;
+    }
+    fclose(in);
+    return nlines > 0;
+}
+
+int
+main(void)
+{
+    char name[] = "/tmp/prbot_config_test.XXXXXX";
+    int fd = mkstemp(name);
+    FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!file)
+        return 1;
+    CHECK(extract_example("config.h", file));
+    fclose(file);
+
+    struct config config = { 0 };
+    CHECK(config_load(&config, name));
+    unlink(name);
+
+    CHECK(config.database && strcmp(config.database, "prbot.sqlite3") == 0);
+    CHECK(config.synchronous && strcmp(config.synchronous, "FULL") == 0);
+    CHECK(config.nnetworks == 1);
+    if (config.nnetworks == 1) {
+        struct config_network *network = &config.networks[0];
+        CHECK(strcmp(network->host, "irc.rizon.net") == 0);
+        CHECK(strcmp(network->port, "6667") == 0);
+        CHECK(strcmp(network->nick, "prbot") == 0);
+        CHECK(network->nchannels == 2);
+        CHECK(network->nchannels == 2 && strcmp(network->channels[1], "#fitness") == 0);
+        CHECK(network->flood_burst == 5);
+        CHECK(network->flood_interval_ms == 2000);
+        CHECK(network->keepalive_idle_ms == 30000);
+        CHECK(network->keepalive_timeout_ms == 15000);
+    }
+
+    config_free(&config);
+    TEST_DONE("config_test");
+}
@@ -0,0 +1,191 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks that once a handler closes the connection, nothing more is handled
+// on it and the per-connection tables stay freed, so a reconnect can't leak.
+// Built on prbot.c itself, to drive on_lines() and on_close() as they are.
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define main prbot_main
+#include "../prbot.c"
+#undef main
+
+// Connects |network| to a socket whose other end goes in |peer|. Without a
+// |peer|, nobody reads it, so the first reply sent fails and closes the
+// connection.
+static bool
+open_conn(struct network *network, int *peer)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        return false;
+    if (peer)
+        *peer = fds[1];
+    else
+        close(fds[1]);
+
+    set_nick(network, network->config->nick);
+    members_init(&network->members);
+    auth_init(&network->auth);
+    ratelimit_init(&network->limits);
+    network->conn.on_lines = on_lines;
+    network->conn.on_close = on_close;
+    network->conn.data = network;
+    return ircconn_init(&network->conn, network->loop, fds[0], network->buf, IRC_BUF_LEN);
+}
+
+static bool
+open_dead_conn(struct network *network)
+{
+    return open_conn(network, NULL);
+}
+
+static void
+feed(struct network *network, char **text, int n)
+{
+    struct ircline lines[16];
+    for (int i = 0; i < n; ++i) {
+        lines[i].text = text[i];
+        lines[i].len = strlen(text[i]);
+    }
+    on_lines(&network->conn, lines, n);
+}
+
+// How many lines |peer| has been sent so far that start with |prefix|.
+// Everything received is kept, so each call counts over all of it.
+static int
+replies(int peer, const char *prefix)
+{
+    static char buf[8192];
+    static int len;
+    ssize_t n = recv(peer, buf + len, sizeof buf - len - 1, MSG_DONTWAIT);
+    if (n > 0)
+        len += n;
+    buf[len] = '\0';
+
+    int count = 0;
+    for (const char *p = buf; (p = strstr(p, prefix)); p++)
+        count++;
+    return count;
+}
+
+static bool
+all_freed(struct network *network)
+{
+    return !ircconn_isopen(&network->conn) && network->members.nchans == 0 &&
+           network->members.strs == NULL && network->auth.cache == NULL &&
+           network->limits.table == NULL;
+}
+
+int
+main(void)
+{
+    struct ircloop loop;
+    if (!ircloop_init(&loop))
+        return 1;
+    commands_init();
+
+    struct config_network config = { "test", "6667", "prbot", NULL, 0, 0, -1, -1, 0 };
+    struct network network = { 0 };
+    network.config = &config;
+    network.loop = &loop;
+
+    // The PONG fails and closes the connection; the lines after it in the
+    // same read must not bring anything back.
+    char ping[] = "PING :x";
+    char join[] = ":prbot!u@h JOIN #c";
+    char names[] = ":srv 353 prbot = #c :prbot alice bob";
+    char account[] = ":alice!u@h ACCOUNT alice";
+    char help[] = ":alice!u@h PRIVMSG #c :prbot: help";
+    char *lines[] = { ping, join, names, account, help };
+    CHECK(open_dead_conn(&network));
+    feed(&network, lines, 5);
+    CHECK(all_freed(&network));
+
+    // Likewise in the middle of an IRCv3 batch.
+    char start[] = "BATCH +b netsplit";
+    char bping[] = "@batch=b PING :x";
+    char bjoin[] = "@batch=b :prbot!u@h JOIN #c";
+    char baccount[] = "@batch=b :alice!u@h ACCOUNT alice";
+    char end[] = "BATCH -b";
+    char *batch[] = { start, bping, bjoin, baccount, end, account };
+    CHECK(open_dead_conn(&network));
+    feed(&network, batch, 6);
+    CHECK(all_freed(&network));
+
+    // Messages that reach the freed tables anyway are ignored.
+    members_join_self(&network.members, "#c");
+    members_names(&network.members, "#c", "alice bob");
+    auth_learn(&network.auth, "alice", "alice");
+    CHECK(ratelimit_charge(&network.limits, "u", "h", "#c", 1) == RATELIMIT_DROP);
+    CHECK(all_freed(&network));
+
+    // A netsplit's QUITs leave the channel together.
+    int peer;
+    CHECK(open_conn(&network, &peer));
+    char sjoin[] = ":prbot!u@h JOIN #c";
+    char snames[] = ":srv 353 prbot = #c :prbot alice bob carol";
+    char send[] = ":srv 366 prbot #c :End of /NAMES list.";
+    char split[] = "BATCH +s netsplit a.net b.net";
+    char quit1[] = "@batch=s :alice!u@h QUIT :a.net b.net";
+    char quit2[] = "@batch=s :bob!u@h QUIT :a.net b.net";
+    char splitend[] = "BATCH -s";
+    char *netsplit[] = { sjoin, snames, send, split, quit1, quit2, splitend };
+    feed(&network, netsplit, 7);
+    CHECK(ircconn_isopen(&network.conn));
+    CHECK(members_count(&network.members, "#c") == 2);
+
+    // Commands that don't exist or don't parse are charged, too: past the
+    // burst, one warning and then silence.
+    ircconn_set_flood(&network.conn, 100, 1);
+    char bogus[] = ":mallory!m@evil PRIVMSG #c :prbot: bogus";
+    char *spam[12];
+    for (int i = 0; i < 12; ++i)
+        spam[i] = strdup(i % 2 ? ":mallory!m@evil PRIVMSG #c :prbot: top" : bogus);
+    feed(&network, spam, 12);
+    for (int i = 0; i < 12; ++i)
+        free(spam[i]);
+    CHECK(replies(peer, "PRIVMSG #c :mallory: shut the fuck up.") == RATELIMIT_USER_BURST / 2);
+    CHECK(replies(peer, "PRIVMSG #c :mallory: usage: top ") == RATELIMIT_USER_BURST / 2);
+    CHECK(replies(peer, "PRIVMSG #c :mallory: slow down.") == 1);
+
+    // The bot knows itself, and queries to it, in either case form.
+    set_nick(&network, "pr[bot]");
+    CHECK(is_self(&network.conn, "PR{BOT}"));
+    char query[] = ":alice!a@h PRIVMSG pr{bot} :help record";
+    char *queries[] = { query };
+    feed(&network, queries, 1);
+    CHECK(replies(peer, "PRIVMSG alice :") == 1);
+    char *text = strdup("PR{bot}: help");
+    CHECK(skip_address(text, "pr[BOT]") == text + 9);
+    CHECK(skip_address(text, "pr[bo") == NULL);
+    free(text);
+
+    ircconn_close(&network.conn);
+    close(peer);
+    CHECK(all_freed(&network));
+
+    ircloop_free(&loop);
+    TEST_DONE("conn_test");
+}
@@ -0,0 +1,162 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks the leaderboards that `top` reads, and how best_prs and best_e1rms
+// follow new PRs, both one at a time and through a bulk import, and that the
+// PR cache agrees with them.
+
+#include <stdbool.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#include "db.h"
+#include "test.h"
+
+static int
+lift_id(const char *name)
+{
+    sqlite3_stmt *stmt = db_stmt(DB_LIFT_ID);
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    int id = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : -1;
+    db_stmt_done(stmt);
+    return id;
+}
+
+static bool
+record_lift(const char *nick, const char *lift, time_t date, int reps, double kgs)
+{
+    struct prbot_pr pr = { (char *) nick, (char *) lift, date, 1, reps, kgs };
+    return db_insert_pr(&pr);
+}
+
+static bool
+record(const char *nick, time_t date, int reps, double kgs)
+{
+    return record_lift(nick, "squat", date, reps, kgs);
+}
+
+// Writes the nicks on the lift's board, best first, into |out|, separated by
+// spaces. Returns how many there were.
+static int
+board(enum db_stmtid id, const char *lift, int limit, char *out, size_t len)
+{
+    int n = 0;
+    out[0] = '\0';
+    sqlite3_stmt *stmt = db_stmt(id);
+    sqlite3_bind_int(stmt, 1, lift_id(lift));
+    sqlite3_bind_int(stmt, 2, limit);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        size_t used = strlen(out);
+        snprintf(out + used, len - used, "%s%s", n++ ? " " : "",
+                 (const char *) sqlite3_column_text(stmt, 0));
+    }
+    db_stmt_done(stmt);
+    return n;
+}
+
+// The kgs of the nick's squat, as `records` would show it.
+static bool
+squat_row(const struct prbot_pr *pr, void *data)
+{
+    if (strcmp(pr->lift, "squat") == 0)
+        *(double *) data = pr->kgs;
+    return true;
+}
+
+static double
+records_squat(const char *nick)
+{
+    double kgs = -1;
+    CHECK(db_top_prs(nick, squat_row, &kgs));
+    return kgs;
+}
+
+// The first row of a leaderboard: its nick and kgs.
+static double
+leader(enum db_stmtid id, char *nick, size_t len)
+{
+    double kgs = -1;
+    sqlite3_stmt *stmt = db_stmt(id);
+    sqlite3_bind_int(stmt, 1, lift_id("squat"));
+    sqlite3_bind_int(stmt, 2, 5);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        snprintf(nick, len, "%s", (const char *) sqlite3_column_text(stmt, 0));
+        kgs = sqlite3_column_double(stmt, 4);
+    }
+    db_stmt_done(stmt);
+    return kgs;
+}
+
+int
+main(void)
+{
+    if (!db_open(":memory:", "FULL") || !db_migrate() || !db_prepare()) {
+        fprintf(stderr, "db_test: can't set up the database\n");
+        return 1;
+    }
+
+    CHECK(db_e1rm(1, 100) == 100);
+    CHECK(db_e1rm(5, 150) == 175);
+
+    // Each board in its order, stopping at the number asked for.
+    char nicks[256];
+    CHECK(record_lift("alice", "deadlift", 1000, 1, 200));
+    CHECK(record_lift("bob", "deadlift", 1000, 5, 180));   // e1RM 210.
+    CHECK(record_lift("carol", "deadlift", 1000, 3, 190)); // e1RM 209.
+    CHECK(board(DB_TOP_BY_KGS, "deadlift", 5, nicks, sizeof nicks) == 3);
+    CHECK(strcmp(nicks, "alice carol bob") == 0);
+    CHECK(board(DB_TOP_BY_E1RM, "deadlift", 5, nicks, sizeof nicks) == 3);
+    CHECK(strcmp(nicks, "bob carol alice") == 0);
+    CHECK(board(DB_TOP_BY_KGS, "deadlift", 2, nicks, sizeof nicks) == 2);
+    CHECK(strcmp(nicks, "alice carol") == 0);
+
+    char nick[64];
+
+    // A newer, lighter PR must not replace an older, heavier one.
+    CHECK(record("alice", 1000, 1, 200));
+    CHECK(records_squat("alice") == 200); // Now cached.
+    CHECK(record("alice", 2000, 1, 150));
+    CHECK(records_squat("alice") == 200);
+    CHECK(record("bob", 1500, 1, 180));
+    CHECK(leader(DB_TOP_BY_KGS, nick, sizeof nick) == 200 && strcmp(nick, "alice") == 0);
+
+    // A lighter PR with more reps can still be the best e1RM.
+    CHECK(record("bob", 3000, 5, 190)); // e1RM 221.7, past alice's 200.
+    CHECK(leader(DB_TOP_BY_KGS, nick, sizeof nick) == 200 && strcmp(nick, "alice") == 0);
+    CHECK(leader(DB_TOP_BY_E1RM, nick, sizeof nick) == 190 && strcmp(nick, "bob") == 0);
+    CHECK(records_squat("bob") == 190);
+
+    // A heavier one does replace it.
+    CHECK(record("alice", 4000, 1, 210));
+    CHECK(records_squat("alice") == 210);
+
+    // Bulk imports follow the same rules.
+    struct prbot_pr heavy = { "carol", "squat", 1000, 1, 1, 250 };
+    struct prbot_pr light = { "carol", "squat", 2000, 1, 3, 230 };
+    CHECK(db_import_begin());
+    CHECK(db_import_pr(&heavy, lift_id("squat")));
+    CHECK(db_import_pr(&light, lift_id("squat")));
+    CHECK(db_import_end(true));
+    CHECK(leader(DB_TOP_BY_KGS, nick, sizeof nick) == 250 && strcmp(nick, "carol") == 0);
+    CHECK(leader(DB_TOP_BY_E1RM, nick, sizeof nick) == 230 && strcmp(nick, "carol") == 0);
+
+    db_close();
+    TEST_DONE("db_test");
+}
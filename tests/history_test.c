@@ -0,0 +1,159 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks that `history` pages through a nick's PRs newest first, whether the
+// pages are walked in order or jumped to. Built on prbot.c itself, to run
+// history_run() as it is, on this thread.
+
+#include "test.h"
+
+#define main prbot_main
+#include "../prbot.c"
+#undef main
+
+// 2024-01-01, and a day.
+#define DAY0 1704067200
+#define DAY 86400
+
+// The lines of the last page served, joined, or its error.
+static char served[4096];
+
+static void
+page_done(struct db_job *job)
+{
+    struct history_job *hj = (struct history_job *) job;
+    served[0] = '\0';
+    if (!hj->ok || hj->error) {
+        snprintf(served, sizeof served, "%s", hj->ok ? hj->error : "failed");
+    } else {
+        const char *line = hj->reply.lines;
+        for (int i = 0; i < hj->reply.nlines; ++i) {
+            strncat(served, line, sizeof served - strlen(served) - 1);
+            line += strlen(line) + 1;
+        }
+    }
+    free(hj->reply.lines);
+    free(hj);
+}
+
+// Serves page |page| of |nick|'s squat history into |served|.
+static const char *
+history(const char *nick, int page)
+{
+    struct history_job *hj = calloc(1, sizeof *hj);
+    snprintf(hj->to.chan, sizeof hj->to.chan, "#c");
+    snprintf(hj->to.nick, sizeof hj->to.nick, "tester");
+    snprintf(hj->nick, sizeof hj->nick, "%s", nick);
+    hj->lift = lifts_find("squat", 5);
+    hj->page = page;
+    hj->job.run = history_run;
+    hj->job.done = page_done;
+    history_run(&hj->job);
+    db_reap();
+    return served;
+}
+
+// How many entries the text of a page lists.
+static int
+entries(const char *text)
+{
+    int n = 0;
+    for (const char *p = text; (p = strstr(p, "| ")); p += 2)
+        n++;
+    return n;
+}
+
+// Whether the page lists the PR of January |day| first.
+static bool
+starts_on(const char *text, int day)
+{
+    char date[16];
+    snprintf(date, sizeof date, "| 2024-01-%02d ", day);
+    const char *first = strstr(text, "| ");
+    return first && strncmp(first, date, strlen(date)) == 0;
+}
+
+static bool rj_ok;
+
+static void
+recorded(struct db_job *job)
+{
+    rj_ok = ((struct record_job *) job)->ok;
+    free(job);
+}
+
+static bool
+record(int day, int reps, double kgs)
+{
+    struct prbot_pr pr = { "alice", "squat", DAY0 + (day - 1) * DAY, 1, reps, kgs };
+    return db_insert_pr(&pr);
+}
+
+int
+main(void)
+{
+    if (!db_open(":memory:", "FULL") || !db_migrate() || !db_prepare() || !lifts_load()) {
+        fprintf(stderr, "history_test: can't set up the database\n");
+        return 1;
+    }
+
+    // January 1st to 25th: three pages, the last one short.
+    for (int day = 1; day <= 25; ++day)
+        CHECK(record(day, day == 10 ? 5 : 1, 100 + day));
+
+    const char *text = history("alice", 1);
+    CHECK(strstr(text, "squat history for alice, page 1, best e1RM 128.3kg"));
+    CHECK(entries(text) == 10 && starts_on(text, 25));
+    text = history("alice", 2);
+    CHECK(entries(text) == 10 && starts_on(text, 15));
+    CHECK(strstr(text, "| 2024-01-10 110.0kg 1x5 (e1RM 128.3) "));
+    text = history("alice", 3);
+    CHECK(entries(text) == 5 && starts_on(text, 5) && strstr(text, "| 2024-01-01 "));
+
+    // Jumping straight to a page, with no cursor to go on, finds the same one.
+    memset(history_cursors, 0, sizeof history_cursors);
+    text = history("alice", 3);
+    CHECK(entries(text) == 5 && starts_on(text, 5));
+    text = history("alice", 2);
+    CHECK(entries(text) == 10 && starts_on(text, 15));
+
+    CHECK(strcmp(history("alice", 4), "there aren't that many pages") == 0);
+
+    // A PR recorded the way the bot does moves every page along by one,
+    // though their cursors were all remembered.
+    history("alice", 2);
+    history("alice", 3);
+    struct record_job *rj = calloc(1, sizeof *rj);
+    struct prbot_pr pr = { "alice", "squat", DAY0 + 25 * DAY, 1, 1, 90 };
+    rj->pr = pr;
+    rj->job.run = record_run;
+    rj->job.done = recorded;
+    record_run(&rj->job);
+    text = history("alice", 2);
+    CHECK(entries(text) == 10 && starts_on(text, 16));
+    CHECK(rj_ok);
+    text = history("alice", 3);
+    CHECK(entries(text) == 6 && starts_on(text, 6));
+    CHECK(strcmp(history("bob", 1), "no history for that") == 0);
+
+    db_close();
+    lifts_free();
+    TEST_DONE("history_test");
+}
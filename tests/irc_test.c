@@ -0,0 +1,202 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks the IRCv3 additions to the parser (message tags, capability
+// negotiation and batches) and how output is queued and paced. Batched lines
+// must come back whole, tags and all, and what a connection holds back in
+// open batches is bounded.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "irc.h"
+#include "test.h"
+
+// Parses |text| into |msg|, out of a buffer of its own that stays valid.
+static void
+parse(const char *text, struct ircmsg *msg)
+{
+    static char buf[16][512];
+    static int next;
+    char *copy = buf[next++ % 16];
+    snprintf(copy, sizeof buf[0], "%s", text);
+    irc_parseline(copy, strlen(copy), msg);
+}
+
+// Whether |peer| has been sent exactly |expected|.
+static bool
+sent(int peer, const char *expected)
+{
+    char buf[1024];
+    ssize_t len = recv(peer, buf, sizeof buf - 1, MSG_DONTWAIT);
+    if (len < 0)
+        len = 0;
+    buf[len] = '\0';
+    return strcmp(buf, expected) == 0;
+}
+
+// Feeds one line through irc_batch_collect(), as on_lines() would.
+static bool
+collect(struct ircconn *conn, const char *text, struct ircmsg *msg)
+{
+    static char buf[16][512];
+    static int next;
+    char *copy = buf[next++ % 16];
+    snprintf(copy, sizeof buf[0], "%s", text);
+    struct ircline line = { copy, strlen(copy) };
+    return irc_batch_collect(conn, &line, msg);
+}
+
+int
+main(void)
+{
+    struct ircmsg msg;
+
+    // Tags are split off, and their values unescaped.
+    parse("@account=alice;note=a\\sb\\:c;flag :alice!u@h PRIVMSG #c :hi", &msg);
+    CHECK(msg.type == IRCMSG_PRIVMSG && msg.ntags == 3);
+    CHECK(strcmp(msg.name.nick.s, "alice") == 0);
+    struct ircslice *tag = irc_tag(&msg, "account");
+    CHECK(tag && strcmp(tag->s, "alice") == 0);
+    tag = irc_tag(&msg, "note");
+    CHECK(tag && strcmp(tag->s, "a b;c") == 0);
+    tag = irc_tag(&msg, "flag");
+    CHECK(tag && tag->len == 0);
+    CHECK(irc_tag(&msg, "time") == NULL);
+
+    parse(":alice!u@h PRIVMSG #c :no tags", &msg);
+    CHECK(msg.type == IRCMSG_PRIVMSG && msg.ntags == 0);
+
+    // Negotiation asks only for what is both offered and known, then ends.
+    struct ircloop loop;
+    int fds[2];
+    if (!ircloop_init(&loop) || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        return 1;
+    static char inbuf[4096];
+    struct ircconn conn;
+    memset(&conn, 0, sizeof conn);
+    CHECK(ircconn_init(&conn, &loop, fds[0], inbuf, sizeof inbuf));
+    CHECK(irc_nick(&conn, "prbot", NULL));
+    CHECK(sent(fds[1], "CAP LS 302\r\nNICK prbot\r\nUSER prbot 0 * : prbot\r\n"));
+
+    parse(":srv CAP * LS * :sasl=PLAIN message-tags", &msg);
+    CHECK(msg.type == IRCMSG_CAP && irc_cap_handle(&conn, &msg));
+    CHECK(sent(fds[1], ""));
+    parse(":srv CAP * LS :batch multi-prefix", &msg);
+    CHECK(irc_cap_handle(&conn, &msg));
+    CHECK(sent(fds[1], "CAP REQ :message-tags batch\r\n"));
+    parse(":srv CAP prbot ACK :message-tags batch", &msg);
+    CHECK(irc_cap_handle(&conn, &msg));
+    CHECK(conn.caps == (IRCCAP_MESSAGE_TAGS | IRCCAP_BATCH));
+    CHECK(sent(fds[1], "CAP END\r\n"));
+
+    // Held back until the batch closes, then replayed with every tag.
+    CHECK(collect(&conn, "BATCH +a netsplit", &msg));
+    CHECK(collect(&conn, "@batch=a;account=alice;time=2024-01-01T00:00:00Z :alice!u@h QUIT :x",
+                  &msg));
+    CHECK(collect(&conn, "@batch=a :bob!u@h QUIT :y", &msg));
+    CHECK(!collect(&conn, ":carol!u@h PRIVMSG #c :not batched", &msg));
+    CHECK(msg.type == IRCMSG_PRIVMSG);
+    CHECK(!collect(&conn, "BATCH -a", &msg));
+    CHECK(msg.type == IRCMSG_BATCH && msg.u.batch.nlines == 2);
+    if (msg.type == IRCMSG_BATCH && msg.u.batch.nlines == 2) {
+        struct ircmsg quit;
+        irc_batch_line(&msg.u.batch, 0, &quit);
+        CHECK(quit.type == IRCMSG_QUIT && strcmp(quit.name.nick.s, "alice") == 0);
+        struct ircslice *account = irc_tag(&quit, "account");
+        CHECK(account && strcmp(account->s, "alice") == 0);
+        CHECK(irc_tag(&quit, "time") != NULL);
+        irc_batch_line(&msg.u.batch, 1, &quit);
+        CHECK(quit.type == IRCMSG_QUIT && strcmp(quit.name.nick.s, "bob") == 0);
+    }
+    CHECK(conn.nbatches == 0 && conn.batched_lines == 0 && conn.batched_bytes == 0);
+
+    // Past the line limit, lines are dispatched on their own.
+    CHECK(collect(&conn, "BATCH +b netsplit", &msg));
+    int held = 0;
+    for (int i = 0; i < IRCBATCH_MAX_LINES + 10; ++i)
+        held += collect(&conn, "@batch=b :x!u@h QUIT :z", &msg);
+    CHECK(held == IRCBATCH_MAX_LINES);
+    CHECK(!collect(&conn, "BATCH -b", &msg));
+    CHECK(msg.u.batch.nlines == IRCBATCH_MAX_LINES);
+
+    // So are the lines of batches opened past the limit on open batches.
+    char line[64];
+    for (int i = 0; i <= IRCBATCH_MAX_OPEN; ++i) {
+        snprintf(line, sizeof line, "BATCH +c%d netsplit", i);
+        CHECK(collect(&conn, line, &msg));
+    }
+    CHECK(conn.nbatches == IRCBATCH_MAX_OPEN);
+    snprintf(line, sizeof line, "@batch=c%d :x!u@h QUIT :z", IRCBATCH_MAX_OPEN);
+    CHECK(!collect(&conn, line, &msg));
+    CHECK(collect(&conn, "@batch=c0 :x!u@h QUIT :z", &msg));
+
+    for (int i = 0; i < IRCBATCH_MAX_OPEN; ++i) {
+        snprintf(line, sizeof line, "BATCH -c%d", i);
+        CHECK(!collect(&conn, line, &msg));
+    }
+    CHECK(conn.nbatches == 0 && conn.batched_lines == 0 && conn.batched_bytes == 0);
+    CHECK(collect(&conn, "BATCH +d netsplit", &msg));
+    CHECK(!collect(&conn, "BATCH -d", &msg));
+    CHECK(collect(&conn, "PING :done", &msg) == false); // Frees the last group.
+
+    // A PING token longer than a line can hold is echoed cut short.
+    ircconn_set_flood(&conn, 5, 60000);
+    char token[1000];
+    memset(token, 'x', sizeof token - 1);
+    token[sizeof token - 1] = '\0';
+    char pong[IRC_LINE_MAX * 2];
+    snprintf(pong, sizeof pong, "PONG :%.*s\r\n", IRC_LINE_MAX - 8, token);
+    CHECK(irc_pong(&conn, token));
+    CHECK(sent(fds[1], pong));
+    CHECK(irc_send(&conn, "PING :%s\r\nPONG :y\r\n", token));
+    snprintf(pong, sizeof pong, "PING :%.*s\r\nPONG :y\r\n", IRC_LINE_MAX - 8, token);
+    CHECK(sent(fds[1], pong));
+
+    // So is a reply that quotes it, and a line break ends the reply.
+    char privmsg[IRC_LINE_MAX * 2];
+    snprintf(privmsg, sizeof privmsg, "PRIVMSG #l :\"%.*s\r\n", IRC_LINE_MAX - 15, token);
+    CHECK(irc_privmsg(&conn, "#l", "\"%s\" is a real lift", token));
+    CHECK(sent(fds[1], privmsg));
+    CHECK(irc_privmsg(&conn, "#l", "one\r\nQUIT"));
+    CHECK(sent(fds[1], "PRIVMSG #l :one\r\n"));
+
+    // Past the flood bucket, lines wait: protocol traffic first, then one
+    // line per target in turn.
+    ircconn_set_flood(&conn, 1, 60000);
+    CHECK(irc_privmsg(&conn, "#a", "a1"));
+    CHECK(irc_privmsg(&conn, "#a", "a2"));
+    CHECK(irc_privmsg(&conn, "#a", "a3"));
+    CHECK(irc_privmsg(&conn, "#b", "b1"));
+    CHECK(sent(fds[1], "PRIVMSG #a :a1\r\n"));
+    CHECK(irctimer_pending(&conn.flood_timer));
+    ircconn_set_flood(&conn, 3, 60000);
+    CHECK(irc_send(&conn, "PONG :x\r\n"));
+    CHECK(sent(fds[1], "PONG :x\r\nPRIVMSG #a :a2\r\nPRIVMSG #b :b1\r\n"));
+    CHECK(conn.targets && conn.targets == conn.targets_tail);
+
+    ircconn_close(&conn);
+    close(fds[1]);
+    ircloop_free(&loop);
+    TEST_DONE("irc_test");
+}
@@ -0,0 +1,134 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Follows a channel through NAMES, JOIN, PART, KICK, QUIT and NICK, and
+// checks who the members table thinks is in it at each step.
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "irc.h"
+#include "members.h"
+#include "test.h"
+
+static bool
+count_nick(const char *nick, void *data)
+{
+    (void) nick;
+    ++*(int *) data;
+    return true;
+}
+
+struct find {
+    const char *nick;
+    bool found;
+};
+
+static bool
+find_nick(const char *nick, void *data)
+{
+    struct find *f = data;
+    f->found = irc_name_equal(nick, f->nick);
+    return !f->found;
+}
+
+// Whether members_each() visits |nick| in |chan|.
+static bool
+has(struct members *m, const char *chan, const char *nick)
+{
+    struct find f = { nick, false };
+    members_each(m, chan, find_nick, &f);
+    return f.found;
+}
+
+// How many nicks members_each() visits in |chan|.
+static int
+each_count(struct members *m, const char *chan)
+{
+    int n = 0;
+    members_each(m, chan, count_nick, &n);
+    return n;
+}
+
+int
+main(void)
+{
+    struct members m;
+    members_init(&m);
+
+    // Not known until the bot has joined and NAMES has ended.
+    CHECK(members_count(&m, "#c") == -1);
+    members_join(&m, "#c", "alice", "a", "host");
+    CHECK(!has(&m, "#c", "alice"));
+    members_join_self(&m, "#c");
+    members_names(&m, "#c", "@prbot +alice!a@host @+bob!b@other carol");
+    CHECK(members_count(&m, "#c") == -1);
+    members_names_end(&m, "#c");
+    CHECK(members_count(&m, "#c") == 4);
+    CHECK(has(&m, "#c", "alice") && has(&m, "#c", "bob"));
+    CHECK(!has(&m, "#c", "@prbot") && !has(&m, "#c", "+alice"));
+    const char *userhost = members_userhost(&m, "bob");
+    CHECK(userhost && strcmp(userhost, "b@other") == 0);
+    CHECK(members_userhost(&m, "carol") == NULL);
+
+    // RFC 1459 casemapping.
+    members_join(&m, "#c", "dave[away]", "d", "host");
+    CHECK(has(&m, "#c", "DAVE{AWAY}"));
+    CHECK(members_count(&m, "#c") == 5);
+
+    // A second channel shares the nicks.
+    members_join_self(&m, "#d");
+    members_names(&m, "#d", "prbot alice bob");
+    members_names_end(&m, "#d");
+    CHECK(members_count(&m, "#d") == 3);
+
+    members_part(&m, "#c", "carol");
+    CHECK(!has(&m, "#c", "carol") && members_count(&m, "#c") == 4);
+    members_rename(&m, "alice", "alicia");
+    CHECK(!has(&m, "#c", "alice") && has(&m, "#c", "alicia"));
+    CHECK(has(&m, "#d", "alicia"));
+    userhost = members_userhost(&m, "alicia");
+    CHECK(userhost && strcmp(userhost, "a@host") == 0);
+    members_quit(&m, "bob");
+    CHECK(!has(&m, "#c", "bob") && !has(&m, "#d", "bob"));
+    CHECK(members_count(&m, "#c") == 3 && members_count(&m, "#d") == 2);
+    CHECK(each_count(&m, "#c") == 3 && each_count(&m, "#d") == 2);
+    CHECK(members_userhost(&m, "bob") == NULL);
+
+    // A netsplit's QUITs at once, with a repeat and a stranger among them.
+    members_join(&m, "#c", "eve", "e", "host");
+    members_join(&m, "#d", "eve", "e", "host");
+    members_join(&m, "#c", "frank", NULL, NULL);
+    const char *split[] = { "eve", "FRANK", "nobody", "eve" };
+    members_quit_many(&m, split, 4);
+    CHECK(!has(&m, "#c", "eve") && !has(&m, "#d", "eve"));
+    CHECK(!has(&m, "#c", "frank"));
+    CHECK(members_count(&m, "#c") == 3 && members_count(&m, "#d") == 2);
+    CHECK(each_count(&m, "#c") == 3 && each_count(&m, "#d") == 2);
+    CHECK(members_userhost(&m, "eve") == NULL);
+
+    // Leaving forgets the channel.
+    members_leave_self(&m, "#d");
+    CHECK(members_count(&m, "#d") == -1 && !has(&m, "#d", "alicia"));
+    CHECK(has(&m, "#c", "alicia"));
+
+    members_free(&m);
+    TEST_DONE("members_test");
+}
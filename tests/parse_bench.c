@@ -0,0 +1,148 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Times tryparse_pr() against the POSIX regex parser it replaced, after
+// checking that the two agree on what the old one accepted. The timings are
+// only reported: nothing fails for being slow.
+
+#include <ctype.h>
+#include <math.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "parse.h"
+#include "test.h"
+
+// The old parser, as it was in prbot.c.
+static const char NEW_PR_PATTERN[] = "^(.+) of ([0-9]+)(\\.[0-9]+)?(kg|lb) ([0-9]+)x([0-9]+)";
+static regex_t new_pr_regex;
+
+static bool
+regex_tryparse_pr(char *msg, struct prbot_pr *pr)
+{
+#define NUM_MATCHES 7
+    regmatch_t matches[NUM_MATCHES];
+    if (regexec(&new_pr_regex, msg, NUM_MATCHES, matches, 0))
+        return false;
+
+    bool needs_conv_from_lb = msg[matches[4].rm_so] == 'l';
+    for (size_t i = 0; i < NUM_MATCHES; ++i) {
+        if (i != 2)
+            msg[matches[i].rm_eo] = '\0';
+    }
+#undef NUM_MATCHES
+
+    pr->lift = msg + matches[1].rm_so;
+    for (char *c = pr->lift; *c != '\0'; ++c)
+        *c = tolower(*c);
+    pr->kgs = atof(msg + matches[2].rm_so);
+    if (needs_conv_from_lb)
+        pr->kgs = lb2kg(pr->kgs);
+    pr->sets = atoi(msg + matches[5].rm_so);
+    pr->reps = atoi(msg + matches[6].rm_so);
+    return true;
+}
+
+static const char *INPUTS[] = {
+    "squat of 100kg 5x5",
+    "Bench Press of 225lb 3x5",
+    "deadlift of 182.5kg 1x1",
+    "overhead press of 60kg 5x3 felt heavy today",
+    "front squat of 315.25lb 2x8",
+    "power clean of 80kg 3x2",
+    "I did a squat yesterday, it was great",
+    "squat 5x5",
+    "what's the best way to improve my bench press of all time?",
+};
+#define NINPUTS ((int) (sizeof INPUTS / sizeof *INPUTS))
+
+typedef bool (*parser)(char *msg, struct prbot_pr *pr);
+
+static double
+now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Nanoseconds per parse of |input|, over |iters| runs on fresh copies.
+static double
+time_parser(parser parse, const char *input, int iters)
+{
+    char buf[256];
+    struct prbot_pr pr;
+    int accepted = 0;
+    double start = now_s();
+    for (int i = 0; i < iters; ++i) {
+        strcpy(buf, input);
+        accepted += parse(buf, &pr);
+    }
+    double elapsed = now_s() - start;
+    if (accepted < 0) // Keeps the calls from being optimized out.
+        puts("");
+    return elapsed * 1e9 / iters;
+}
+
+int
+main(void)
+{
+    if (regcomp(&new_pr_regex, NEW_PR_PATTERN, REG_EXTENDED))
+        return 1;
+
+    // Wherever the regex accepted a PR, the new parser reads the same one.
+    for (int i = 0; i < NINPUTS; ++i) {
+        char a[256], b[256];
+        struct prbot_pr old, new;
+        strcpy(a, INPUTS[i]);
+        strcpy(b, INPUTS[i]);
+        if (!regex_tryparse_pr(a, &old))
+            continue;
+        CHECK(tryparse_pr(b, &new));
+        CHECK(strcmp(old.lift, new.lift) == 0);
+        CHECK(old.sets == new.sets && old.reps == new.reps);
+        CHECK(fabs(old.kgs - new.kgs) < 1e-9 * old.kgs);
+    }
+
+    // The ordinary chatter the bot is addressed with most, and a long line
+    // that gives the regex's leading (.+) plenty to backtrack over.
+    char chatter[256];
+    memset(chatter, 'a', 200);
+    strcpy(chatter + 200, " of 100 kilos");
+
+    const int iters = 20000;
+    double regex_ns = 0, hand_ns = 0;
+    for (int i = 0; i < NINPUTS; ++i) {
+        regex_ns += time_parser(regex_tryparse_pr, INPUTS[i], iters) / NINPUTS;
+        hand_ns += time_parser(tryparse_pr, INPUTS[i], iters) / NINPUTS;
+    }
+    fprintf(stderr, "parse_bench: typical input: regex %.0f ns, by hand %.0f ns\n",
+            regex_ns, hand_ns);
+    fprintf(stderr, "parse_bench: 213-byte non-PR: regex %.0f ns, by hand %.0f ns\n",
+            time_parser(regex_tryparse_pr, chatter, iters / 10),
+            time_parser(tryparse_pr, chatter, iters / 10));
+
+    regfree(&new_pr_regex);
+    TEST_DONE("parse_bench");
+}
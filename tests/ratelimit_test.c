@@ -0,0 +1,70 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks the per-user and per-channel buckets: how much each lets through,
+// the single warning, and that a refused command costs nothing.
+
+#include <stdio.h>
+
+#include "ratelimit.h"
+#include "test.h"
+
+int
+main(void)
+{
+    struct ratelimit rl;
+    ratelimit_init(&rl);
+
+    // A user's burst, then one warning, then silence.
+    for (int i = 0; i < RATELIMIT_USER_BURST / 2; ++i)
+        CHECK(ratelimit_charge(&rl, "alice", "host", "#c", 2) == RATELIMIT_OK);
+    CHECK(ratelimit_charge(&rl, "alice", "host", "#c", 2) == RATELIMIT_WARN);
+    CHECK(ratelimit_charge(&rl, "alice", "host", "#c", 1) == RATELIMIT_DROP);
+    CHECK(ratelimit_charge(&rl, "alice", "host", NULL, 1) == RATELIMIT_DROP);
+
+    // Keyed by user@host, casemapped, in any channel.
+    CHECK(ratelimit_charge(&rl, "ALICE", "HOST", "#d", 1) == RATELIMIT_DROP);
+    CHECK(ratelimit_charge(&rl, "bob", "host", "#c", 2) == RATELIMIT_OK);
+
+    // A channel's bucket is shared by everyone in it.
+    char user[16];
+    int spent = 0;
+    for (int i = 0; spent + 2 <= RATELIMIT_CHAN_BURST; ++i, spent += 2) {
+        snprintf(user, sizeof user, "u%d", i);
+        CHECK(ratelimit_charge(&rl, user, "host", "#busy", 2) == RATELIMIT_OK);
+    }
+    CHECK(ratelimit_charge(&rl, "carol", "host", "#busy", 2) == RATELIMIT_WARN);
+    CHECK(ratelimit_charge(&rl, "dave", "host", "#busy", 2) == RATELIMIT_DROP);
+
+    // Neither was charged for that, so each still has a whole burst.
+    for (int i = 0; i < RATELIMIT_USER_BURST; ++i) {
+        CHECK(ratelimit_charge(&rl, "carol", "host", NULL, 1) == RATELIMIT_OK);
+        CHECK(ratelimit_charge(&rl, "dave", "host", "#quiet", 1) == RATELIMIT_OK);
+    }
+
+    // The table is bounded: strangers keep getting buckets of their own.
+    for (int i = 0; i < 4 * RATELIMIT_SLOTS; ++i) {
+        snprintf(user, sizeof user, "s%d", i);
+        CHECK(ratelimit_charge(&rl, user, "host", NULL, 1) == RATELIMIT_OK);
+    }
+
+    ratelimit_free(&rl);
+    TEST_DONE("ratelimit_test");
+}
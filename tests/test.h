@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// A minimal harness for the test programs under tests/: each one is a main()
+// that runs its checks and exits non-zero if any failed.
+
+#include <stdio.h>
+
+#ifndef prbot_test_h__
+#define prbot_test_h__
+
+static int test_failures;
+
+// Reports a failed |cond| and carries on, so one run shows every failure.
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond);                                                  \
+            test_failures++;                                                 \
+        }                                                                    \
+    } while (0)
+
+// Ends main(), reporting how it went.
+#define TEST_DONE(name)                                                      \
+    do {                                                                     \
+        fprintf(stderr, "%s: %s\n", name, test_failures ? "FAILED" : "ok");  \
+        return test_failures ? 1 : 0;                                        \
+    } while (0)
+
+#endif // prbot_test_h__
@@ -0,0 +1,192 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Runs the event loop's timer wheel for real: timers fire in order, never
+// early and at most a little late, cancelled ones never fire, and keepalive
+// drops a server that stops answering. Also connects for real, with the name
+// looked up off the loop.
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "irc.h"
+#include "test.h"
+
+// How late a timer may fire, on top of a tick, on a busy machine.
+#define SLACK_MS 100
+
+static long long
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+struct probe {
+    struct irctimer timer;
+    long long fired_ms; // 0 until it fires.
+    int order;
+};
+
+static int nfired;
+
+static void
+probe_fire(struct irctimer *timer)
+{
+    struct probe *p = timer->data;
+    p->fired_ms = now_ms();
+    p->order = ++nfired;
+}
+
+static void
+stop_fire(struct irctimer *timer)
+{
+    ircloop_stop(timer->data);
+}
+
+static void
+stop_on_close(struct ircconn *conn)
+{
+    ircloop_stop(conn->loop);
+}
+
+static int connected_fd;
+static int nconnected;
+
+static void
+on_connect(struct ircconnector *connector, int fd)
+{
+    connected_fd = fd;
+    nconnected++;
+    ircloop_stop(connector->data);
+}
+
+// Whether |p| fired |delay_ms| after |start|, give or take a tick.
+static bool
+on_time(struct probe *p, long long start, long delay_ms)
+{
+    long long late = p->fired_ms - (start + delay_ms);
+    return p->fired_ms && late >= 0 && late <= IRCWHEEL_TICK_MS + SLACK_MS;
+}
+
+int
+main(void)
+{
+    struct ircloop loop;
+    if (!ircloop_init(&loop))
+        return 1;
+
+    struct probe a, b, c, d;
+    struct irctimer stop;
+    irctimer_init(&a.timer, probe_fire, &a);
+    irctimer_init(&b.timer, probe_fire, &b);
+    irctimer_init(&c.timer, probe_fire, &c);
+    irctimer_init(&d.timer, probe_fire, &d);
+    irctimer_init(&stop, stop_fire, &loop);
+    a.fired_ms = b.fired_ms = c.fired_ms = d.fired_ms = 0;
+
+    // |b| is past what the first level spans, so it comes down a level first.
+    long long start = now_ms();
+    ircloop_schedule(&loop, &a.timer, 30);
+    ircloop_schedule(&loop, &b.timer, IRCWHEEL_SLOTS * IRCWHEEL_TICK_MS + 60);
+    ircloop_schedule(&loop, &c.timer, 20);
+    ircloop_schedule(&loop, &d.timer, 500);
+    ircloop_schedule(&loop, &d.timer, 10);
+    ircloop_cancel(&loop, &c.timer);
+    ircloop_schedule(&loop, &stop, IRCWHEEL_SLOTS * IRCWHEEL_TICK_MS + 100);
+    CHECK(loop.ntimers == 4);
+    CHECK(irctimer_pending(&a.timer) && !irctimer_pending(&c.timer));
+    ircloop_run(&loop);
+
+    CHECK(d.order == 1 && on_time(&d, start, 10));
+    CHECK(a.order == 2 && on_time(&a, start, 30));
+    CHECK(b.order == 3 && on_time(&b, start, IRCWHEEL_SLOTS * IRCWHEEL_TICK_MS + 60));
+    CHECK(c.fired_ms == 0);
+    CHECK(loop.ntimers == 0 && !irctimer_pending(&b.timer));
+
+    // A server that goes quiet is PINGed after |idle_ms|, and dropped
+    // |timeout_ms| after that.
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        return 1;
+    static char inbuf[4096];
+    struct ircconn conn;
+    memset(&conn, 0, sizeof conn);
+    conn.on_close = stop_on_close;
+    CHECK(ircconn_init(&conn, &loop, fds[0], inbuf, sizeof inbuf));
+    start = now_ms();
+    ircconn_set_keepalive(&conn, 50, 80);
+    ircloop_run(&loop);
+
+    long long elapsed = now_ms() - start;
+    CHECK(!ircconn_isopen(&conn));
+    CHECK(elapsed >= 130 && elapsed <= 130 + 2 * (IRCWHEEL_TICK_MS + SLACK_MS));
+    char buf[64];
+    ssize_t len = recv(fds[1], buf, sizeof buf - 1, MSG_DONTWAIT);
+    CHECK(len > 6 && strncmp(buf, "PING :", 6) == 0);
+    close(fds[1]);
+
+    // The lookup runs on its own, so the connector only calls back from the loop.
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addrlen = sizeof addr;
+    if (listener < 0 || bind(listener, (struct sockaddr *) &addr, sizeof addr) < 0 ||
+        listen(listener, 1) < 0 || getsockname(listener, (struct sockaddr *) &addr, &addrlen) < 0)
+    {
+        return 1;
+    }
+    char port[16];
+    snprintf(port, sizeof port, "%d", ntohs(addr.sin_port));
+
+    struct ircconnector connector;
+    memset(&connector, 0, sizeof connector);
+    connector.on_connect = on_connect;
+    connector.data = &loop;
+    ircloop_schedule(&loop, &stop, 5000);
+    CHECK(ircconnector_start(&connector, &loop, "127.0.0.1", port));
+    CHECK(ircconnector_busy(&connector) && nconnected == 0);
+    ircloop_run(&loop);
+    CHECK(nconnected == 1 && connected_fd >= 0 && !ircconnector_busy(&connector));
+    close(connected_fd);
+
+    // A name that doesn't resolve fails like an address that won't connect.
+    CHECK(ircconnector_start(&connector, &loop, "127.0.0.1", "no-such-service"));
+    ircloop_run(&loop);
+    CHECK(nconnected == 2 && connected_fd == -1 && !ircconnector_busy(&connector));
+
+    // An abandoned lookup never calls back.
+    CHECK(ircconnector_start(&connector, &loop, "127.0.0.1", port));
+    ircconnector_cancel(&connector);
+    CHECK(!ircconnector_busy(&connector));
+    ircloop_cancel(&loop, &stop);
+    ircloop_schedule(&loop, &stop, 100);
+    ircloop_run(&loop);
+    CHECK(nconnected == 2);
+    close(listener);
+
+    ircloop_free(&loop);
+    TEST_DONE("timer_test");
+}
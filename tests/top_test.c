@@ -0,0 +1,105 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 4 -*-
+ * vim: set ts=8 sts=4 et sw=4 tw=99:
+ * Copyright 2013 Sean Stangl (sean.stangl@gmail.com)
+ *
+ * This file is part of PRBot.
+ *
+ * PRBot is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PRBot is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PRBot.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks that `top ... here` ranks only who is in the channel, as the
+// membership tables have it. Built on prbot.c itself, to run top_run() as it
+// is, on this thread.
+
+#include "test.h"
+
+#define main prbot_main
+#include "../prbot.c"
+#undef main
+
+// The lines of the last leaderboard served, joined.
+static char served[4096];
+
+static void
+top_served(struct db_job *job)
+{
+    struct top_job *tj = (struct top_job *) job;
+    served[0] = '\0';
+    const char *line = tj->reply.lines;
+    for (int i = 0; tj->ok && i < tj->reply.nlines; ++i) {
+        strncat(served, line, sizeof served - strlen(served) - 1);
+        line += strlen(line) + 1;
+    }
+    free(tj->reply.lines);
+    free(tj);
+}
+
+// Serves the top |n| squatters of |chan|, or of everyone if |chan| is NULL.
+static const char *
+top(struct members *members, const char *chan, int n)
+{
+    struct top_job *tj = top_job_new(members, chan);
+    snprintf(tj->to.chan, sizeof tj->to.chan, "#c");
+    snprintf(tj->to.nick, sizeof tj->to.nick, "tester");
+    tj->lift_id = lifts_find("squat", 5)->id;
+    tj->n = n;
+    snprintf(tj->head, sizeof tj->head, "Top ");
+    tj->job.run = top_run;
+    tj->job.done = top_served;
+    top_run(&tj->job);
+    db_reap();
+    return served;
+}
+
+static bool
+record(const char *nick, double kgs)
+{
+    struct prbot_pr pr = { (char *) nick, "squat", 1704067200, 1, 1, kgs };
+    return db_insert_pr(&pr);
+}
+
+int
+main(void)
+{
+    if (!db_open(":memory:", "FULL") || !db_migrate() || !db_prepare() || !lifts_load()) {
+        fprintf(stderr, "top_test: can't set up the database\n");
+        return 1;
+    }
+
+    CHECK(record("alice", 100) && record("bob", 150) && record("Carol", 120) &&
+          record("dave", 90));
+
+    struct members members;
+    members_init(&members);
+    members_join_self(&members, "#c");
+    members_names(&members, "#c", "@prbot alice carol");
+    members_names_end(&members, "#c");
+
+    CHECK(strcmp(top(&members, NULL, 3),
+                 "Top | 1. bob 150.0kg 1x1 | 2. Carol 120.0kg 1x1 | 3. alice 100.0kg 1x1 ") == 0);
+
+    // Bob outlifts everyone, but isn't here. Nicks compare as IRC does.
+    CHECK(strcmp(top(&members, "#c", 5),
+                 "Top | 1. Carol 120.0kg 1x1 | 2. alice 100.0kg 1x1 ") == 0);
+    CHECK(strcmp(top(&members, "#c", 1), "Top | 1. Carol 120.0kg 1x1 ") == 0);
+
+    members_part(&members, "#c", "alice");
+    members_part(&members, "#c", "carol");
+    CHECK(strcmp(top(&members, "#c", 5), "Top | nobody yet") == 0);
+
+    members_free(&members);
+    db_close();
+    lifts_free();
+    TEST_DONE("top_test");
+}